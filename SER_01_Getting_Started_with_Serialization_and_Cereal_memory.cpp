@@ -0,0 +1,312 @@
+// SER_01 Getting started: in-memory archives without streams
+// ----------------------------------------------------------------------
+// SER_01_Getting_Started_with_Serialization_and_Cereal.cpp round-trips MyData
+// through a std::stringstream. cereal's binary archives talk to the
+// streambuf, i.e., every int costs a virtual sputn/sgetn call, and the
+// stringbuf grows (and copies) its buffer step by step.
+//
+// For snapshots kept in RAM we use a dedicated pair of archives instead:
+// - cereal::MemoryBuffer: contiguous, growable buffer. clear() keeps the
+//   capacity, so one buffer serves any number of snapshots; reserve() takes a
+//   size hint; the memory comes from a std::pmr::memory_resource, e.g., an
+//   arena (std::pmr::monotonic_buffer_resource) for many short-lived buffers
+// - cereal::MemoryOutputArchive appends to a MemoryBuffer
+// - cereal::MemoryInputArchive reads from a span of bytes (pointer and size)
+// Reads and writes are inlined memcpy calls, there is no streambuf layer.
+// The data layout is the one of cereal::BinaryOutputArchive.
+//
+// NOTE:
+// - MemoryInputArchive does not copy, the bytes have to outlive the archive.
+// - Reading past the end of the span throws a cereal::Exception.
+// ----------------------------------------------------------------------
+// [[Rcpp::plugins("cpp17")]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <memory_resource>
+#include <string>
+
+#include <cereal/cereal.hpp>
+#include <cereal/archives/binary.hpp>
+
+#include <Rcpp.h>
+
+
+namespace cereal
+{
+  class MemoryBuffer
+  {
+  public:
+    explicit MemoryBuffer( std::size_t reserve_hint = 0,
+                           std::pmr::memory_resource* resource = std::pmr::get_default_resource() ) :
+      itsResource( resource )
+    {
+      reserve( reserve_hint );
+    }
+
+    ~MemoryBuffer()
+    {
+      if( itsData ) {
+        itsResource->deallocate( itsData, itsCapacity );
+      }
+    }
+
+    MemoryBuffer( const MemoryBuffer& ) = delete;
+    MemoryBuffer& operator=( const MemoryBuffer& ) = delete;
+
+    void reserve( std::size_t capacity )
+    {
+      if( capacity > itsCapacity ) {
+        reallocate( capacity );
+      }
+    }
+
+    // Forgets the content, keeps the memory
+    void clear() { itsSize = 0; }
+
+    inline void append( const void* data, std::size_t n )
+    {
+      if( n == 0 ) {
+        return;   // e.g. empty strings, data may be a null pointer
+      }
+      if( n > itsCapacity - itsSize ) {
+        reallocate( std::max( { 2 * itsCapacity, itsSize + n, std::size_t( 256 ) } ) );
+      }
+      std::memcpy( itsData + itsSize, data, n );
+      itsSize += n;
+    }
+
+    const char* data() const { return itsData; }
+    std::size_t size() const { return itsSize; }
+    std::size_t capacity() const { return itsCapacity; }
+
+  private:
+    void reallocate( std::size_t capacity )
+    {
+      char* data = static_cast<char*>( itsResource->allocate( capacity ) );
+      if( itsSize > 0 ) {
+        std::memcpy( data, itsData, itsSize );
+      }
+      if( itsData ) {
+        itsResource->deallocate( itsData, itsCapacity );
+      }
+      itsData = data;
+      itsCapacity = capacity;
+    }
+
+    std::pmr::memory_resource* itsResource;
+    char* itsData = nullptr;
+    std::size_t itsSize = 0;
+    std::size_t itsCapacity = 0;
+  };
+
+
+  class MemoryOutputArchive : public OutputArchive<MemoryOutputArchive, AllowEmptyClassElision>
+  {
+  public:
+    // Appends to buffer, call buffer.clear() first to start a new snapshot
+    explicit MemoryOutputArchive( MemoryBuffer& buffer ) :
+      OutputArchive<MemoryOutputArchive, AllowEmptyClassElision>( this ),
+      itsBuffer( buffer )
+    { }
+
+    ~MemoryOutputArchive() CEREAL_NOEXCEPT = default;
+
+    inline void saveBinary( const void* data, std::size_t size )
+    {
+      itsBuffer.append( data, size );
+    }
+
+  private:
+    MemoryBuffer& itsBuffer;
+  };
+
+
+  class MemoryInputArchive : public InputArchive<MemoryInputArchive, AllowEmptyClassElision>
+  {
+  public:
+    MemoryInputArchive( const void* data, std::size_t size ) :
+      InputArchive<MemoryInputArchive, AllowEmptyClassElision>( this ),
+      itsPos( static_cast<const char*>( data ) ),
+      itsEnd( static_cast<const char*>( data ) + size )
+    { }
+
+    explicit MemoryInputArchive( MemoryBuffer const& buffer ) :
+      MemoryInputArchive( buffer.data(), buffer.size() )
+    { }
+
+    ~MemoryInputArchive() CEREAL_NOEXCEPT = default;
+
+    inline void loadBinary( void* const data, std::size_t size )
+    {
+      if( size > static_cast<std::size_t>( itsEnd - itsPos ) ) {
+        throw Exception( "Failed to read " + std::to_string( size ) + " bytes from memory! Remaining " +
+                         std::to_string( itsEnd - itsPos ) );
+      }
+      if( size == 0 ) {
+        return;
+      }
+      std::memcpy( data, itsPos, size );
+      itsPos += size;
+    }
+
+    // Bytes not read yet
+    std::size_t remaining() const { return static_cast<std::size_t>( itsEnd - itsPos ); }
+
+  private:
+    const char* itsPos;
+    const char* itsEnd;
+  };
+
+
+  // Common serialization functions, as for the cereal binary archives
+  // --------------------------------
+  template<class T> inline
+  typename std::enable_if<std::is_arithmetic<T>::value, void>::type
+  CEREAL_SAVE_FUNCTION_NAME( MemoryOutputArchive& ar, T const& t )
+  {
+    ar.saveBinary( std::addressof( t ), sizeof( t ) );
+  }
+
+  template<class T> inline
+  typename std::enable_if<std::is_arithmetic<T>::value, void>::type
+  CEREAL_LOAD_FUNCTION_NAME( MemoryInputArchive& ar, T& t )
+  {
+    ar.loadBinary( std::addressof( t ), sizeof( t ) );
+  }
+
+  template<class Archive, class T> inline
+  CEREAL_ARCHIVE_RESTRICT(MemoryInputArchive, MemoryOutputArchive)
+  CEREAL_SERIALIZE_FUNCTION_NAME( Archive& ar, NameValuePair<T>& t )
+  {
+    ar( t.value );
+  }
+
+  template<class Archive, class T> inline
+  CEREAL_ARCHIVE_RESTRICT(MemoryInputArchive, MemoryOutputArchive)
+  CEREAL_SERIALIZE_FUNCTION_NAME( Archive& ar, SizeTag<T>& t )
+  {
+    ar( t.size );
+  }
+
+  template<class T> inline
+  void CEREAL_SAVE_FUNCTION_NAME( MemoryOutputArchive& ar, BinaryData<T> const& bd )
+  {
+    ar.saveBinary( bd.data, static_cast<std::size_t>( bd.size ) );
+  }
+
+  template<class T> inline
+  void CEREAL_LOAD_FUNCTION_NAME( MemoryInputArchive& ar, BinaryData<T>& bd )
+  {
+    ar.loadBinary( bd.data, static_cast<std::size_t>( bd.size ) );
+  }
+}
+
+// register archives for polymorphic support
+CEREAL_REGISTER_ARCHIVE(cereal::MemoryOutputArchive)
+CEREAL_REGISTER_ARCHIVE(cereal::MemoryInputArchive)
+
+// tie input and output archives together
+CEREAL_SETUP_ARCHIVE_TRAITS(cereal::MemoryInputArchive, cereal::MemoryOutputArchive)
+
+
+// some "complex" data class
+class MyData
+{
+public:
+  MyData(){};
+
+  int x, y, z;
+
+  // let cereal know which data members to serialize
+  template<typename Archive>
+  void serialize(Archive& archive)
+  {
+    archive(x, y, z);
+  }
+
+};
+
+
+// [[Rcpp::export]]
+int main()
+{
+  cereal::MemoryBuffer buffer(1024); // reused for every snapshot
+
+  // serialization
+  // ----------------------------------------
+  {
+    cereal::MemoryOutputArchive oarchive(buffer);
+
+    MyData m1, m2, m3;
+    m1.x = 40; m1.y = 41; m1.z = 42;
+    m2.x = 50; m2.y = 51; m2.z = 52;
+    m3.x = 60; m3.y = 61; m3.z = 62;
+
+    oarchive(m1, m2, m3);
+  }
+  Rcpp::Rcout << "snapshot: " << buffer.size() << " bytes" << std::endl;
+
+  // deserialization
+  // ----------------------------------------
+  {
+    cereal::MemoryInputArchive iarchive(buffer.data(), buffer.size());
+
+    MyData m1, m2, m3;
+    iarchive(m1, m2, m3);
+
+    Rcpp::Rcout << "m1: " << m1.x << " " << m1.y << " " << m1.z << std::endl;
+    Rcpp::Rcout << "m2: " << m2.x << " " << m2.y << " " << m2.z << std::endl;
+    Rcpp::Rcout << "m3: " << m3.x << " " << m3.y << " " << m3.z << std::endl;
+  }
+
+  // small object round trips: std::stringstream vs. memory archives
+  // ----------------------------------------
+  {
+    using clock = std::chrono::steady_clock;
+    const int n = 1000000;
+    MyData in, out;
+    in.x = 1; in.y = 2; in.z = 3;
+    long long check1 = 0, check2 = 0;
+
+    auto t0 = clock::now();
+    for (int i = 0; i < n; ++i) {
+      in.x = i;
+      std::stringstream ss;
+      {
+        cereal::BinaryOutputArchive oarchive(ss);
+        oarchive(in);
+      }
+      cereal::BinaryInputArchive iarchive(ss);
+      iarchive(out);
+      check1 += out.x;
+    }
+    auto t1 = clock::now();
+
+    // an arena for the buffers, released at once at the end of the scope
+    std::pmr::monotonic_buffer_resource arena(1 << 16);
+    cereal::MemoryBuffer buf(64, &arena);
+    for (int i = 0; i < n; ++i) {
+      in.x = i;
+      buf.clear();
+      {
+        cereal::MemoryOutputArchive oarchive(buf);
+        oarchive(in);
+      }
+      cereal::MemoryInputArchive iarchive(buf);
+      iarchive(out);
+      check2 += out.x;
+    }
+    auto t2 = clock::now();
+
+    Rcpp::Rcout << "std::stringstream: " << std::chrono::duration<double>(t1 - t0).count() << " s" << std::endl;
+    Rcpp::Rcout << "memory archives:   " << std::chrono::duration<double>(t2 - t1).count() << " s" << std::endl;
+    Rcpp::Rcout << "same result: " << (check1 == check2) << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,613 @@
+// SER_02: Streaming JSON output archive
+// ----------------------------------------------------------------------------
+// cereal::JSONOutputArchive writes through a rapidjson PrettyWriter on top of
+// an OStreamWrapper, i.e., every token, indentation and quote ends up as a
+// small write on the std::ostream. For a lot of small, string heavy records
+// (like EmployeeData below) the writer is the bottleneck.
+//
+// cereal::StreamingJSONOutputArchive produces documents with the same
+// structure (object per class, array per container, names value0, value1, ...
+// for unnamed values), which load with cereal::JSONInputArchive, but
+// - collects the output in its own large buffer (1 MB by default) and hands
+//   it to the stream buffer in big chunks
+// - has a compact mode without any indentation or line breaks
+// - escapes strings with a SIMD kernel: 32 (AVX2) or 16 (SSE2) bytes are
+//   checked at once for '"', '\\' and control characters, runs of clean bytes
+//   are copied with one memcpy
+// - formats numbers with std::to_chars
+//
+// NOTE:
+// - Like for all cereal archives, the output is complete only once the
+//   archive is destroyed. Errors at that point cannot be reported, call
+//   flush() after the last value to get them as cereal::Exception.
+// - Compile with e.g. Sys.setenv(PKG_CXXFLAGS = "-march=native") for the AVX2
+//   kernel, SSE2 is always available on x86-64.
+// ----------------------------------------------------------------------------
+// [[Rcpp::plugins("cpp17")]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include <cereal/cereal.hpp>
+#include <cereal/access.hpp>
+#include <cereal/archives/json.hpp>
+#include <cereal/external/base64.hpp>
+#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
+
+#include <Rcpp.h>
+
+
+namespace cereal
+{
+  namespace streaming_json_detail
+  {
+    // Length of the prefix of s which can be copied without escaping, i.e.,
+    // contains no '"', '\\' or control character (< 0x20).
+    inline std::size_t clean_prefix( const char* s, std::size_t n )
+    {
+      std::size_t i = 0;
+#if defined(__AVX2__)
+      const __m256i quote = _mm256_set1_epi8( '"' );
+      const __m256i slash = _mm256_set1_epi8( '\\' );
+      const __m256i ctrl  = _mm256_set1_epi8( 0x1F );
+      for( ; i + 32 <= n; i += 32 ) {
+        const __m256i v = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( s + i ) );
+        const __m256i m = _mm256_or_si256(
+          _mm256_or_si256( _mm256_cmpeq_epi8( v, quote ), _mm256_cmpeq_epi8( v, slash ) ),
+          _mm256_cmpeq_epi8( _mm256_max_epu8( v, ctrl ), ctrl ) );   // v <= 0x1F
+        const std::uint32_t bits = static_cast<std::uint32_t>( _mm256_movemask_epi8( m ) );
+        if( bits != 0 ) {
+          return i + static_cast<std::size_t>( __builtin_ctz( bits ) );
+        }
+      }
+#endif
+#if defined(__SSE2__)
+      const __m128i quote16 = _mm_set1_epi8( '"' );
+      const __m128i slash16 = _mm_set1_epi8( '\\' );
+      const __m128i ctrl16  = _mm_set1_epi8( 0x1F );
+      for( ; i + 16 <= n; i += 16 ) {
+        const __m128i v = _mm_loadu_si128( reinterpret_cast<const __m128i*>( s + i ) );
+        const __m128i m = _mm_or_si128(
+          _mm_or_si128( _mm_cmpeq_epi8( v, quote16 ), _mm_cmpeq_epi8( v, slash16 ) ),
+          _mm_cmpeq_epi8( _mm_max_epu8( v, ctrl16 ), ctrl16 ) );
+        const unsigned bits = static_cast<unsigned>( _mm_movemask_epi8( m ) );
+        if( bits != 0 ) {
+          return i + static_cast<std::size_t>( __builtin_ctz( bits ) );
+        }
+      }
+#endif
+      for( ; i < n; ++i ) {
+        const unsigned char c = static_cast<unsigned char>( s[i] );
+        if( c < 0x20 || c == '"' || c == '\\' ) {
+          return i;
+        }
+      }
+      return n;
+    }
+  }
+
+
+  class StreamingJSONOutputArchive : public OutputArchive<StreamingJSONOutputArchive>, public traits::TextArchive
+  {
+    enum class NodeType { StartArray, InArray, StartObject, InObject };
+
+    struct Node
+    {
+      NodeType type;
+      std::uint32_t nameCounter;
+      bool empty;
+    };
+
+  public:
+    class Options
+    {
+    public:
+      // Pretty printed with 4 spaces, like cereal::JSONOutputArchive
+      static Options Default() { return Options(); }
+
+      // No indentation, no line breaks
+      static Options Compact() { return Options( true ); }
+
+      // compact: no whitespace at all
+      // bufferSize: bytes collected before they are handed to the stream
+      // indentLength: spaces per level when pretty printing
+      explicit Options( bool compact = false, std::size_t bufferSize = 1 << 20, unsigned indentLength = 4 ) :
+        itsCompact( compact ),
+        itsBufferSize( bufferSize < 1024 ? 1024 : bufferSize ),
+        itsIndentLength( indentLength )
+      { }
+
+    private:
+      friend class StreamingJSONOutputArchive;
+      bool itsCompact;
+      std::size_t itsBufferSize;
+      unsigned itsIndentLength;
+    };
+
+    explicit StreamingJSONOutputArchive( std::ostream& stream, Options const& options = Options::Default() ) :
+      OutputArchive<StreamingJSONOutputArchive>( this ),
+      itsStream( stream ),
+      itsBuffer( options.itsBufferSize ),
+      itsCompact( options.itsCompact ),
+      itsIndentLength( options.itsIndentLength )
+    {
+      itsNodes.push_back( Node{ NodeType::StartObject, 0, true } );
+    }
+
+    ~StreamingJSONOutputArchive() CEREAL_NOEXCEPT
+    {
+      try {
+        if( itsNodes.front().type == NodeType::InObject ) {
+          newline( 0 );
+          put( '}' );
+        }
+        flush();
+      } catch( ... ) { }
+    }
+
+    // Hands everything serialized so far to the stream
+    void flush()
+    {
+      sink( itsBuffer.data(), itsUsed );
+      itsUsed = 0;
+    }
+
+    // Interface used by the serialization functions below, the same as the
+    // one of cereal::JSONOutputArchive
+    // --------------------------------
+
+    void startNode()
+    {
+      writeName();
+      itsNodes.push_back( Node{ NodeType::StartObject, 0, true } );
+    }
+
+    void finishNode()
+    {
+      const Node n = itsNodes.back();
+      itsNodes.pop_back();
+
+      switch( n.type ) {
+        case NodeType::StartArray:  write( "[]", 2 ); break;
+        case NodeType::StartObject: write( "{}", 2 ); break;
+        case NodeType::InArray:     newline( itsNodes.size() ); put( ']' ); break;
+        case NodeType::InObject:    newline( itsNodes.size() ); put( '}' ); break;
+      }
+    }
+
+    void setNextName( const char* name ) { itsNextName = name; }
+
+    // The current node is written as an array
+    void makeArray() { itsNodes.back().type = NodeType::StartArray; }
+
+    // Opens the current node if needed, then writes the separator and, in
+    // objects, the name of the next value
+    void writeName()
+    {
+      Node& n = itsNodes.back();
+      if( n.type == NodeType::StartArray ) {
+        put( '[' );
+        n.type = NodeType::InArray;
+      } else if( n.type == NodeType::StartObject ) {
+        put( '{' );
+        n.type = NodeType::InObject;
+      }
+
+      if( !n.empty ) {
+        put( ',' );
+      }
+      n.empty = false;
+      newline( itsNodes.size() );
+
+      if( n.type == NodeType::InArray ) {
+        return;   // array elements have no names
+      }
+
+      if( itsNextName == nullptr ) {
+        char name[32] = "value";
+        const auto res = std::to_chars( name + 5, name + sizeof(name), n.nameCounter++ );
+        writeString( name, static_cast<std::size_t>( res.ptr - name ) );
+      } else {
+        writeString( itsNextName, std::strlen( itsNextName ) );
+        itsNextName = nullptr;
+      }
+
+      if( itsCompact ) {
+        put( ':' );
+      } else {
+        write( ": ", 2 );
+      }
+    }
+
+    void saveValue( bool b )
+    {
+      if( b ) {
+        write( "true", 4 );
+      } else {
+        write( "false", 5 );
+      }
+    }
+
+    void saveValue( std::string const& s ) { writeString( s.data(), s.size() ); }
+    void saveValue( char const* s ) { writeString( s, std::strlen( s ) ); }
+    void saveValue( std::nullptr_t ) { write( "null", 4 ); }
+
+    template<class T, traits::EnableIf<std::is_integral<T>::value,
+                                       !std::is_same<T, bool>::value> = traits::sfinae> inline
+    void saveValue( T t )
+    {
+      // char types are written as numbers, like in cereal
+      using U = typename std::conditional<std::is_signed<T>::value, std::int64_t, std::uint64_t>::type;
+      char* p = reserve( 24 );
+      itsUsed += static_cast<std::size_t>( std::to_chars( p, p + 24, static_cast<U>( t ) ).ptr - p );
+    }
+
+    template<class T, traits::EnableIf<std::is_floating_point<T>::value> = traits::sfinae> inline
+    void saveValue( T t )
+    {
+      if constexpr ( sizeof(T) > sizeof(double) ) {
+        // cereal writes long double as a string
+        char buf[64];
+        const auto res = std::to_chars( buf, buf + sizeof(buf), t );
+        writeString( buf, static_cast<std::size_t>( res.ptr - buf ) );
+        return;
+      } else {
+        if( std::isnan( t ) ) {
+          write( "NaN", 3 );
+          return;
+        }
+        if( std::isinf( t ) ) {
+          if( t < 0 ) {
+            write( "-Infinity", 9 );
+          } else {
+            write( "Infinity", 8 );
+          }
+          return;
+        }
+
+        char* p = reserve( 34 );
+        char* e = std::to_chars( p, p + 32, t ).ptr;
+        // integral values keep a ".0" to stay floating point, like rapidjson
+        if( std::find_if( p, e, []( char c ) { return c == '.' || c == 'e'; } ) == e ) {
+          *e++ = '.';
+          *e++ = '0';
+        }
+        itsUsed += static_cast<std::size_t>( e - p );
+      }
+    }
+
+    void saveBinaryValue( const void* data, size_t size, const char* name = nullptr )
+    {
+      setNextName( name );
+      writeName();
+      saveValue( base64::encode( reinterpret_cast<const unsigned char*>( data ), size ) );
+    }
+
+  private:
+    // Space for n bytes at the end of the buffer (n is small)
+    char* reserve( std::size_t n )
+    {
+      if( itsUsed + n > itsBuffer.size() ) {
+        flush();
+      }
+      return itsBuffer.data() + itsUsed;
+    }
+
+    void put( char c )
+    {
+      *reserve( 1 ) = c;
+      ++itsUsed;
+    }
+
+    void write( const char* data, std::size_t n )
+    {
+      if( itsUsed + n > itsBuffer.size() ) {
+        flush();
+        if( n >= itsBuffer.size() ) {
+          sink( data, n );   // larger than the buffer, bypass it
+          return;
+        }
+      }
+      std::memcpy( itsBuffer.data() + itsUsed, data, n );
+      itsUsed += n;
+    }
+
+    void writeString( const char* s, std::size_t n )
+    {
+      static const char hex[] = "0123456789abcdef";
+
+      put( '"' );
+      for( std::size_t i = 0; i < n; ) {
+        const std::size_t run = streaming_json_detail::clean_prefix( s + i, n - i );
+        write( s + i, run );
+        i += run;
+        if( i == n ) {
+          break;
+        }
+
+        const unsigned char c = static_cast<unsigned char>( s[i++] );
+        char* p = reserve( 6 );
+        p[0] = '\\';
+        switch( c ) {
+          case '"':  p[1] = '"';  itsUsed += 2; break;
+          case '\\': p[1] = '\\'; itsUsed += 2; break;
+          case '\b': p[1] = 'b';  itsUsed += 2; break;
+          case '\f': p[1] = 'f';  itsUsed += 2; break;
+          case '\n': p[1] = 'n';  itsUsed += 2; break;
+          case '\r': p[1] = 'r';  itsUsed += 2; break;
+          case '\t': p[1] = 't';  itsUsed += 2; break;
+          default:
+            p[1] = 'u'; p[2] = '0'; p[3] = '0';
+            p[4] = hex[c >> 4];
+            p[5] = hex[c & 0xF];
+            itsUsed += 6;
+        }
+      }
+      put( '"' );
+    }
+
+    void newline( std::size_t depth )
+    {
+      if( itsCompact ) {
+        return;
+      }
+      const std::size_t n = 1 + depth * itsIndentLength;
+      char* p = reserve( n );
+      p[0] = '\n';
+      std::memset( p + 1, ' ', n - 1 );
+      itsUsed += n;
+    }
+
+    void sink( const char* data, std::size_t n )
+    {
+      if( n == 0 ) {
+        return;
+      }
+      const auto written = itsStream.rdbuf()->sputn( data, static_cast<std::streamsize>( n ) );
+      if( written != static_cast<std::streamsize>( n ) ) {
+        throw Exception( "Failed to write " + std::to_string( n ) + " bytes to output stream! Wrote " + std::to_string( written ) );
+      }
+    }
+
+    std::ostream& itsStream;
+    std::vector<char> itsBuffer;
+    std::size_t itsUsed = 0;
+    bool itsCompact;
+    unsigned itsIndentLength;
+
+    std::vector<Node> itsNodes;
+    const char* itsNextName = nullptr;
+  };
+
+
+  // Prologue/epilogue and save functions, the same as for
+  // cereal::JSONOutputArchive
+  // --------------------------------
+  template<class T> inline
+  void prologue( StreamingJSONOutputArchive&, NameValuePair<T> const& ) { }
+
+  template<class T> inline
+  void epilogue( StreamingJSONOutputArchive&, NameValuePair<T> const& ) { }
+
+  // containers are written as arrays
+  template<class T> inline
+  void prologue( StreamingJSONOutputArchive& ar, SizeTag<T> const& )
+  {
+    ar.makeArray();
+  }
+
+  template<class T> inline
+  void epilogue( StreamingJSONOutputArchive&, SizeTag<T> const& ) { }
+
+  // classes with serialization functions (but not minimal ones) open a node
+  template<class T, traits::EnableIf<!std::is_arithmetic<T>::value,
+                                     !traits::has_minimal_base_class_serialization<T, traits::has_minimal_output_serialization, StreamingJSONOutputArchive>::value,
+                                     !traits::has_minimal_output_serialization<T, StreamingJSONOutputArchive>::value> = traits::sfinae> inline
+  void prologue( StreamingJSONOutputArchive& ar, T const& )
+  {
+    ar.startNode();
+  }
+
+  template<class T, traits::EnableIf<!std::is_arithmetic<T>::value,
+                                     !traits::has_minimal_base_class_serialization<T, traits::has_minimal_output_serialization, StreamingJSONOutputArchive>::value,
+                                     !traits::has_minimal_output_serialization<T, StreamingJSONOutputArchive>::value> = traits::sfinae> inline
+  void epilogue( StreamingJSONOutputArchive& ar, T const& )
+  {
+    ar.finishNode();
+  }
+
+  inline void prologue( StreamingJSONOutputArchive& ar, std::nullptr_t const& )
+  {
+    ar.writeName();
+  }
+
+  inline void epilogue( StreamingJSONOutputArchive&, std::nullptr_t const& ) { }
+
+  template<class T, traits::EnableIf<std::is_arithmetic<T>::value> = traits::sfinae> inline
+  void prologue( StreamingJSONOutputArchive& ar, T const& )
+  {
+    ar.writeName();
+  }
+
+  template<class T, traits::EnableIf<std::is_arithmetic<T>::value> = traits::sfinae> inline
+  void epilogue( StreamingJSONOutputArchive&, T const& ) { }
+
+  template<class CharT, class Traits, class Alloc> inline
+  void prologue( StreamingJSONOutputArchive& ar, std::basic_string<CharT, Traits, Alloc> const& )
+  {
+    ar.writeName();
+  }
+
+  template<class CharT, class Traits, class Alloc> inline
+  void epilogue( StreamingJSONOutputArchive&, std::basic_string<CharT, Traits, Alloc> const& ) { }
+
+  template<class T> inline
+  void CEREAL_SAVE_FUNCTION_NAME( StreamingJSONOutputArchive& ar, NameValuePair<T> const& t )
+  {
+    ar.setNextName( t.name );
+    ar( t.value );
+  }
+
+  inline void CEREAL_SAVE_FUNCTION_NAME( StreamingJSONOutputArchive& ar, std::nullptr_t const& t )
+  {
+    ar.saveValue( t );
+  }
+
+  template<class T, traits::EnableIf<std::is_arithmetic<T>::value> = traits::sfinae> inline
+  void CEREAL_SAVE_FUNCTION_NAME( StreamingJSONOutputArchive& ar, T const& t )
+  {
+    ar.saveValue( t );
+  }
+
+  template<class CharT, class Traits, class Alloc> inline
+  void CEREAL_SAVE_FUNCTION_NAME( StreamingJSONOutputArchive& ar, std::basic_string<CharT, Traits, Alloc> const& str )
+  {
+    ar.saveValue( str );
+  }
+
+  // the size is given by the array itself
+  template<class T> inline
+  void CEREAL_SAVE_FUNCTION_NAME( StreamingJSONOutputArchive&, SizeTag<T> const& ) { }
+
+  namespace traits
+  {
+    namespace detail
+    {
+      // documents are read back with the cereal JSON archive
+      template<>
+      struct get_input_from_output<cereal::StreamingJSONOutputArchive>
+      {
+        using type = cereal::JSONInputArchive;
+      };
+    }
+  }
+}
+
+// register archive for polymorphic support
+CEREAL_REGISTER_ARCHIVE(cereal::StreamingJSONOutputArchive)
+
+
+class MyData
+{
+public:
+  MyData(){};
+
+  int x, y, z;
+
+  // let cereal know which data members to serialize
+  template<typename Archive>
+  void serialize(Archive& archive)
+  {
+    archive(x, y, z);
+  }
+
+};
+
+
+class EmployeeData
+{
+  public:
+    EmployeeData() = default;
+    EmployeeData(std::string name, int age, std::string company)
+      : name{name}, age{age}, company{company} {}
+    ~EmployeeData() = default;
+
+    std::string get_name() const {
+      return name;
+    }
+
+  private:
+
+    std::string name;
+    int age;
+    std::string company;
+
+    friend class cereal::access;
+
+    template<class Archive>
+    void serialize(Archive& archive)
+    {
+      archive(
+        CEREAL_NVP(name),
+        CEREAL_NVP(age),
+        CEREAL_NVP(company)
+      );
+    }
+
+};
+
+
+// [[Rcpp::export]]
+int main()
+{
+  MyData m1;
+  m1.x = 40;
+  m1.y = 41;
+  m1.z = 42;
+  int someInt{0};
+  double d{42.42};
+
+  { // same structure as cereal::JSONOutputArchive
+    cereal::StreamingJSONOutputArchive oarchive(std::cout);
+    oarchive(CEREAL_NVP(m1), someInt, cereal::make_nvp("this_name_is_way_better", d));
+  }
+  Rcpp::Rcout << std::endl;
+
+  { // compact
+    cereal::StreamingJSONOutputArchive oarchive(std::cout, cereal::StreamingJSONOutputArchive::Options::Compact());
+    oarchive(CEREAL_NVP(m1), someInt, cereal::make_nvp("this_name_is_way_better", d));
+  }
+  Rcpp::Rcout << std::endl;
+
+  { // many string heavy records, cereal vs. streaming archive
+    using clock = std::chrono::steady_clock;
+    std::vector<EmployeeData> staff;
+    for (int i = 0; i < 200000; ++i) {
+      staff.emplace_back("Employee \"" + std::to_string(i) + "\" of the month",
+                         20 + i % 45,
+                         "Company\twith a rather long name, department " + std::to_string(i % 100));
+    }
+
+    std::ostringstream os1, os2;
+    auto t0 = clock::now();
+    {
+      cereal::JSONOutputArchive oarchive(os1);
+      oarchive(CEREAL_NVP(staff));
+    }
+    auto t1 = clock::now();
+    {
+      cereal::StreamingJSONOutputArchive oarchive(os2, cereal::StreamingJSONOutputArchive::Options::Compact());
+      oarchive(CEREAL_NVP(staff));
+    }
+    auto t2 = clock::now();
+
+    Rcpp::Rcout << "cereal JSONOutputArchive:            " << std::chrono::duration<double>(t1 - t0).count()
+                << " s, " << os1.str().size() << " bytes" << std::endl;
+    Rcpp::Rcout << "StreamingJSONOutputArchive, compact: " << std::chrono::duration<double>(t2 - t1).count()
+                << " s, " << os2.str().size() << " bytes" << std::endl;
+
+    // the compact document is read with the cereal JSON archive
+    std::vector<EmployeeData> staff2;
+    std::istringstream is(os2.str());
+    cereal::JSONInputArchive iarchive(is);
+    iarchive(CEREAL_NVP(staff2));
+    Rcpp::Rcout << staff2.size() << " employees, last: " << staff2.back().get_name() << std::endl;
+  }
+
+  return 0;
+}
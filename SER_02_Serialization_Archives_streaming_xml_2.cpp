@@ -0,0 +1,1370 @@
+// SER_02: Streaming XML archives
+// ----------------------------------------------------------------------------
+// cereal::XMLOutputArchive builds a rapidxml DOM of the whole document and
+// prints it when the archive is destroyed; cereal::XMLInputArchive reads the
+// complete file into memory and parses it into a DOM in its constructor. For
+// exports of several GB both need a multiple of the document size in RAM.
+//
+// cereal::StreamingXMLOutputArchive writes every element as soon as it is
+// serialized:
+// - the start tag is left open until the first child or value arrives, so
+//   attributes (size="dynamic", xml:space="preserve") can still be appended
+// - output is collected in a large buffer (1 MB by default) which is handed
+//   to the stream buffer in big chunks
+// - text is escaped with a SIMD scan for '&', '<', '>' and '"' (AVX2 or
+//   SSE2), numbers are formatted with std::to_chars
+// - memory use is the buffer plus the names of the currently open elements
+//
+// cereal::StreamingXMLInputArchive is a pull parser. An element is read when
+// serialize()/load() asks for it:
+// - named elements which are asked for out of document order are kept as raw
+//   text on the way and replayed when they are requested
+// - the size of a container is the number of its child elements; they are
+//   counted in one pass, then the archive jumps back (seekable streams) or
+//   replays the counted text
+// Hence the peak memory is bounded by the largest single element.
+//
+// Both produce/read the layout of the cereal XML archives: a <cereal> root,
+// one element per value named by its NVP or value0, value1, ... and
+// size="dynamic" on containers. Documents can be mixed freely with
+// cereal::XMLOutputArchive/XMLInputArchive.
+//
+// NOTE:
+// - The "type" attributes of cereal's outputType option are not written.
+// - Floating point values are written in the shortest form which reads back
+//   exactly (42.42, not 42.420000000000002).
+// - Compile with e.g. Sys.setenv(PKG_CXXFLAGS = "-march=native") for the AVX2
+//   kernel, SSE2 is always available on x86-64.
+// - The output archive closes the root element and writes the rest of its
+//   buffer when it is destroyed. Errors at that point cannot be reported,
+//   call flush() after the last value to get them as cereal::Exception.
+// ----------------------------------------------------------------------------
+// [[Rcpp::plugins("cpp17")]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include <cereal/cereal.hpp>
+#include <cereal/access.hpp>
+#include <cereal/archives/xml.hpp>
+#include <cereal/external/base64.hpp>
+#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
+#include <cereal/types/memory.hpp>
+
+#include <Rcpp.h>
+
+
+namespace cereal
+{
+  namespace streaming_xml_detail
+  {
+    inline bool is_space( int c )
+    {
+      return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+    }
+
+    // Length of the prefix of s which needs no escaping, i.e., contains no
+    // '&', '<', '>' or '"'.
+    inline std::size_t clean_prefix( const char* s, std::size_t n )
+    {
+      std::size_t i = 0;
+#if defined(__AVX2__)
+      const __m256i amp   = _mm256_set1_epi8( '&' );
+      const __m256i lt    = _mm256_set1_epi8( '<' );
+      const __m256i gt    = _mm256_set1_epi8( '>' );
+      const __m256i quote = _mm256_set1_epi8( '"' );
+      for( ; i + 32 <= n; i += 32 ) {
+        const __m256i v = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( s + i ) );
+        const __m256i m = _mm256_or_si256(
+          _mm256_or_si256( _mm256_cmpeq_epi8( v, amp ), _mm256_cmpeq_epi8( v, lt ) ),
+          _mm256_or_si256( _mm256_cmpeq_epi8( v, gt ), _mm256_cmpeq_epi8( v, quote ) ) );
+        const std::uint32_t bits = static_cast<std::uint32_t>( _mm256_movemask_epi8( m ) );
+        if( bits != 0 ) {
+          return i + static_cast<std::size_t>( __builtin_ctz( bits ) );
+        }
+      }
+#endif
+#if defined(__SSE2__)
+      const __m128i amp16   = _mm_set1_epi8( '&' );
+      const __m128i lt16    = _mm_set1_epi8( '<' );
+      const __m128i gt16    = _mm_set1_epi8( '>' );
+      const __m128i quote16 = _mm_set1_epi8( '"' );
+      for( ; i + 16 <= n; i += 16 ) {
+        const __m128i v = _mm_loadu_si128( reinterpret_cast<const __m128i*>( s + i ) );
+        const __m128i m = _mm_or_si128(
+          _mm_or_si128( _mm_cmpeq_epi8( v, amp16 ), _mm_cmpeq_epi8( v, lt16 ) ),
+          _mm_or_si128( _mm_cmpeq_epi8( v, gt16 ), _mm_cmpeq_epi8( v, quote16 ) ) );
+        const unsigned bits = static_cast<unsigned>( _mm_movemask_epi8( m ) );
+        if( bits != 0 ) {
+          return i + static_cast<std::size_t>( __builtin_ctz( bits ) );
+        }
+      }
+#endif
+      for( ; i < n; ++i ) {
+        const char c = s[i];
+        if( c == '&' || c == '<' || c == '>' || c == '"' ) {
+          return i;
+        }
+      }
+      return n;
+    }
+
+    inline void append_utf8( std::string& out, std::uint32_t cp )
+    {
+      if( cp < 0x80 ) {
+        out += static_cast<char>( cp );
+      } else if( cp < 0x800 ) {
+        out += static_cast<char>( 0xC0 | (cp >> 6) );
+        out += static_cast<char>( 0x80 | (cp & 0x3F) );
+      } else if( cp < 0x10000 ) {
+        out += static_cast<char>( 0xE0 | (cp >> 12) );
+        out += static_cast<char>( 0x80 | ((cp >> 6) & 0x3F) );
+        out += static_cast<char>( 0x80 | (cp & 0x3F) );
+      } else {
+        out += static_cast<char>( 0xF0 | (cp >> 18) );
+        out += static_cast<char>( 0x80 | ((cp >> 12) & 0x3F) );
+        out += static_cast<char>( 0x80 | ((cp >> 6) & 0x3F) );
+        out += static_cast<char>( 0x80 | (cp & 0x3F) );
+      }
+    }
+
+
+    // Writes elements as they are opened and closed. Keeps the output buffer
+    // and the names of the open elements, nothing else.
+    class Writer
+    {
+    public:
+      Writer( std::ostream& stream, bool indent, std::size_t buffer_size ) :
+        itsStream( stream ),
+        itsBuffer( buffer_size < 1024 ? 1024 : buffer_size ),
+        itsIndent( indent )
+      {
+        static const char head[] = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<cereal>";
+        write( head, sizeof(head) - 1 );
+        itsNames = "cereal";
+        itsNodes.push_back( Node{ 0, 6, 0, false, false } );
+      }
+
+      // Closes the root element and hands everything to the stream
+      void finish()
+      {
+        if( itsNodes.front().children ) {
+          newline( 0 );
+        }
+        write( "</cereal>\n", 10 );
+        flush();
+      }
+
+      // Hands the buffer to the stream
+      void flush()
+      {
+        sink( itsBuffer.data(), itsUsed );
+        itsUsed = 0;
+      }
+
+      // Opens a child of the current element, named valueN if name is nullptr
+      void startNode( const char* name )
+      {
+        Node& parent = itsNodes.back();
+        closeTag( parent );
+        parent.children = true;
+        newline( itsNodes.size() );
+
+        const std::size_t offset = itsNames.size();
+        if( name == nullptr ) {
+          char buf[32] = "value";
+          const auto res = std::to_chars( buf + 5, buf + sizeof(buf), parent.nameCounter++ );
+          itsNames.append( buf, static_cast<std::size_t>( res.ptr - buf ) );
+        } else {
+          itsNames.append( name );
+        }
+
+        put( '<' );
+        write( itsNames.data() + offset, itsNames.size() - offset );
+        itsNodes.push_back( Node{ offset, itsNames.size() - offset, 0, true, false } );
+      }
+
+      void finishNode()
+      {
+        const Node n = itsNodes.back();
+        itsNodes.pop_back();
+
+        if( n.open ) {
+          write( "/>", 2 );
+        } else {
+          if( n.children ) {
+            newline( itsNodes.size() );
+          }
+          write( "</", 2 );
+          write( itsNames.data() + n.nameOffset, n.nameLength );
+          put( '>' );
+        }
+        itsNames.resize( n.nameOffset );
+      }
+
+      // Only valid before the first child or value of the current element
+      void appendAttribute( const char* name, const char* value )
+      {
+        if( !itsNodes.back().open ) {
+          throw Exception( "XML attributes have to be set before the content of an element" );
+        }
+        put( ' ' );
+        write( name, std::strlen( name ) );
+        write( "=\"", 2 );
+        writeEscaped( value, std::strlen( value ) );
+        put( '"' );
+      }
+
+      // Text content of the current element
+      void text( const char* s, std::size_t n )
+      {
+        if( n > 0 && ( is_space( s[0] ) || is_space( s[n - 1] ) ) ) {
+          appendAttribute( "xml:space", "preserve" );
+        }
+        closeTag( itsNodes.back() );
+        writeEscaped( s, n );
+      }
+
+      // Text which never needs escaping (numbers, true/false)
+      void rawText( const char* s, std::size_t n )
+      {
+        closeTag( itsNodes.back() );
+        write( s, n );
+      }
+
+    private:
+      struct Node
+      {
+        std::size_t nameOffset;   // name is itsNames[nameOffset, +nameLength)
+        std::size_t nameLength;
+        std::uint32_t nameCounter;
+        bool open;       // start tag not yet terminated with '>'
+        bool children;
+      };
+
+      void closeTag( Node& n )
+      {
+        if( n.open ) {
+          put( '>' );
+          n.open = false;
+        }
+      }
+
+      void writeEscaped( const char* s, std::size_t n )
+      {
+        for( std::size_t i = 0; i < n; ) {
+          const std::size_t run = clean_prefix( s + i, n - i );
+          write( s + i, run );
+          i += run;
+          if( i == n ) {
+            break;
+          }
+          switch( s[i++] ) {
+            case '&': write( "&amp;", 5 );  break;
+            case '<': write( "&lt;", 4 );   break;
+            case '>': write( "&gt;", 4 );   break;
+            default:  write( "&quot;", 6 ); break;
+          }
+        }
+      }
+
+      void newline( std::size_t depth )
+      {
+        if( !itsIndent ) {
+          return;
+        }
+        const std::size_t n = 1 + depth;
+        char* p = reserve( n );
+        p[0] = '\n';
+        std::memset( p + 1, '\t', n - 1 );
+        itsUsed += n;
+      }
+
+      // Space for n bytes at the end of the buffer (n is small)
+      char* reserve( std::size_t n )
+      {
+        if( itsUsed + n > itsBuffer.size() ) {
+          flush();
+        }
+        return itsBuffer.data() + itsUsed;
+      }
+
+      void put( char c )
+      {
+        *reserve( 1 ) = c;
+        ++itsUsed;
+      }
+
+      void write( const char* data, std::size_t n )
+      {
+        if( itsUsed + n > itsBuffer.size() ) {
+          flush();
+          if( n >= itsBuffer.size() ) {
+            sink( data, n );   // larger than the buffer, bypass it
+            return;
+          }
+        }
+        std::memcpy( itsBuffer.data() + itsUsed, data, n );
+        itsUsed += n;
+      }
+
+      void sink( const char* data, std::size_t n )
+      {
+        if( n == 0 ) {
+          return;
+        }
+        const auto written = itsStream.rdbuf()->sputn( data, static_cast<std::streamsize>( n ) );
+        if( written != static_cast<std::streamsize>( n ) ) {
+          throw Exception( "Failed to write " + std::to_string( n ) + " bytes to output stream! Wrote " + std::to_string( written ) );
+        }
+      }
+
+      std::ostream& itsStream;
+      std::vector<char> itsBuffer;
+      std::size_t itsUsed = 0;
+      bool itsIndent;
+
+      std::vector<Node> itsNodes;
+      std::string itsNames;   // names of all open elements, back to back
+    };
+
+
+    // Pull parser over a stream. Keeps the read buffer, the stack of open
+    // elements and the raw text of elements read ahead.
+    class Reader
+    {
+    public:
+      Reader( std::istream& stream, std::size_t buffer_size ) :
+        itsStream( stream ),
+        itsBuffer( buffer_size > 0 ? buffer_size : 1 )
+      {
+        itsSeekable = ( itsStream.tellg() != std::streampos( -1 ) );
+
+        // skip the declaration, comments and a doctype up to the root element
+        Tag root;
+        for( ;; ) {
+          while( is_space( peek() ) ) {
+            advance();
+          }
+          if( get() != '<' ) {
+            throw Exception( "XML Parsing failed - expected the root element" );
+          }
+          if( peek() == '?' || peek() == '!' ) {
+            skipMarkup( nullptr );
+            continue;
+          }
+          readStartTag( root );
+          break;
+        }
+        if( root.name != "cereal" ) {
+          throw Exception( "Could not detect cereal root node - likely due to empty or invalid input" );
+        }
+        itsFrames.emplace_back();
+        itsFrames.back().tag = std::move( root );
+      }
+
+      // Sets the name of the next element, nullptr for "next in order"
+      void setNextName( const char* name ) { itsNextName = name; }
+
+      // Name of the next child of the current element, nullptr at its end
+      const char* getNodeName()
+      {
+        Frame& f = itsFrames.back();
+        if( !f.peeked ) {
+          if( !nextChild( f, f.next ) ) {
+            return nullptr;
+          }
+          f.peeked = true;
+        }
+        return f.next.name.c_str();
+      }
+
+      // Enters the next element, found by name if set
+      void startNode()
+      {
+        Tag t;
+        locate( t );
+        itsFrames.emplace_back();
+        itsFrames.back().tag = std::move( t );
+      }
+
+      // Skips what was not asked for and leaves the current element
+      void finishNode()
+      {
+        Frame& f = itsFrames.back();
+        if( !f.tag.empty ) {
+          if( f.peeked ) {
+            copyContent( f.next, nullptr );
+            f.peeked = false;
+          }
+          Tag t;
+          while( nextChild( f, t ) ) {
+            copyContent( t, nullptr );
+          }
+
+          // "</" is consumed, check the name of the end tag
+          std::string name;
+          for( int c = get(); c != '>'; c = get() ) {
+            if( c == EOF ) {
+              throw Exception( "XML Parsing failed - unterminated end tag" );
+            }
+            if( !is_space( c ) ) {
+              name += static_cast<char>( c );
+            }
+          }
+          if( name != f.tag.name ) {
+            throw Exception( "XML Parsing failed - </" + name + "> does not close <" + f.tag.name + ">" );
+          }
+        }
+        itsFrames.pop_back();
+      }
+
+      // Number of child elements of the element just entered
+      std::size_t childCount()
+      {
+        Frame& f = itsFrames.back();
+        if( f.tag.empty ) {
+          return 0;
+        }
+        if( f.peeked || f.closed ) {
+          throw Exception( "XML Parsing failed - size requested after the content was read" );
+        }
+
+        peek();   // drops exhausted replays
+        if( !itsReplays.empty() ) {
+          // scan the replayed text and rewind
+          const std::size_t level = itsReplays.size();
+          const std::size_t pos = itsReplays.back().pos;
+          const std::size_t n = scanContent( nullptr );
+          itsReplays.resize( level );
+          itsReplays.back().pos = pos;
+          return n;
+        }
+
+        if( itsSeekable && itsBase != std::streampos( -1 ) ) {
+          // scan the stream, jump back to the start of the buffer and read
+          // it again (tellg() positions only, text mode streams may
+          // translate line endings)
+          const std::streampos at = itsBase;
+          const std::size_t pos = itsPos;
+          const std::size_t n = scanContent( nullptr );
+          itsStream.clear();
+          itsStream.seekg( at );
+          if( !itsStream || !refill() || itsLength < pos ) {
+            throw Exception( "XML Parsing failed - cannot seek back in the input stream" );
+          }
+          itsPos = pos;
+          return n;
+        }
+
+        // keep the text of the children and read it again
+        std::string text;
+        const std::size_t n = scanContent( &text );
+        pushReplay( std::move( text ) );
+        return n;
+      }
+
+      // Reads the text content of the current element (entities decoded,
+      // trimmed unless xml:space="preserve")
+      void readText( std::string& out )
+      {
+        out.clear();
+        Frame& f = itsFrames.back();
+        if( f.tag.empty ) {
+          return;
+        }
+        if( f.peeked || f.closed ) {
+          throw Exception( "XML Parsing failed - expected text in <" + f.tag.name + ">" );
+        }
+
+        for( ;; ) {
+          // copy runs of plain characters straight from the read buffer
+          if( itsReplays.empty() && itsPos < itsLength ) {
+            const char* s = itsBuffer.data() + itsPos;
+            std::size_t n = 0;
+            while( n < itsLength - itsPos && s[n] != '<' && s[n] != '&' ) {
+              ++n;
+            }
+            out.append( s, n );
+            itsPos += n;
+          }
+
+          const int c = get();
+          if( c == EOF ) {
+            throw Exception( "XML Parsing failed - unterminated element <" + f.tag.name + ">" );
+          }
+          if( c == '&' ) {
+            readEntity( out );
+          } else if( c == '<' ) {
+            if( peek() == '/' ) {
+              advance();
+              f.closed = true;
+              break;
+            }
+            if( peek() != '!' ) {
+              throw Exception( "XML Parsing failed - expected text in <" + f.tag.name + ">, found an element" );
+            }
+            skipMarkup( &out );   // comment or CDATA section
+          } else {
+            out += static_cast<char>( c );
+          }
+        }
+
+        if( !f.tag.preserve ) {
+          std::size_t first = 0;
+          std::size_t last = out.size();
+          while( first < last && is_space( out[first] ) ) {
+            ++first;
+          }
+          while( last > first && is_space( out[last - 1] ) ) {
+            --last;
+          }
+          out.erase( last );
+          out.erase( 0, first );
+        }
+      }
+
+    private:
+      struct Tag
+      {
+        std::string name;
+        std::string attributes;   // raw text between the name and '>'
+        bool empty = false;       // <name/>
+        bool preserve = false;    // xml:space="preserve"
+      };
+
+      struct Frame
+      {
+        Tag tag;
+        bool peeked = false;   // start tag of the next child already read
+        bool closed = false;   // "</" of the end tag already read
+        Tag next;
+        std::unordered_map<std::string, std::string> stash;   // children read ahead
+      };
+
+      struct Replay
+      {
+        std::string text;
+        std::size_t pos;
+      };
+
+      int peek()
+      {
+        while( !itsReplays.empty() ) {
+          const Replay& r = itsReplays.back();
+          if( r.pos < r.text.size() ) {
+            return static_cast<unsigned char>( r.text[r.pos] );
+          }
+          itsReplays.pop_back();
+        }
+        if( itsPos == itsLength && !refill() ) {
+          return EOF;
+        }
+        return static_cast<unsigned char>( itsBuffer[itsPos] );
+      }
+
+      // call only after peek() returned a character
+      void advance()
+      {
+        if( !itsReplays.empty() ) {
+          ++itsReplays.back().pos;
+        } else {
+          ++itsPos;
+        }
+      }
+
+      int get()
+      {
+        const int c = peek();
+        if( c != EOF ) {
+          advance();
+        }
+        return c;
+      }
+
+      bool refill()
+      {
+        if( itsSeekable ) {
+          itsBase = itsStream.tellg();
+        }
+        itsStream.read( itsBuffer.data(), static_cast<std::streamsize>( itsBuffer.size() ) );
+        itsLength = static_cast<std::size_t>( itsStream.gcount() );
+        itsPos = 0;
+        return itsLength > 0;
+      }
+
+      void pushReplay( std::string text )
+      {
+        itsReplays.push_back( Replay{ std::move( text ), 0 } );
+      }
+
+      // Copies up to and including terminator
+      void copyUntil( const char* terminator, std::string* out )
+      {
+        // the last n characters read, compared after every character
+        const std::size_t n = std::strlen( terminator );
+        char tail[8] = {};
+        for( std::size_t read = 1; ; ++read ) {
+          const int c = get();
+          if( c == EOF ) {
+            throw Exception( std::string( "XML Parsing failed - missing " ) + terminator );
+          }
+          if( out ) {
+            *out += static_cast<char>( c );
+          }
+          std::memmove( tail, tail + 1, n - 1 );
+          tail[n - 1] = static_cast<char>( c );
+          if( read >= n && std::memcmp( tail, terminator, n ) == 0 ) {
+            return;
+          }
+        }
+      }
+
+      // Reads the rest of <?...?>, <!--...-->, <![CDATA[...]]> or <!...>
+      // whose '<' was consumed. Only the content of CDATA goes to text.
+      void skipMarkup( std::string* text )
+      {
+        if( get() == '?' ) {
+          copyUntil( "?>", nullptr );
+          return;
+        }
+        if( peek() == '-' ) {
+          copyUntil( "-->", nullptr );
+        } else if( peek() == '[' ) {
+          copyUntil( "CDATA[", nullptr );
+          if( text ) {
+            copyUntil( "]]>", text );
+            text->resize( text->size() - 3 );
+          } else {
+            copyUntil( "]]>", nullptr );
+          }
+        } else {
+          copyUntil( ">", nullptr );
+        }
+      }
+
+      // Reads name and attributes of a start tag whose '<' was consumed
+      void readStartTag( Tag& t )
+      {
+        t.name.clear();
+        t.attributes.clear();
+        for( int c = peek(); c != '>' && c != '/' && !is_space( c ); c = peek() ) {
+          if( c == EOF ) {
+            throw Exception( "XML Parsing failed - unterminated start tag" );
+          }
+          t.name += static_cast<char>( c );
+          advance();
+        }
+        if( t.name.empty() ) {
+          throw Exception( "XML Parsing failed - element without a name" );
+        }
+
+        char quote = 0;
+        for( ;; ) {
+          const int c = get();
+          if( c == EOF ) {
+            throw Exception( "XML Parsing failed - unterminated start tag <" + t.name + ">" );
+          }
+          if( quote == 0 && c == '>' ) {
+            break;
+          }
+          if( quote == 0 && ( c == '"' || c == '\'' ) ) {
+            quote = static_cast<char>( c );
+          } else if( c == quote ) {
+            quote = 0;
+          }
+          t.attributes += static_cast<char>( c );
+        }
+        t.empty = !t.attributes.empty() && t.attributes.back() == '/';
+
+        const std::size_t at = t.attributes.find( "xml:space" );
+        t.preserve = at != std::string::npos && t.attributes.find( "preserve", at ) != std::string::npos;
+      }
+
+      // Reads the start tag of the next child of f, false at the end of f
+      // (the "</" of its end tag is consumed then).
+      bool nextChild( Frame& f, Tag& t )
+      {
+        if( f.tag.empty || f.closed ) {
+          return false;
+        }
+        for( ;; ) {
+          const int c = get();
+          if( c == EOF ) {
+            throw Exception( "XML Parsing failed - unterminated element <" + f.tag.name + ">" );
+          }
+          if( c != '<' ) {
+            continue;   // whitespace (or ignored text) between children
+          }
+          const int d = peek();
+          if( d == '/' ) {
+            advance();
+            f.closed = true;
+            return false;
+          }
+          if( d == '?' || d == '!' ) {
+            skipMarkup( nullptr );
+            continue;
+          }
+          readStartTag( t );
+          return true;
+        }
+      }
+
+      // Reads (and copies, if out is given) the element whose start tag t
+      // was read, up to and including its end tag.
+      void copyContent( const Tag& t, std::string* out )
+      {
+        if( out ) {
+          *out += '<';
+          *out += t.name;
+          *out += t.attributes;
+          *out += '>';
+        }
+        if( !t.empty ) {
+          scanContent( out );
+        }
+      }
+
+      // Reads the content of an element whose start tag was read, up to and
+      // including its end tag. Returns the number of child elements.
+      std::size_t scanContent( std::string* out )
+      {
+        std::size_t children = 0;
+        int depth = 0;
+        for( ;; ) {
+          int c = get();
+          if( c == EOF ) {
+            throw Exception( "XML Parsing failed - unterminated element" );
+          }
+          if( out ) {
+            *out += static_cast<char>( c );
+          }
+          if( c != '<' ) {
+            continue;
+          }
+
+          c = peek();
+          if( c == '/' ) {
+            copyUntil( ">", out );
+            if( depth == 0 ) {
+              return children;
+            }
+            --depth;
+          } else if( c == '!' ) {
+            advance();
+            if( out ) {
+              *out += '!';
+            }
+            if( peek() == '-' ) {
+              copyUntil( "-->", out );
+            } else if( peek() == '[' ) {
+              copyUntil( "]]>", out );
+            } else {
+              copyUntil( ">", out );
+            }
+          } else if( c == '?' ) {
+            copyUntil( "?>", out );
+          } else {
+            children += ( depth == 0 );
+            // start tag, '>' inside attribute values does not end it
+            char quote = 0;
+            int prev = 0;
+            for( ;; ) {
+              c = get();
+              if( c == EOF ) {
+                throw Exception( "XML Parsing failed - unterminated start tag" );
+              }
+              if( out ) {
+                *out += static_cast<char>( c );
+              }
+              if( quote == 0 && c == '>' ) {
+                break;
+              }
+              if( quote == 0 && ( c == '"' || c == '\'' ) ) {
+                quote = static_cast<char>( c );
+              } else if( c == quote ) {
+                quote = 0;
+              }
+              prev = c;
+            }
+            depth += ( prev != '/' );
+          }
+        }
+      }
+
+      // Positions the reader behind the start tag of the next child, found
+      // by name if set
+      void locate( Tag& t )
+      {
+        const char* name = itsNextName;
+        itsNextName = nullptr;
+        Frame& f = itsFrames.back();
+
+        if( f.peeked ) {
+          f.peeked = false;
+          if( name == nullptr || f.next.name == name ) {
+            t = std::move( f.next );
+            return;
+          }
+          stash( f, f.next );
+        }
+
+        if( name == nullptr ) {
+          if( !nextChild( f, t ) ) {
+            throw Exception( "XML Parsing failed - no more children in <" + f.tag.name + ">" );
+          }
+          return;
+        }
+
+        auto it = f.stash.find( name );
+        if( it != f.stash.end() ) {
+          pushReplay( std::move( it->second ) );
+          f.stash.erase( it );
+          get();   // '<'
+          readStartTag( t );
+          return;
+        }
+
+        while( nextChild( f, t ) ) {
+          if( t.name == name ) {
+            return;
+          }
+          stash( f, t );
+        }
+        throw Exception( std::string( "XML Parsing failed - provided NVP (" ) + name + ") not found" );
+      }
+
+      void stash( Frame& f, const Tag& t )
+      {
+        std::string text;
+        copyContent( t, &text );
+        f.stash.emplace( t.name, std::move( text ) );   // the first one wins
+      }
+
+      // Decodes an entity whose '&' was consumed
+      void readEntity( std::string& out )
+      {
+        char name[16];
+        std::size_t n = 0;
+        for( int c = get(); c != ';'; c = get() ) {
+          if( c == EOF || n + 1 == sizeof(name) ) {
+            throw Exception( "XML Parsing failed - invalid entity" );
+          }
+          name[n++] = static_cast<char>( c );
+        }
+        name[n] = '\0';
+
+        if( std::strcmp( name, "amp" ) == 0 )       out += '&';
+        else if( std::strcmp( name, "lt" ) == 0 )   out += '<';
+        else if( std::strcmp( name, "gt" ) == 0 )   out += '>';
+        else if( std::strcmp( name, "quot" ) == 0 ) out += '"';
+        else if( std::strcmp( name, "apos" ) == 0 ) out += '\'';
+        else if( n > 1 && name[0] == '#' ) {
+          const bool hex = ( name[1] == 'x' );
+          std::uint32_t cp = 0;
+          const char* first = name + ( hex ? 2 : 1 );
+          const auto res = std::from_chars( first, name + n, cp, hex ? 16 : 10 );
+          if( res.ec != std::errc() || res.ptr != name + n ) {
+            throw Exception( std::string( "XML Parsing failed - invalid character reference &" ) + name + ";" );
+          }
+          append_utf8( out, cp );
+        } else {
+          throw Exception( std::string( "XML Parsing failed - unknown entity &" ) + name + ";" );
+        }
+      }
+
+      std::istream& itsStream;
+      std::vector<char> itsBuffer;
+      std::size_t itsPos = 0;
+      std::size_t itsLength = 0;
+      std::streampos itsBase = -1;   // stream position of itsBuffer[0]
+      bool itsSeekable = false;
+
+      std::vector<Frame> itsFrames;
+      std::vector<Replay> itsReplays;
+      const char* itsNextName = nullptr;
+    };
+  }
+
+
+  class StreamingXMLOutputArchive : public OutputArchive<StreamingXMLOutputArchive>, public traits::TextArchive
+  {
+  public:
+    class Options
+    {
+    public:
+      // Indented with tabs, size attributes, like cereal::XMLOutputArchive
+      static Options Default() { return Options(); }
+
+      // No indentation, no line breaks
+      static Options NoIndent() { return Options( false ); }
+
+      // indent: one element per line, indented with tabs
+      // sizeAttributes: mark containers with size="dynamic"
+      // bufferSize: bytes collected before they are handed to the stream
+      explicit Options( bool indent = true, bool sizeAttributes = true, std::size_t bufferSize = 1 << 20 ) :
+        itsIndent( indent ),
+        itsSizeAttributes( sizeAttributes ),
+        itsBufferSize( bufferSize )
+      { }
+
+    private:
+      friend class StreamingXMLOutputArchive;
+      bool itsIndent;
+      bool itsSizeAttributes;
+      std::size_t itsBufferSize;
+    };
+
+    explicit StreamingXMLOutputArchive( std::ostream& stream, Options const& options = Options::Default() ) :
+      OutputArchive<StreamingXMLOutputArchive>( this ),
+      itsWriter( stream, options.itsIndent, options.itsBufferSize ),
+      itsSizeAttributes( options.itsSizeAttributes )
+    { }
+
+    ~StreamingXMLOutputArchive() CEREAL_NOEXCEPT
+    {
+      try {
+        itsWriter.finish();
+      } catch( ... ) { }
+    }
+
+    // Hands everything serialized so far to the stream
+    void flush() { itsWriter.flush(); }
+
+    // Interface used by the serialization functions below, the same as the
+    // one of cereal::XMLOutputArchive
+    // --------------------------------
+
+    void startNode()
+    {
+      itsWriter.startNode( itsNextName );
+      itsNextName = nullptr;
+    }
+
+    void finishNode() { itsWriter.finishNode(); }
+
+    void setNextName( const char* name ) { itsNextName = name; }
+
+    void appendAttribute( const char* name, const char* value ) { itsWriter.appendAttribute( name, value ); }
+
+    bool hasSizeAttributes() const { return itsSizeAttributes; }
+
+    void saveValue( bool b )
+    {
+      if( b ) {
+        itsWriter.rawText( "true", 4 );
+      } else {
+        itsWriter.rawText( "false", 5 );
+      }
+    }
+
+    void saveValue( std::string const& s ) { itsWriter.text( s.data(), s.size() ); }
+    void saveValue( char const* s ) { itsWriter.text( s, std::strlen( s ) ); }
+
+    template<class T, traits::EnableIf<std::is_integral<T>::value,
+                                       !std::is_same<T, bool>::value> = traits::sfinae> inline
+    void saveValue( T t )
+    {
+      // char types are written as numbers, like in cereal
+      using U = typename std::conditional<std::is_signed<T>::value, std::int64_t, std::uint64_t>::type;
+      char buf[24];
+      const auto res = std::to_chars( buf, buf + sizeof(buf), static_cast<U>( t ) );
+      itsWriter.rawText( buf, static_cast<std::size_t>( res.ptr - buf ) );
+    }
+
+    template<class T, traits::EnableIf<std::is_floating_point<T>::value> = traits::sfinae> inline
+    void saveValue( T t )
+    {
+      // inf and nan come out as "inf", "-inf" and "nan", like with std::ostream
+      char buf[64];
+      const auto res = std::to_chars( buf, buf + sizeof(buf), t );
+      itsWriter.rawText( buf, static_cast<std::size_t>( res.ptr - buf ) );
+    }
+
+    void saveBinaryValue( const void* data, size_t size, const char* name = nullptr )
+    {
+      setNextName( name );
+      startNode();
+      const std::string encoded = base64::encode( reinterpret_cast<const unsigned char*>( data ), size );
+      itsWriter.rawText( encoded.data(), encoded.size() );
+      finishNode();
+    }
+
+  private:
+    streaming_xml_detail::Writer itsWriter;
+    bool itsSizeAttributes;
+    const char* itsNextName = nullptr;
+  };
+
+
+  class StreamingXMLInputArchive : public InputArchive<StreamingXMLInputArchive>, public traits::TextArchive
+  {
+  public:
+    // buffer_size: bytes read from the stream at once
+    explicit StreamingXMLInputArchive( std::istream& stream, std::size_t buffer_size = 1 << 16 ) :
+      InputArchive<StreamingXMLInputArchive>( this ),
+      itsReader( stream, buffer_size )
+    { }
+
+    ~StreamingXMLInputArchive() CEREAL_NOEXCEPT = default;
+
+    // Interface used by the serialization functions below, the same as the
+    // one of cereal::XMLInputArchive
+    void startNode() { itsReader.startNode(); }
+    void finishNode() { itsReader.finishNode(); }
+    void setNextName( const char* name ) { itsReader.setNextName( name ); }
+    const char* getNodeName() { return itsReader.getNodeName(); }
+
+    void loadSize( size_type& size ) { size = static_cast<size_type>( itsReader.childCount() ); }
+
+    void loadValue( std::string& val ) { itsReader.readText( val ); }
+
+    void loadValue( bool& val )
+    {
+      itsReader.readText( itsText );
+      if( itsText == "true" || itsText == "1" )       val = true;
+      else if( itsText == "false" || itsText == "0" ) val = false;
+      else throw Exception( "XML Parsing failed - expected a bool, got " + itsText );
+    }
+
+    template<class T, traits::EnableIf<std::is_arithmetic<T>::value,
+                                       !std::is_same<T, bool>::value> = traits::sfinae> inline
+    void loadValue( T& val )
+    {
+      itsReader.readText( itsText );
+      const char* first = itsText.data();
+      const char* last = first + itsText.size();
+      if( first != last && *first == '+' ) {
+        ++first;   // accepted by std::stoi and friends, not by from_chars
+      }
+
+      const auto res = std::from_chars( first, last, val );
+      if( res.ec != std::errc() || res.ptr != last ) {
+        throw Exception( "XML Parsing failed - invalid number " + itsText );
+      }
+    }
+
+    void loadBinaryValue( void* data, size_t size, const char* name = nullptr )
+    {
+      setNextName( name );
+      startNode();
+      std::string encoded;
+      loadValue( encoded );
+      finishNode();
+      const std::string decoded = base64::decode( encoded );
+      if( size != decoded.size() ) {
+        throw Exception( "Decoded binary data size does not match specified size" );
+      }
+      std::memcpy( data, decoded.data(), decoded.size() );
+    }
+
+  private:
+    streaming_xml_detail::Reader itsReader;
+    std::string itsText;
+  };
+
+
+  // Prologue/epilogue and save/load functions, the same as for the cereal
+  // XML archives: every value except NVPs and size tags is an element
+  // --------------------------------
+  template<class T> inline
+  void prologue( StreamingXMLOutputArchive&, NameValuePair<T> const& ) { }
+
+  template<class T> inline
+  void prologue( StreamingXMLInputArchive&, NameValuePair<T> const& ) { }
+
+  template<class T> inline
+  void epilogue( StreamingXMLOutputArchive&, NameValuePair<T> const& ) { }
+
+  template<class T> inline
+  void epilogue( StreamingXMLInputArchive&, NameValuePair<T> const& ) { }
+
+  // containers are marked with size="dynamic"
+  template<class T> inline
+  void prologue( StreamingXMLOutputArchive& ar, SizeTag<T> const& )
+  {
+    if( ar.hasSizeAttributes() ) {
+      ar.appendAttribute( "size", "dynamic" );
+    }
+  }
+
+  template<class T> inline
+  void prologue( StreamingXMLInputArchive&, SizeTag<T> const& ) { }
+
+  template<class T> inline
+  void epilogue( StreamingXMLOutputArchive&, SizeTag<T> const& ) { }
+
+  template<class T> inline
+  void epilogue( StreamingXMLInputArchive&, SizeTag<T> const& ) { }
+
+  // all other types (but not minimal ones) open an element
+  template<class T, traits::EnableIf<!traits::has_minimal_base_class_serialization<T, traits::has_minimal_output_serialization, StreamingXMLOutputArchive>::value,
+                                     !traits::has_minimal_output_serialization<T, StreamingXMLOutputArchive>::value> = traits::sfinae> inline
+  void prologue( StreamingXMLOutputArchive& ar, T const& )
+  {
+    ar.startNode();
+  }
+
+  template<class T, traits::EnableIf<!traits::has_minimal_base_class_serialization<T, traits::has_minimal_input_serialization, StreamingXMLInputArchive>::value,
+                                     !traits::has_minimal_input_serialization<T, StreamingXMLInputArchive>::value> = traits::sfinae> inline
+  void prologue( StreamingXMLInputArchive& ar, T const& )
+  {
+    ar.startNode();
+  }
+
+  template<class T, traits::EnableIf<!traits::has_minimal_base_class_serialization<T, traits::has_minimal_output_serialization, StreamingXMLOutputArchive>::value,
+                                     !traits::has_minimal_output_serialization<T, StreamingXMLOutputArchive>::value> = traits::sfinae> inline
+  void epilogue( StreamingXMLOutputArchive& ar, T const& )
+  {
+    ar.finishNode();
+  }
+
+  template<class T, traits::EnableIf<!traits::has_minimal_base_class_serialization<T, traits::has_minimal_input_serialization, StreamingXMLInputArchive>::value,
+                                     !traits::has_minimal_input_serialization<T, StreamingXMLInputArchive>::value> = traits::sfinae> inline
+  void epilogue( StreamingXMLInputArchive& ar, T const& )
+  {
+    ar.finishNode();
+  }
+
+  template<class T> inline
+  void CEREAL_SAVE_FUNCTION_NAME( StreamingXMLOutputArchive& ar, NameValuePair<T> const& t )
+  {
+    ar.setNextName( t.name );
+    ar( t.value );
+  }
+
+  template<class T> inline
+  void CEREAL_LOAD_FUNCTION_NAME( StreamingXMLInputArchive& ar, NameValuePair<T>& t )
+  {
+    ar.setNextName( t.name );
+    ar( t.value );
+  }
+
+  // the size is given by the number of child elements
+  template<class T> inline
+  void CEREAL_SAVE_FUNCTION_NAME( StreamingXMLOutputArchive&, SizeTag<T> const& ) { }
+
+  template<class T> inline
+  void CEREAL_LOAD_FUNCTION_NAME( StreamingXMLInputArchive& ar, SizeTag<T>& st )
+  {
+    ar.loadSize( st.size );
+  }
+
+  template<class T, traits::EnableIf<std::is_arithmetic<T>::value> = traits::sfinae> inline
+  void CEREAL_SAVE_FUNCTION_NAME( StreamingXMLOutputArchive& ar, T const& t )
+  {
+    ar.saveValue( t );
+  }
+
+  template<class T, traits::EnableIf<std::is_arithmetic<T>::value> = traits::sfinae> inline
+  void CEREAL_LOAD_FUNCTION_NAME( StreamingXMLInputArchive& ar, T& t )
+  {
+    ar.loadValue( t );
+  }
+
+  template<class CharT, class Traits, class Alloc> inline
+  void CEREAL_SAVE_FUNCTION_NAME( StreamingXMLOutputArchive& ar, std::basic_string<CharT, Traits, Alloc> const& str )
+  {
+    ar.saveValue( str );
+  }
+
+  template<class CharT, class Traits, class Alloc> inline
+  void CEREAL_LOAD_FUNCTION_NAME( StreamingXMLInputArchive& ar, std::basic_string<CharT, Traits, Alloc>& str )
+  {
+    ar.loadValue( str );
+  }
+}
+
+// register archives for polymorphic support
+CEREAL_REGISTER_ARCHIVE(cereal::StreamingXMLOutputArchive)
+CEREAL_REGISTER_ARCHIVE(cereal::StreamingXMLInputArchive)
+
+// tie input and output archives together
+CEREAL_SETUP_ARCHIVE_TRAITS(cereal::StreamingXMLInputArchive, cereal::StreamingXMLOutputArchive)
+
+
+class MyData
+{
+public:
+  MyData(){};
+
+  int x, y, z;
+
+  // let cereal know which data members to serialize
+  template<typename Archive>
+  void serialize(Archive& archive)
+  {
+    archive(x, y, z);
+  }
+
+};
+
+
+class EmployeeData
+{
+  public:
+    EmployeeData() = default;
+    EmployeeData(std::string name, int age, std::string company)
+      : name{name}, age{age}, company{company} {}
+    ~EmployeeData() = default;
+
+    std::string get_name() const {
+      return name;
+    }
+
+  private:
+
+    std::string name;
+    int age;
+    std::string company;
+
+    friend class cereal::access;
+
+    template<class Archive>
+    void serialize(Archive& archive)
+    {
+      archive(
+        CEREAL_NVP(name),
+        CEREAL_NVP(age),
+        CEREAL_NVP(company)
+      );
+    }
+
+};
+
+
+// polymorphic types, see SER_09
+#include <cereal/types/polymorphic.hpp>
+
+struct BaseClass
+{
+  virtual ~BaseClass() = default;
+  virtual std::string sayType() const = 0;
+};
+
+struct DerivedClassOne : public BaseClass
+{
+  int x{0};
+  std::string sayType() const { return "DerivedClassOne, x = " + std::to_string(x); }
+
+  template<class Archive>
+  void serialize(Archive& ar) { ar(x); }
+};
+
+CEREAL_REGISTER_TYPE(DerivedClassOne)
+CEREAL_REGISTER_POLYMORPHIC_RELATION(BaseClass, DerivedClassOne)
+
+
+// [[Rcpp::export]]
+int main()
+{
+  MyData m1;
+  m1.x = 40;
+  m1.y = 41;
+  m1.z = 42;
+  int someInt{0};
+  double d{42.42};
+
+  { // same layout as cereal::XMLOutputArchive
+    std::ofstream os("Backend/data_SER02_stream.xml");
+    cereal::StreamingXMLOutputArchive oarchive(os);
+    oarchive(CEREAL_NVP(m1), someInt, cereal::make_nvp("this_name_is_way_better", d));
+  }
+
+  { // ... which loads with the cereal archive
+    std::ifstream is("Backend/data_SER02_stream.xml");
+    cereal::XMLInputArchive iarchive(is);
+    MyData m2;
+    int someInt2;
+    double d2;
+    iarchive(m2, someInt2, d2);
+    Rcpp::Rcout << "cereal XMLInputArchive: x: " << m2.x << ", y: " << m2.y << " z: " << m2.z
+                << ", someInt: " << someInt2 << ", d: " << d2 << std::endl;
+  }
+
+  { // ... and with the streaming one, named values in any order
+    std::ifstream is("Backend/data_SER02_stream.xml");
+    cereal::StreamingXMLInputArchive iarchive(is);
+    MyData m2;
+    double d2;
+    iarchive(cereal::make_nvp("this_name_is_way_better", d2), cereal::make_nvp("m1", m2));
+    Rcpp::Rcout << "StreamingXMLInputArchive: x: " << m2.x << ", y: " << m2.y << " z: " << m2.z
+                << ", d: " << d2 << std::endl;
+  }
+
+  { // polymorphic pointers
+    std::stringstream ss;
+    {
+      cereal::StreamingXMLOutputArchive oarchive(ss);
+      std::shared_ptr<BaseClass> ptr = std::make_shared<DerivedClassOne>();
+      std::static_pointer_cast<DerivedClassOne>(ptr)->x = 7;
+      oarchive(ptr);
+    }
+    std::shared_ptr<BaseClass> ptr;
+    cereal::StreamingXMLInputArchive iarchive(ss);
+    iarchive(ptr);
+    Rcpp::Rcout << ptr->sayType() << std::endl;
+  }
+
+  { // a large export, cereal vs. streaming archives
+    using clock = std::chrono::steady_clock;
+    std::vector<EmployeeData> staff;
+    for (int i = 0; i < 200000; ++i) {
+      staff.emplace_back("Employee <" + std::to_string(i) + "> of the month",
+                         20 + i % 45,
+                         "Company & Sons, department " + std::to_string(i % 100));
+    }
+
+    auto t0 = clock::now();
+    {
+      std::ofstream os("Backend/staff_SER02.xml");
+      cereal::XMLOutputArchive oarchive(os);
+      oarchive(CEREAL_NVP(staff));
+    }
+    auto t1 = clock::now();
+    {
+      std::ofstream os("Backend/staff_SER02_stream.xml");
+      cereal::StreamingXMLOutputArchive oarchive(os);
+      oarchive(CEREAL_NVP(staff));
+    }
+    auto t2 = clock::now();
+
+    std::vector<EmployeeData> staff1, staff2;
+    {
+      std::ifstream is("Backend/staff_SER02_stream.xml");
+      cereal::XMLInputArchive iarchive(is);
+      iarchive(cereal::make_nvp("staff", staff1));
+    }
+    auto t3 = clock::now();
+    {
+      std::ifstream is("Backend/staff_SER02_stream.xml");
+      cereal::StreamingXMLInputArchive iarchive(is);
+      iarchive(cereal::make_nvp("staff", staff2));
+    }
+    auto t4 = clock::now();
+
+    Rcpp::Rcout << "write, cereal XMLOutputArchive:       " << std::chrono::duration<double>(t1 - t0).count() << " s" << std::endl;
+    Rcpp::Rcout << "write, StreamingXMLOutputArchive:     " << std::chrono::duration<double>(t2 - t1).count() << " s" << std::endl;
+    Rcpp::Rcout << "read,  cereal XMLInputArchive:        " << std::chrono::duration<double>(t3 - t2).count() << " s" << std::endl;
+    Rcpp::Rcout << "read,  StreamingXMLInputArchive:      " << std::chrono::duration<double>(t4 - t3).count() << " s" << std::endl;
+    Rcpp::Rcout << staff2.size() << " employees, last: " << staff2.back().get_name() << std::endl;
+  }
+
+  return 0;
+}
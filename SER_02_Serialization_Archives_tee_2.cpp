@@ -0,0 +1,535 @@
+// SER_02: Tee archive, one traversal for several formats
+// ----------------------------------------------------------------------------
+// SER_02_Serialization_Archives_2.cpp passes the same objects to a binary, an
+// XML and a JSON archive, i.e., every serialize() function, every class
+// version lookup and every pointer registration runs once per format.
+//
+// cereal::TeeOutputArchive<Sinks...> walks the objects once and fans the
+// values out to the sink archives:
+// - classes: the prologue/epilogue of each sink is called (this opens and
+//   closes the JSON objects or XML elements), serialize() runs on the tee
+// - names: passed on to sinks which have setNextName() (JSON, XML), the
+//   binary archive ignores them as usual
+// - primitives, strings and size tags are handed to every sink, which formats
+//   them exactly as if it had walked the objects itself
+// Versions and shared pointer ids are assigned by the tee and written to the
+// sinks as ordinary values, hence each sink's output is identical to a direct
+// serialization.
+//
+// cereal::BufferedSink<Archive> owns a sink archive together with its own
+// output buffer. Full buffers are written to the target stream by a writer
+// thread of the sink (SinkOptions::own_thread), so the file I/O of all
+// formats overlaps with the traversal.
+//
+// NOTE:
+// - Destroy the tee before its sinks; the JSON and XML archives only complete
+//   their documents when they are destroyed.
+// - Write errors of a BufferedSink (e.g. a full disk) cannot be reported when
+//   it is destroyed, call finish() to get them as cereal::Exception.
+// - binary_data() is not available through the tee (no text archive supports
+//   it), vectors of arithmetic types are therefore written element-wise. The
+//   binary sink produces the same bytes either way.
+// - The tee is not registered for polymorphic pointers.
+// ----------------------------------------------------------------------------
+// [[Rcpp::plugins("cpp17")]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include <cereal/cereal.hpp>
+#include <cereal/access.hpp>
+#include <cereal/archives/binary.hpp>
+#include <cereal/archives/json.hpp>
+#include <cereal/archives/xml.hpp>
+#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
+
+#include <Rcpp.h>
+
+
+namespace cereal
+{
+  struct SinkOptions
+  {
+    std::size_t buffer_size = 1 << 20; // bytes collected before a write
+    bool own_thread = true;            // write full buffers on a writer thread
+  };
+
+
+  namespace tee_detail
+  {
+    // Values the tee hands to its sinks as a whole
+    template<class T>
+    struct is_forwarded : std::is_arithmetic<T> { };
+
+    template<>
+    struct is_forwarded<std::nullptr_t> : std::true_type { };
+
+    template<class CharT, class Traits, class Alloc>
+    struct is_forwarded<std::basic_string<CharT, Traits, Alloc>> : std::true_type { };
+
+    template<class T>
+    struct is_forwarded<SizeTag<T>> : std::true_type { };
+
+    template<class T>
+    struct is_nvp : std::false_type { };
+
+    template<class T>
+    struct is_nvp<NameValuePair<T>> : std::true_type { };
+
+    template<class Archive, class = void>
+    struct has_set_next_name : std::false_type { };
+
+    template<class Archive>
+    struct has_set_next_name<Archive, std::void_t<decltype( std::declval<Archive&>().setNextName( "" ) )>> : std::true_type { };
+
+
+    // Output buffer of one sink. Full buffers are written to the target
+    // stream, either directly or by a writer thread while the next buffer is
+    // filled.
+    class SinkStreambuf : public std::streambuf
+    {
+    public:
+      SinkStreambuf( std::ostream& target, const SinkOptions& opts )
+        : target( target ), opts( opts ), block( opts.buffer_size > 0 ? opts.buffer_size : 1 ) {
+          setp( block.data(), block.data() + block.size() );
+          if( opts.own_thread ) {
+            writer = std::thread( [this] { run(); } );
+          }
+      }
+
+      // Errors during the final flush cannot be reported from a destructor,
+      // call BufferedSink::finish() explicitly if you need to handle them.
+      ~SinkStreambuf() {
+        try { finish(); } catch( ... ) {}
+        if( writer.joinable() ) {
+          stop_writer();
+        }
+      }
+
+      void finish() {
+        if( finished ) {
+          return;
+        }
+        finished = true;
+        hand_off();
+        if( writer.joinable() ) {
+          stop_writer();
+        }
+        check();
+        target.flush();
+        if( !target ) {
+          throw Exception( "Failed to flush the sink stream!" );
+        }
+      }
+
+    protected:
+      int_type overflow( int_type ch ) override {
+        hand_off();
+        if( !traits_type::eq_int_type( ch, traits_type::eof() ) ) {
+          *pptr() = traits_type::to_char_type( ch );
+          pbump( 1 );
+        }
+        return traits_type::not_eof( ch );
+      }
+
+      std::streamsize xsputn( const char* s, std::streamsize n ) override {
+        std::streamsize done = 0;
+        while( done < n ) {
+          std::streamsize room = epptr() - pptr();
+          if( room == 0 ) {
+            hand_off();
+            continue;
+          }
+          std::streamsize k = std::min( room, n - done );
+          std::memcpy( pptr(), s + done, static_cast<std::size_t>( k ) );
+          pbump( static_cast<int>( k ) );
+          done += k;
+        }
+        return n;
+      }
+
+      int sync() override {
+        hand_off();
+        if( writer.joinable() ) {
+          std::unique_lock<std::mutex> lock( mtx );
+          cv.wait( lock, [this] { return ( pending.empty() && !busy ) || !error.empty(); } );
+          if( !error.empty() ) {
+            return -1;
+          }
+        }
+        target.flush();
+        return target ? 0 : -1;
+      }
+
+    private:
+      void hand_off() {
+        const std::size_t n = static_cast<std::size_t>( pptr() - pbase() );
+        if( n == 0 ) {
+          return;
+        }
+        block.resize( n );
+
+        if( !writer.joinable() ) {
+          write_out( block );
+          check();
+        } else {
+          std::unique_lock<std::mutex> lock( mtx );
+          // at most two buffers in flight bound the memory of the sink
+          cv.wait( lock, [this] { return pending.size() < 2 || !error.empty(); } );
+          if( !error.empty() ) {
+            throw Exception( error );
+          }
+          pending.push_back( std::move( block ) );
+          if( !spare.empty() ) {
+            block = std::move( spare.back() );
+            spare.pop_back();
+          } else {
+            block = std::vector<char>();
+          }
+          cv.notify_all();
+        }
+
+        block.resize( opts.buffer_size > 0 ? opts.buffer_size : 1 );
+        setp( block.data(), block.data() + block.size() );
+      }
+
+      void run() {
+        for( ;; ) {
+          std::vector<char> buf;
+          {
+            std::unique_lock<std::mutex> lock( mtx );
+            cv.wait( lock, [this] { return stop || !pending.empty(); } );
+            if( pending.empty() ) {
+              return;
+            }
+            buf = std::move( pending.front() );
+            pending.pop_front();
+            busy = true;
+          }
+          write_out( buf );
+          {
+            std::lock_guard<std::mutex> lock( mtx );
+            busy = false;
+            spare.push_back( std::move( buf ) );
+          }
+          cv.notify_all();
+        }
+      }
+
+      void write_out( const std::vector<char>& buf ) {
+        const auto written = target.rdbuf()->sputn( buf.data(), static_cast<std::streamsize>( buf.size() ) );
+        if( written != static_cast<std::streamsize>( buf.size() ) ) {
+          std::lock_guard<std::mutex> lock( mtx );
+          if( error.empty() ) {
+            error = "Failed to write " + std::to_string( buf.size() ) + " bytes to sink stream! Wrote " + std::to_string( written );
+          }
+        }
+      }
+
+      void stop_writer() {
+        {
+          std::lock_guard<std::mutex> lock( mtx );
+          stop = true;
+        }
+        cv.notify_all();
+        writer.join();
+      }
+
+      void check() {
+        std::lock_guard<std::mutex> lock( mtx );
+        if( !error.empty() ) {
+          throw Exception( error );
+        }
+      }
+
+      std::ostream& target;
+      SinkOptions opts;
+      std::vector<char> block;
+
+      std::thread writer;
+      std::deque<std::vector<char>> pending;
+      std::vector<std::vector<char>> spare;
+      std::mutex mtx;
+      std::condition_variable cv;
+      std::string error;
+      bool busy = false;
+      bool stop = false;
+      bool finished = false;
+    };
+  }
+
+
+  // A sink archive of type Archive with its own buffer (and writer thread).
+  // Members are destroyed in reverse order: the archive finishes its document
+  // first, then the buffer is flushed.
+  template<class Archive>
+  class BufferedSink
+  {
+  public:
+    explicit BufferedSink( std::ostream& target )
+      : buf( target, SinkOptions{} ), os( &buf ) { ar.emplace( os ); }
+
+    // further arguments are passed on to the archive, e.g. its Options
+    template<class ... Args>
+    BufferedSink( std::ostream& target, const SinkOptions& opts, Args && ... args )
+      : buf( target, opts ), os( &buf ) { ar.emplace( os, std::forward<Args>( args )... ); }
+
+    Archive& archive() { return *ar; }
+
+    // Completes the document of the archive (which must not be used any
+    // more) and writes everything to the target. Write errors are thrown as
+    // cereal::Exception, unlike in the destructor.
+    void finish()
+    {
+      ar.reset();
+      buf.finish();
+      if( !os ) {
+        throw Exception( "Failed to write to the sink buffer!" );
+      }
+    }
+
+  private:
+    tee_detail::SinkStreambuf buf;
+    std::ostream os;
+    std::optional<Archive> ar;
+  };
+
+
+  template<class ... Sinks>
+  class TeeOutputArchive : public OutputArchive<TeeOutputArchive<Sinks...>>
+  {
+  public:
+    explicit TeeOutputArchive( Sinks& ... sinks ) :
+      OutputArchive<TeeOutputArchive<Sinks...>>( this ),
+      itsSinks( sinks... )
+    { }
+
+    ~TeeOutputArchive() CEREAL_NOEXCEPT = default;
+
+    // Interface used by the serialization functions below
+    // --------------------------------
+
+    void setNextName( const char* name )
+    {
+      std::apply( [name]( auto& ... s ) { ( setName( s, name ), ... ); }, itsSinks );
+    }
+
+    // Opening/closing of classes, e.g. JSON objects or XML elements
+    template<class T>
+    void sinkPrologue( T const& t )
+    {
+      std::apply( [&t]( auto& ... s ) { ( prologue( s, t ), ... ); }, itsSinks );
+    }
+
+    template<class T>
+    void sinkEpilogue( T const& t )
+    {
+      std::apply( [&t]( auto& ... s ) { ( epilogue( s, t ), ... ); }, itsSinks );
+    }
+
+    // A complete value for every sink
+    template<class T>
+    void forward( T const& t )
+    {
+      std::apply( [&t]( auto& ... s ) { ( s( t ), ... ); }, itsSinks );
+    }
+
+  private:
+    template<class Archive>
+    static void setName( Archive& s, const char* name )
+    {
+      if constexpr ( tee_detail::has_set_next_name<Archive>::value ) {
+        s.setNextName( name );
+      }
+    }
+
+    std::tuple<Sinks&...> itsSinks;
+  };
+
+
+  // Prologue/epilogue and save functions: forwarded values are complete in
+  // the sinks, NVPs only set the name, everything else opens/closes a node
+  // --------------------------------
+  template<class ... Sinks, class T> inline
+  void prologue( TeeOutputArchive<Sinks...>& ar, T const& t )
+  {
+    if constexpr ( !tee_detail::is_forwarded<T>::value && !tee_detail::is_nvp<T>::value ) {
+      ar.sinkPrologue( t );
+    }
+  }
+
+  template<class ... Sinks, class T> inline
+  void epilogue( TeeOutputArchive<Sinks...>& ar, T const& t )
+  {
+    if constexpr ( !tee_detail::is_forwarded<T>::value && !tee_detail::is_nvp<T>::value ) {
+      ar.sinkEpilogue( t );
+    }
+  }
+
+  template<class ... Sinks, class T> inline
+  void CEREAL_SAVE_FUNCTION_NAME( TeeOutputArchive<Sinks...>& ar, NameValuePair<T> const& t )
+  {
+    ar.setNextName( t.name );
+    ar( t.value );
+  }
+
+  template<class ... Sinks, class T, traits::EnableIf<tee_detail::is_forwarded<T>::value> = traits::sfinae> inline
+  void CEREAL_SAVE_FUNCTION_NAME( TeeOutputArchive<Sinks...>& ar, T const& t )
+  {
+    ar.forward( t );
+  }
+}
+
+
+class MyData
+{
+public:
+  MyData(){};
+
+  int x, y, z;
+
+  // let cereal know which data members to serialize
+  template<typename Archive>
+  void serialize(Archive& archive)
+  {
+    archive(x, y, z);
+  }
+
+};
+
+
+class EmployeeData
+{
+  public:
+    EmployeeData() = default;
+    EmployeeData(std::string name, int age, std::string company)
+      : name{name}, age{age}, company{company} {}
+    ~EmployeeData() = default;
+
+    std::string get_name() const {
+      return name;
+    }
+
+  private:
+
+    std::string name;
+    int age;
+    std::string company;
+
+    friend class cereal::access;
+
+    template<class Archive>
+    void serialize(Archive& archive)
+    {
+      archive(
+        CEREAL_NVP(name),
+        CEREAL_NVP(age),
+        CEREAL_NVP(company)
+      );
+    }
+
+};
+
+
+// [[Rcpp::export]]
+int main()
+{
+  MyData m1;
+  m1.x = 40;
+  m1.y = 41;
+  m1.z = 42;
+  int someInt{0};
+  double d{42.42};
+
+  { // one traversal, three formats
+    std::ofstream os1("Backend/data_SER02_tee.bin", std::ios::binary);
+    std::ofstream os2("Backend/data_SER02_tee.xml");
+    std::ofstream os3("Backend/data_SER02_tee.json");
+
+    cereal::BinaryOutputArchive oarchive1(os1);
+    cereal::XMLOutputArchive oarchive2(os2);
+    cereal::JSONOutputArchive oarchive3(os3);
+
+    cereal::TeeOutputArchive tee(oarchive1, oarchive2, oarchive3);
+    tee(CEREAL_NVP(m1), someInt, cereal::make_nvp("this_name_is_way_better", d));
+  }
+
+  { // the files load with the plain cereal archives
+    std::ifstream is1("Backend/data_SER02_tee.bin", std::ios::binary);
+    std::ifstream is2("Backend/data_SER02_tee.xml");
+    std::ifstream is3("Backend/data_SER02_tee.json");
+
+    cereal::BinaryInputArchive iarchive1(is1);
+    cereal::XMLInputArchive iarchive2(is2);
+    cereal::JSONInputArchive iarchive3(is3);
+
+    MyData m2;
+    int someInt2;
+    double d2;
+    iarchive1(m2, someInt2, d2);
+    Rcpp::Rcout << "source bin:  x: " << m2.x << ", y: " << m2.y << " z: " << m2.z << ", d: " << d2 << std::endl;
+    iarchive2(m2, someInt2, d2);
+    Rcpp::Rcout << "source xml:  x: " << m2.x << ", y: " << m2.y << " z: " << m2.z << ", d: " << d2 << std::endl;
+    iarchive3(m2, someInt2, d2);
+    Rcpp::Rcout << "source json: x: " << m2.x << ", y: " << m2.y << " z: " << m2.z << ", d: " << d2 << std::endl;
+  }
+
+  { // binary checkpoint and JSON summary of a large state
+    using clock = std::chrono::steady_clock;
+    std::vector<EmployeeData> staff;
+    for (int i = 0; i < 200000; ++i) {
+      staff.emplace_back("Employee " + std::to_string(i), 20 + i % 45, "Company " + std::to_string(i % 100));
+    }
+
+    auto t0 = clock::now();
+    {
+      std::ofstream os1("Backend/staff_SER02.bin", std::ios::binary);
+      std::ofstream os2("Backend/staff_SER02.json");
+      cereal::BinaryOutputArchive oarchive1(os1);
+      cereal::JSONOutputArchive oarchive2(os2);
+      oarchive1(CEREAL_NVP(staff));
+      oarchive2(CEREAL_NVP(staff));
+    }
+    auto t1 = clock::now();
+    {
+      std::ofstream os1("Backend/staff_SER02_tee.bin", std::ios::binary);
+      std::ofstream os2("Backend/staff_SER02_tee.json");
+      cereal::BufferedSink<cereal::BinaryOutputArchive> sink1(os1);
+      cereal::BufferedSink<cereal::JSONOutputArchive> sink2(os2);
+
+      {
+        cereal::TeeOutputArchive tee(sink1.archive(), sink2.archive());
+        tee(CEREAL_NVP(staff));
+      }
+      sink1.finish();
+      sink2.finish();
+    }
+    auto t2 = clock::now();
+
+    Rcpp::Rcout << "two archives:           " << std::chrono::duration<double>(t1 - t0).count() << " s" << std::endl;
+    Rcpp::Rcout << "tee with buffered sinks: " << std::chrono::duration<double>(t2 - t1).count() << " s" << std::endl;
+
+    std::vector<EmployeeData> staff2;
+    std::ifstream is("Backend/staff_SER02_tee.json");
+    cereal::JSONInputArchive iarchive(is);
+    iarchive(CEREAL_NVP(staff2));
+    Rcpp::Rcout << staff2.size() << " employees, last: " << staff2.back().get_name() << std::endl;
+  }
+
+  return 0;
+}
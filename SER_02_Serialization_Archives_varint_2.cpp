@@ -0,0 +1,552 @@
+// SER_02: Compact binary archive with varint integers
+// ----------------------------------------------------------------------------
+// cereal::BinaryOutputArchive writes integers at their full width and every
+// container size as a 64 bit size_tag. Our record streams consist mostly of
+// small numbers (EmployeeData::age, MyNode::node_id, short containers), i.e.,
+// of zero bytes.
+//
+// CompactBinaryOutputArchive / CompactBinaryInputArchive store
+// - integers (16 bit and wider) and size tags as LEB128 varints, 7 bits per
+//   byte, signed integers zigzag encoded first (0, -1, 1, -2, ... -> 0, 1, 2,
+//   3, ...), so small negative numbers stay short as well
+// - bulk arrays of 32 bit integers (std::vector<int> etc., i.e., everything
+//   cereal writes as binary_data) in the stream VByte format: 2 bit length
+//   codes, four per control byte, followed by the 1-4 data bytes per value.
+//   Decoding a group of four values is one byte shuffle (SSSE3), the shuffle
+//   masks are looked up by the control byte. Build with, e.g.,
+//     Sys.setenv(PKG_CXXFLAGS = "-march=native")
+//   for the SIMD decoder, a scalar fallback is used otherwise.
+// - 16/64 bit integer arrays as LEB128, everything else (bool, char, floating
+//   point) as raw bytes like the cereal binary archive
+// Arrays are cut into chunks of 64K values, each chunk is prefixed with its
+// size in bytes and written with a single call.
+//
+// NOTE:
+// - Data bytes are little endian, floating point values are written in host
+//   byte order as by cereal::BinaryOutputArchive.
+// - Malformed input (overlong varints, values out of range of the target
+//   type) throws a cereal::Exception.
+// ----------------------------------------------------------------------------
+// [[Rcpp::plugins("cpp17")]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if defined(__SSSE3__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include <cereal/cereal.hpp>
+#include <cereal/archives/binary.hpp>
+#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
+
+#include <Rcpp.h>
+
+
+namespace cereal
+{
+  namespace compact_detail
+  {
+    template<class T> inline
+    typename std::make_unsigned<T>::type zigzag( T t )
+    {
+      using U = typename std::make_unsigned<T>::type;
+      if constexpr( std::is_signed<T>::value ) {
+        return static_cast<U>( ( static_cast<U>( t ) << 1 ) ^ static_cast<U>( t >> ( sizeof( T ) * 8 - 1 ) ) );
+      } else {
+        return t;
+      }
+    }
+
+    template<class T> inline
+    T unzigzag( typename std::make_unsigned<T>::type u )
+    {
+      using U = typename std::make_unsigned<T>::type;
+      if constexpr( std::is_signed<T>::value ) {
+        return static_cast<T>( static_cast<U>( ( u >> 1 ) ^ static_cast<U>( 0 - ( u & 1 ) ) ) );
+      } else {
+        return u;
+      }
+    }
+
+    // LEB128, at most 10 bytes
+    inline std::size_t encode_varint( std::uint64_t v, char* out )
+    {
+      std::size_t n = 0;
+      while( v >= 0x80 ) {
+        out[n++] = static_cast<char>( ( v & 0x7f ) | 0x80 );
+        v >>= 7;
+      }
+      out[n++] = static_cast<char>( v );
+      return n;
+    }
+
+    // Decodes one varint from [p, end), nullptr if malformed
+    inline const char* decode_varint( const char* p, const char* end, std::uint64_t& v )
+    {
+      v = 0;
+      for( unsigned shift = 0; shift < 64 && p < end; shift += 7 ) {
+        const std::uint64_t b = static_cast<unsigned char>( *p++ );
+        if( shift == 63 && b > 1 ) {
+          return nullptr;   // the 10th byte holds bit 63 only
+        }
+        v |= ( b & 0x7f ) << shift;
+        if( b < 0x80 ) {
+          return p;
+        }
+      }
+      return nullptr;
+    }
+
+    // Shuffle masks and data lengths of the stream VByte groups
+    struct SVBTables
+    {
+      alignas(16) unsigned char shuffle[256][16];
+      unsigned char length[256];
+
+      SVBTables()
+      {
+        for( int c = 0; c < 256; ++c ) {
+          int offset = 0;
+          for( int i = 0; i < 4; ++i ) {
+            const int len = ( ( c >> ( 2 * i ) ) & 3 ) + 1;
+            for( int j = 0; j < 4; ++j ) {
+              shuffle[c][4 * i + j] = static_cast<unsigned char>( j < len ? offset + j : 0x80 );
+            }
+            offset += len;
+          }
+          length[c] = static_cast<unsigned char>( offset );
+        }
+      }
+    };
+
+    inline const SVBTables& svb_tables()
+    {
+      static const SVBTables tables;
+      return tables;
+    }
+
+    inline int svb_length( std::uint32_t v )
+    {
+      return v < ( 1u << 8 ) ? 1 : v < ( 1u << 16 ) ? 2 : v < ( 1u << 24 ) ? 3 : 4;
+    }
+
+    // n values into control bytes + data bytes, returns the bytes written.
+    // out needs room for (n + 3) / 4 + 4 * n bytes.
+    template<class T> inline
+    std::size_t svb_encode( const T* in, std::size_t n, char* out )
+    {
+      unsigned char* ctrl = reinterpret_cast<unsigned char*>( out );
+      unsigned char* data = ctrl + ( n + 3 ) / 4;
+      std::memset( ctrl, 0, ( n + 3 ) / 4 );
+
+      for( std::size_t i = 0; i < n; ++i ) {
+        const std::uint32_t v = zigzag( in[i] );
+        const int len = svb_length( v );
+        ctrl[i / 4] |= static_cast<unsigned char>( ( len - 1 ) << ( 2 * ( i % 4 ) ) );
+        for( int j = 0; j < len; ++j ) {
+          *data++ = static_cast<unsigned char>( v >> ( 8 * j ) );
+        }
+      }
+      return static_cast<std::size_t>( reinterpret_cast<char*>( data ) - out );
+    }
+
+    // Decodes n values from in[0, size). in has to be readable up to in + size + 16.
+    // Returns false if the lengths do not match size.
+    template<class T> inline
+    bool svb_decode( const char* in, std::size_t size, T* out, std::size_t n )
+    {
+      const std::size_t n_ctrl = ( n + 3 ) / 4;
+      if( n_ctrl > size ) {
+        return false;
+      }
+      const unsigned char* ctrl = reinterpret_cast<const unsigned char*>( in );
+      const unsigned char* data = ctrl + n_ctrl;
+      const unsigned char* end = reinterpret_cast<const unsigned char*>( in ) + size;
+      const SVBTables& tab = svb_tables();
+
+      std::size_t i = 0;
+#if defined(__SSSE3__) || defined(__AVX2__)
+      const __m128i one = _mm_set1_epi32( 1 );
+      for( ; i + 4 <= n; i += 4 ) {
+        const unsigned char c = ctrl[i / 4];
+        if( data > end ) {
+          return false;
+        }
+        const __m128i d = _mm_loadu_si128( reinterpret_cast<const __m128i*>( data ) );
+        __m128i v = _mm_shuffle_epi8( d, _mm_load_si128( reinterpret_cast<const __m128i*>( tab.shuffle[c] ) ) );
+        if( std::is_signed<T>::value ) {
+          v = _mm_xor_si128( _mm_srli_epi32( v, 1 ), _mm_sub_epi32( _mm_setzero_si128(), _mm_and_si128( v, one ) ) );
+        }
+        _mm_storeu_si128( reinterpret_cast<__m128i*>( out + i ), v );
+        data += tab.length[c];
+      }
+#endif
+      for( ; i < n; ++i ) {
+        const int len = ( ( ctrl[i / 4] >> ( 2 * ( i % 4 ) ) ) & 3 ) + 1;
+        if( data + len > end ) {
+          return false;
+        }
+        std::uint32_t v = 0;
+        for( int j = 0; j < len; ++j ) {
+          v |= static_cast<std::uint32_t>( data[j] ) << ( 8 * j );
+        }
+        out[i] = unzigzag<T>( v );
+        data += len;
+      }
+      (void)tab;
+      return data == end;
+    }
+
+    // Values per chunk of a bulk array, a multiple of 4
+    constexpr std::size_t chunk_values = std::size_t( 1 ) << 16;
+  }
+
+
+  class CompactBinaryOutputArchive : public OutputArchive<CompactBinaryOutputArchive, AllowEmptyClassElision>
+  {
+  public:
+    CompactBinaryOutputArchive( std::ostream& stream ) :
+      OutputArchive<CompactBinaryOutputArchive, AllowEmptyClassElision>( this ),
+      itsStream( stream )
+    { }
+
+    ~CompactBinaryOutputArchive() CEREAL_NOEXCEPT = default;
+
+    void saveBinary( const void* data, std::streamsize size )
+    {
+      auto const written = itsStream.rdbuf()->sputn( reinterpret_cast<const char*>( data ), size );
+      if( written != size ) {
+        throw Exception( "Failed to write " + std::to_string( size ) + " bytes to output stream! Wrote " + std::to_string( written ) );
+      }
+    }
+
+    void saveVarint( std::uint64_t v )
+    {
+      char buf[10];
+      saveBinary( buf, static_cast<std::streamsize>( compact_detail::encode_varint( v, buf ) ) );
+    }
+
+    // Integer array, each chunk as byte count + stream VByte or LEB128 data
+    template<class T>
+    void saveIntegers( const T* data, std::size_t n )
+    {
+      for( std::size_t i = 0; i < n; i += compact_detail::chunk_values ) {
+        const std::size_t k = std::min( compact_detail::chunk_values, n - i );
+        std::size_t bytes = 0;
+        if constexpr( sizeof( T ) == 4 ) {
+          itsScratch.resize( ( k + 3 ) / 4 + 4 * k );
+          bytes = compact_detail::svb_encode( data + i, k, itsScratch.data() );
+        } else {
+          itsScratch.resize( 10 * k );
+          for( std::size_t j = 0; j < k; ++j ) {
+            bytes += compact_detail::encode_varint( compact_detail::zigzag( data[i + j] ), itsScratch.data() + bytes );
+          }
+        }
+        saveVarint( bytes );
+        saveBinary( itsScratch.data(), static_cast<std::streamsize>( bytes ) );
+      }
+    }
+
+  private:
+    std::ostream& itsStream;
+    std::vector<char> itsScratch;
+  };
+
+
+  class CompactBinaryInputArchive : public InputArchive<CompactBinaryInputArchive, AllowEmptyClassElision>
+  {
+  public:
+    CompactBinaryInputArchive( std::istream& stream ) :
+      InputArchive<CompactBinaryInputArchive, AllowEmptyClassElision>( this ),
+      itsStream( stream )
+    { }
+
+    ~CompactBinaryInputArchive() CEREAL_NOEXCEPT = default;
+
+    void loadBinary( void* const data, std::streamsize size )
+    {
+      auto const read = itsStream.rdbuf()->sgetn( reinterpret_cast<char*>( data ), size );
+      if( read != size ) {
+        throw Exception( "Failed to read " + std::to_string( size ) + " bytes from input stream! Read " + std::to_string( read ) );
+      }
+    }
+
+    std::uint64_t loadVarint()
+    {
+      std::streambuf* buf = itsStream.rdbuf();
+      std::uint64_t v = 0;
+      for( unsigned shift = 0; shift < 64; shift += 7 ) {
+        const auto c = buf->sbumpc();
+        if( c == std::char_traits<char>::eof() ) {
+          throw Exception( "Failed to read varint from input stream!" );
+        }
+        if( shift == 63 && c > 1 ) {
+          break;   // the 10th byte holds bit 63 only
+        }
+        v |= static_cast<std::uint64_t>( c & 0x7f ) << shift;
+        if( ( c & 0x80 ) == 0 ) {
+          return v;
+        }
+      }
+      throw Exception( "Malformed varint in input stream!" );
+    }
+
+    template<class T>
+    T loadInteger()
+    {
+      using U = typename std::make_unsigned<T>::type;
+      const std::uint64_t v = loadVarint();
+      if( v > std::numeric_limits<U>::max() ) {
+        throw Exception( "Varint out of range of the " + std::to_string( sizeof( T ) ) + " byte target type!" );
+      }
+      return compact_detail::unzigzag<T>( static_cast<U>( v ) );
+    }
+
+    template<class T>
+    void loadIntegers( T* data, std::size_t n )
+    {
+      using U = typename std::make_unsigned<T>::type;
+
+      for( std::size_t i = 0; i < n; i += compact_detail::chunk_values ) {
+        const std::size_t k = std::min( compact_detail::chunk_values, n - i );
+        const std::uint64_t bytes = loadVarint();
+        const std::size_t max_bytes = sizeof( T ) == 4 ? ( k + 3 ) / 4 + 4 * k : 10 * k;
+        if( bytes > max_bytes ) {
+          throw Exception( "Malformed integer array in input stream!" );
+        }
+        itsScratch.resize( static_cast<std::size_t>( bytes ) + 16 );   // slack for 16 byte loads
+        loadBinary( itsScratch.data(), static_cast<std::streamsize>( bytes ) );
+
+        bool ok = true;
+        if constexpr( sizeof( T ) == 4 ) {
+          ok = compact_detail::svb_decode( itsScratch.data(), static_cast<std::size_t>( bytes ), data + i, k );
+        } else {
+          const char* p = itsScratch.data();
+          const char* end = p + bytes;
+          for( std::size_t j = 0; j < k && ok; ++j ) {
+            std::uint64_t v;
+            p = compact_detail::decode_varint( p, end, v );
+            ok = p != nullptr && v <= std::numeric_limits<U>::max();
+            if( ok ) {
+              data[i + j] = compact_detail::unzigzag<T>( static_cast<U>( v ) );
+            }
+          }
+          ok = ok && p == end;
+        }
+        if( !ok ) {
+          throw Exception( "Malformed integer array in input stream!" );
+        }
+      }
+    }
+
+  private:
+    std::istream& itsStream;
+    std::vector<char> itsScratch;
+  };
+
+
+  namespace compact_detail
+  {
+    // integers worth a varint
+    template<class T>
+    using is_varint = std::integral_constant<bool, std::is_integral<T>::value && !std::is_same<T, bool>::value && ( sizeof( T ) > 1 )>;
+  }
+
+  // Common serialization functions
+  // --------------------------------
+  template<class T> inline
+  typename std::enable_if<std::is_arithmetic<T>::value, void>::type
+  CEREAL_SAVE_FUNCTION_NAME( CompactBinaryOutputArchive& ar, T const& t )
+  {
+    if constexpr( compact_detail::is_varint<T>::value ) {
+      ar.saveVarint( compact_detail::zigzag( t ) );
+    } else {
+      ar.saveBinary( std::addressof( t ), sizeof( t ) );
+    }
+  }
+
+  template<class T> inline
+  typename std::enable_if<std::is_arithmetic<T>::value, void>::type
+  CEREAL_LOAD_FUNCTION_NAME( CompactBinaryInputArchive& ar, T& t )
+  {
+    if constexpr( compact_detail::is_varint<T>::value ) {
+      t = ar.loadInteger<T>();
+    } else {
+      ar.loadBinary( std::addressof( t ), sizeof( t ) );
+    }
+  }
+
+  template<class Archive, class T> inline
+  CEREAL_ARCHIVE_RESTRICT(CompactBinaryInputArchive, CompactBinaryOutputArchive)
+  CEREAL_SERIALIZE_FUNCTION_NAME( Archive& ar, NameValuePair<T>& t )
+  {
+    ar( t.value );
+  }
+
+  template<class T> inline
+  void CEREAL_SAVE_FUNCTION_NAME( CompactBinaryOutputArchive& ar, SizeTag<T> const& t )
+  {
+    ar.saveVarint( static_cast<std::uint64_t>( t.size ) );
+  }
+
+  template<class T> inline
+  void CEREAL_LOAD_FUNCTION_NAME( CompactBinaryInputArchive& ar, SizeTag<T>& t )
+  {
+    t.size = ar.loadInteger<typename std::remove_reference<T>::type>();
+  }
+
+  template<class T> inline
+  void CEREAL_SAVE_FUNCTION_NAME( CompactBinaryOutputArchive& ar, BinaryData<T> const& bd )
+  {
+    using TT = std::remove_cv_t<std::remove_pointer_t<std::remove_reference_t<T>>>;
+    if constexpr( compact_detail::is_varint<TT>::value ) {
+      if( bd.size % sizeof( TT ) != 0 ) {
+        throw Exception( "Binary data of " + std::to_string( bd.size ) + " bytes is not a whole number of " +
+                         std::to_string( sizeof( TT ) ) + " byte integers!" );
+      }
+      ar.saveIntegers( static_cast<const TT*>( bd.data ), static_cast<std::size_t>( bd.size ) / sizeof( TT ) );
+    } else {
+      ar.saveBinary( bd.data, static_cast<std::streamsize>( bd.size ) );
+    }
+  }
+
+  template<class T> inline
+  void CEREAL_LOAD_FUNCTION_NAME( CompactBinaryInputArchive& ar, BinaryData<T>& bd )
+  {
+    using TT = std::remove_cv_t<std::remove_pointer_t<std::remove_reference_t<T>>>;
+    if constexpr( compact_detail::is_varint<TT>::value ) {
+      if( bd.size % sizeof( TT ) != 0 ) {
+        throw Exception( "Binary data of " + std::to_string( bd.size ) + " bytes is not a whole number of " +
+                         std::to_string( sizeof( TT ) ) + " byte integers!" );
+      }
+      ar.loadIntegers( static_cast<TT*>( bd.data ), static_cast<std::size_t>( bd.size ) / sizeof( TT ) );
+    } else {
+      ar.loadBinary( bd.data, static_cast<std::streamsize>( bd.size ) );
+    }
+  }
+}
+
+// register archives for polymorphic support
+CEREAL_REGISTER_ARCHIVE(cereal::CompactBinaryOutputArchive)
+CEREAL_REGISTER_ARCHIVE(cereal::CompactBinaryInputArchive)
+
+// tie input and output archives together
+CEREAL_SETUP_ARCHIVE_TRAITS(cereal::CompactBinaryInputArchive, cereal::CompactBinaryOutputArchive)
+
+
+class EmployeeData
+{
+
+  public:
+    EmployeeData() = default;
+    EmployeeData(std::string name, int age, std::string company)
+      : name{name}, age{age}, company{company} {}
+
+    std::string get_name() const { return name; }
+    int get_age() const { return age; }
+
+  private:
+
+    std::string name;
+    int age;
+    std::string company;
+
+    friend class cereal::access;
+
+    template<class Archive>
+    void serialize(Archive& archive)
+    {
+      archive(
+        CEREAL_NVP(name),
+        CEREAL_NVP(age),
+        CEREAL_NVP(company)
+      );
+    }
+
+};
+
+
+// MyNode from SER_07_Pointers_2
+struct MyNode
+{
+  int node_id;
+
+  template<class Archive>
+  void serialize(Archive& archive)
+  {
+    archive(node_id);
+  }
+};
+
+
+// bytes and seconds to write and read t
+template<class OArchive, class IArchive, class T>
+void report(const char* what, const char* archive, const T& t)
+{
+  using clock = std::chrono::steady_clock;
+  std::stringstream ss;
+
+  auto t0 = clock::now();
+  {
+    OArchive oarchive(ss);
+    oarchive(t);
+  }
+  auto t1 = clock::now();
+  T back;
+  {
+    IArchive iarchive(ss);
+    iarchive(back);
+  }
+  auto t2 = clock::now();
+
+  Rcpp::Rcout << what << ", " << archive << ": " << ss.str().size() << " bytes, save "
+              << std::chrono::duration<double>(t1 - t0).count() << " s, load "
+              << std::chrono::duration<double>(t2 - t1).count() << " s" << std::endl;
+}
+
+
+// [[Rcpp::export]]
+int main()
+{
+  std::vector<EmployeeData> staff;
+  std::vector<MyNode> nodes;
+  std::vector<int> ids;
+  for (int i = 0; i < 1000000; ++i) {
+    staff.emplace_back("Employee " + std::to_string(i), 20 + i % 45, "Company " + std::to_string(i % 100));
+    nodes.push_back(MyNode{i % 1000});
+    ids.push_back((i % 2 ? -1 : 1) * (i % 5000));
+  }
+
+  report<cereal::BinaryOutputArchive, cereal::BinaryInputArchive>("EmployeeData", "binary ", staff);
+  report<cereal::CompactBinaryOutputArchive, cereal::CompactBinaryInputArchive>("EmployeeData", "compact", staff);
+  report<cereal::BinaryOutputArchive, cereal::BinaryInputArchive>("MyNode", "binary ", nodes);
+  report<cereal::CompactBinaryOutputArchive, cereal::CompactBinaryInputArchive>("MyNode", "compact", nodes);
+  report<cereal::BinaryOutputArchive, cereal::BinaryInputArchive>("std::vector<int>", "binary ", ids);
+  report<cereal::CompactBinaryOutputArchive, cereal::CompactBinaryInputArchive>("std::vector<int>", "compact", ids);
+
+  { // round trip check
+    std::stringstream ss;
+    {
+      cereal::CompactBinaryOutputArchive oarchive(ss);
+      oarchive(staff, ids);
+    }
+    std::vector<EmployeeData> staff2;
+    std::vector<int> ids2;
+    cereal::CompactBinaryInputArchive iarchive(ss);
+    iarchive(staff2, ids2);
+    Rcpp::Rcout << "last: " << staff2.back().get_name() << ", " << staff2.back().get_age()
+                << ", ids equal: " << (ids == ids2) << std::endl;
+  }
+
+  return 0;
+}
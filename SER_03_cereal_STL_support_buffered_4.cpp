@@ -0,0 +1,470 @@
+// SER_03: Buffered binary archives over concrete sinks
+// ----------------------------------------------------------------------------
+// cereal::BinaryOutputArchive hands every primitive to std::streambuf::sputn,
+// a virtual call which also checks the put area, i.e., ar(x, y, z) on MyData
+// costs three calls through the streambuf. Writing millions of small records
+// is therefore limited by the call overhead, not by the disk.
+//
+// BufferedBinaryOutputArchive<Sink> / BufferedBinaryInputArchive<Source>
+// keep their own large buffer (1 MB by default) and know the type of the
+// device they talk to:
+// - primitives are copied into the buffer with a fixed size memcpy, which the
+//   compiler turns into plain loads/stores
+// - the device is called once per full buffer; blocks larger than the buffer
+//   bypass it
+// - devices: FileSink/FileSource (C stdio, unbuffered, one fwrite/fread per
+//   block) and StreamSink/StreamSource (one sputn/sgetn per block on any
+//   std::ostream/std::istream); a device is any class with
+//     void write( const char* data, std::size_t n );  void flush();
+//     std::size_t read( char* data, std::size_t n );   // 0 at the end
+// The data layout is the one of cereal::BinaryOutputArchive, both can read
+// each other's files.
+//
+// NOTE:
+// The output archive writes the rest of its buffer when it is destroyed.
+// Errors at that point cannot be reported, call flush() to get them as
+// cereal::Exception.
+// ----------------------------------------------------------------------------
+// [[Rcpp::plugins("cpp17")]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cereal/cereal.hpp>
+#include <cereal/archives/binary.hpp>
+#include <cereal/types/unordered_map.hpp>
+#include <cereal/types/memory.hpp>
+#include <cereal/types/vector.hpp>
+
+#include <Rcpp.h>
+
+
+namespace cereal
+{
+  // Devices
+  // --------------------------------
+  class FileSink
+  {
+  public:
+    explicit FileSink( const std::string& path ) :
+      itsFile( std::fopen( path.c_str(), "wb" ) )
+    {
+      if( !itsFile ) {
+        throw Exception( "FileSink: cannot open " + path );
+      }
+      std::setvbuf( itsFile, nullptr, _IONBF, 0 );   // the archive buffers
+    }
+
+    FileSink( FileSink&& other ) noexcept : itsFile( std::exchange( other.itsFile, nullptr ) ) { }
+    FileSink& operator=( FileSink&& ) = delete;
+
+    ~FileSink()
+    {
+      if( itsFile ) {
+        std::fclose( itsFile );
+      }
+    }
+
+    void write( const char* data, std::size_t n )
+    {
+      if( std::fwrite( data, 1, n, itsFile ) != n ) {
+        throw Exception( "FileSink: failed to write " + std::to_string( n ) + " bytes" );
+      }
+    }
+
+    void flush()
+    {
+      if( std::fflush( itsFile ) != 0 ) {
+        throw Exception( "FileSink: flush failed" );
+      }
+    }
+
+  private:
+    std::FILE* itsFile;
+  };
+
+
+  class FileSource
+  {
+  public:
+    explicit FileSource( const std::string& path ) :
+      itsFile( std::fopen( path.c_str(), "rb" ) )
+    {
+      if( !itsFile ) {
+        throw Exception( "FileSource: cannot open " + path );
+      }
+      std::setvbuf( itsFile, nullptr, _IONBF, 0 );
+    }
+
+    FileSource( FileSource&& other ) noexcept : itsFile( std::exchange( other.itsFile, nullptr ) ) { }
+    FileSource& operator=( FileSource&& ) = delete;
+
+    ~FileSource()
+    {
+      if( itsFile ) {
+        std::fclose( itsFile );
+      }
+    }
+
+    std::size_t read( char* data, std::size_t n )
+    {
+      const std::size_t got = std::fread( data, 1, n, itsFile );
+      if( got < n && std::ferror( itsFile ) ) {
+        throw Exception( "FileSource: read failed" );
+      }
+      return got;
+    }
+
+  private:
+    std::FILE* itsFile;
+  };
+
+
+  class StreamSink
+  {
+  public:
+    explicit StreamSink( std::ostream& stream ) : itsStream( stream ) { }
+
+    void write( const char* data, std::size_t n )
+    {
+      auto const written = itsStream.rdbuf()->sputn( data, static_cast<std::streamsize>( n ) );
+      if( written != static_cast<std::streamsize>( n ) ) {
+        throw Exception( "Failed to write " + std::to_string( n ) + " bytes to output stream! Wrote " + std::to_string( written ) );
+      }
+    }
+
+    void flush()
+    {
+      itsStream.flush();
+    }
+
+  private:
+    std::ostream& itsStream;
+  };
+
+
+  class StreamSource
+  {
+  public:
+    explicit StreamSource( std::istream& stream ) : itsStream( stream ) { }
+
+    std::size_t read( char* data, std::size_t n )
+    {
+      return static_cast<std::size_t>( itsStream.rdbuf()->sgetn( data, static_cast<std::streamsize>( n ) ) );
+    }
+
+  private:
+    std::istream& itsStream;
+  };
+
+
+  // Archives
+  // --------------------------------
+  template<class Sink>
+  class BufferedBinaryOutputArchive : public OutputArchive<BufferedBinaryOutputArchive<Sink>, AllowEmptyClassElision>
+  {
+  public:
+    explicit BufferedBinaryOutputArchive( Sink sink, std::size_t buffer_size = 1 << 20 ) :
+      OutputArchive<BufferedBinaryOutputArchive<Sink>, AllowEmptyClassElision>( this ),
+      itsSink( std::move( sink ) ),
+      itsBuffer( new char[buffer_size] ),
+      itsCapacity( buffer_size )
+    { }
+
+    ~BufferedBinaryOutputArchive() CEREAL_NOEXCEPT
+    {
+      try {
+        writeBuffer();
+      } catch( ... ) { }
+    }
+
+    inline void saveBinary( const void* data, std::size_t size )
+    {
+      if( size <= itsCapacity - itsSize ) {
+        if( size > 0 ) {   // empty blocks may come with a null pointer
+          std::memcpy( itsBuffer.get() + itsSize, data, size );
+        }
+        itsSize += size;
+        return;
+      }
+      saveSlow( static_cast<const char*>( data ), size );
+    }
+
+    // Hands the buffer to the device and flushes the device
+    void flush()
+    {
+      writeBuffer();
+      itsSink.flush();
+    }
+
+  private:
+    void writeBuffer()
+    {
+      if( itsSize > 0 ) {
+        itsSink.write( itsBuffer.get(), itsSize );
+        itsSize = 0;
+      }
+    }
+
+    void saveSlow( const char* data, std::size_t size )
+    {
+      writeBuffer();
+      if( size >= itsCapacity ) {
+        itsSink.write( data, size );
+        return;
+      }
+      std::memcpy( itsBuffer.get(), data, size );
+      itsSize = size;
+    }
+
+    Sink itsSink;
+    std::unique_ptr<char[]> itsBuffer;
+    std::size_t itsCapacity;
+    std::size_t itsSize = 0;
+  };
+
+
+  template<class Source>
+  class BufferedBinaryInputArchive : public InputArchive<BufferedBinaryInputArchive<Source>, AllowEmptyClassElision>
+  {
+  public:
+    explicit BufferedBinaryInputArchive( Source source, std::size_t buffer_size = 1 << 20 ) :
+      InputArchive<BufferedBinaryInputArchive<Source>, AllowEmptyClassElision>( this ),
+      itsSource( std::move( source ) ),
+      itsBuffer( new char[buffer_size] ),
+      itsCapacity( buffer_size ),
+      itsPos( itsBuffer.get() ),
+      itsEnd( itsBuffer.get() )
+    { }
+
+    ~BufferedBinaryInputArchive() CEREAL_NOEXCEPT = default;
+
+    inline void loadBinary( void* const data, std::size_t size )
+    {
+      if( size <= static_cast<std::size_t>( itsEnd - itsPos ) ) {
+        if( size > 0 ) {
+          std::memcpy( data, itsPos, size );
+        }
+        itsPos += size;
+        return;
+      }
+      loadSlow( static_cast<char*>( data ), size );
+    }
+
+  private:
+    // Reads until the buffer holds at least need bytes or the source ends
+    void refill( std::size_t need )
+    {
+      itsPos = itsEnd = itsBuffer.get();
+      while( static_cast<std::size_t>( itsEnd - itsPos ) < need ) {
+        const std::size_t got = itsSource.read( itsEnd, itsCapacity - static_cast<std::size_t>( itsEnd - itsPos ) );
+        if( got == 0 ) {
+          break;
+        }
+        itsEnd += got;
+      }
+    }
+
+    void loadSlow( char* data, std::size_t size )
+    {
+      const std::size_t avail = static_cast<std::size_t>( itsEnd - itsPos );
+      if( avail > 0 ) {
+        std::memcpy( data, itsPos, avail );
+        data += avail;
+        size -= avail;
+      }
+      itsPos = itsEnd;
+
+      std::size_t got = 0;
+      if( size >= itsCapacity ) {   // large blocks go straight to the target
+        for( std::size_t n = 1; got < size && n > 0; got += n ) {
+          n = itsSource.read( data + got, size - got );
+        }
+      } else {
+        refill( size );
+        got = std::min( size, static_cast<std::size_t>( itsEnd - itsPos ) );
+        std::memcpy( data, itsPos, got );
+        itsPos += got;
+      }
+
+      if( got != size ) {
+        throw Exception( "Failed to read " + std::to_string( size ) + " bytes from input stream! Read " + std::to_string( got ) );
+      }
+    }
+
+    Source itsSource;
+    std::unique_ptr<char[]> itsBuffer;
+    std::size_t itsCapacity;
+    char* itsPos;
+    char* itsEnd;
+  };
+
+
+  using FileOutputArchive = BufferedBinaryOutputArchive<FileSink>;
+  using FileInputArchive = BufferedBinaryInputArchive<FileSource>;
+
+
+  // Common serialization functions, as for the cereal binary archives
+  // --------------------------------
+  template<class Sink, class T> inline
+  typename std::enable_if<std::is_arithmetic<T>::value, void>::type
+  CEREAL_SAVE_FUNCTION_NAME( BufferedBinaryOutputArchive<Sink>& ar, T const& t )
+  {
+    ar.saveBinary( std::addressof( t ), sizeof( t ) );
+  }
+
+  template<class Source, class T> inline
+  typename std::enable_if<std::is_arithmetic<T>::value, void>::type
+  CEREAL_LOAD_FUNCTION_NAME( BufferedBinaryInputArchive<Source>& ar, T& t )
+  {
+    ar.loadBinary( std::addressof( t ), sizeof( t ) );
+  }
+
+  template<class Sink, class T> inline
+  void CEREAL_SAVE_FUNCTION_NAME( BufferedBinaryOutputArchive<Sink>& ar, NameValuePair<T> const& t )
+  {
+    ar( t.value );
+  }
+
+  template<class Source, class T> inline
+  void CEREAL_LOAD_FUNCTION_NAME( BufferedBinaryInputArchive<Source>& ar, NameValuePair<T>& t )
+  {
+    ar( t.value );
+  }
+
+  template<class Sink, class T> inline
+  void CEREAL_SAVE_FUNCTION_NAME( BufferedBinaryOutputArchive<Sink>& ar, SizeTag<T> const& t )
+  {
+    ar( t.size );
+  }
+
+  template<class Source, class T> inline
+  void CEREAL_LOAD_FUNCTION_NAME( BufferedBinaryInputArchive<Source>& ar, SizeTag<T>& t )
+  {
+    ar( t.size );
+  }
+
+  template<class Sink, class T> inline
+  void CEREAL_SAVE_FUNCTION_NAME( BufferedBinaryOutputArchive<Sink>& ar, BinaryData<T> const& bd )
+  {
+    ar.saveBinary( bd.data, static_cast<std::size_t>( bd.size ) );
+  }
+
+  template<class Source, class T> inline
+  void CEREAL_LOAD_FUNCTION_NAME( BufferedBinaryInputArchive<Source>& ar, BinaryData<T>& bd )
+  {
+    ar.loadBinary( bd.data, static_cast<std::size_t>( bd.size ) );
+  }
+
+  namespace traits
+  {
+    namespace detail
+    {
+      // tie input and output archives together, per device pair
+      template<>
+      struct get_output_from_input<cereal::FileInputArchive>
+      {
+        using type = cereal::FileOutputArchive;
+      };
+
+      template<>
+      struct get_input_from_output<cereal::FileOutputArchive>
+      {
+        using type = cereal::FileInputArchive;
+      };
+
+      template<>
+      struct get_output_from_input<cereal::BufferedBinaryInputArchive<cereal::StreamSource>>
+      {
+        using type = cereal::BufferedBinaryOutputArchive<cereal::StreamSink>;
+      };
+
+      template<>
+      struct get_input_from_output<cereal::BufferedBinaryOutputArchive<cereal::StreamSink>>
+      {
+        using type = cereal::BufferedBinaryInputArchive<cereal::StreamSource>;
+      };
+    }
+  }
+}
+
+// register archives for polymorphic support
+CEREAL_REGISTER_ARCHIVE(cereal::FileOutputArchive)
+CEREAL_REGISTER_ARCHIVE(cereal::FileInputArchive)
+CEREAL_REGISTER_ARCHIVE(cereal::BufferedBinaryOutputArchive<cereal::StreamSink>)
+CEREAL_REGISTER_ARCHIVE(cereal::BufferedBinaryInputArchive<cereal::StreamSource>)
+
+
+// MyRecord from SER_03_cereal_STL_support_4
+struct MyRecord
+{
+  uint8_t x, y;
+  float z;
+
+  template<class Archive>
+  void serialize(Archive& ar)
+  {
+    ar(x, y, z);
+  }
+};
+
+
+struct SomeData
+{
+  int32_t id;
+  std::shared_ptr<std::unordered_map<uint32_t, MyRecord>> data;
+
+  template <typename Archive>
+  void save(Archive& ar) const
+  {
+    ar(data);
+  }
+
+  template <typename Archive>
+  void load(Archive& ar)
+  {
+    static int32_t idGen = 0;
+    id = idGen++;
+    ar(data);
+  }
+};
+
+
+// [[Rcpp::export]]
+int main()
+{
+  const std::string path_to_file{"Backend/test_output_buffered.cereal"};
+
+  { // write with the buffered archive
+    SomeData myData;
+    myData.data = std::make_shared<std::unordered_map<uint32_t, MyRecord>>();
+    for (uint32_t i = 0; i < 10; ++i) {
+      (*myData.data)[i] = MyRecord{uint8_t(i), uint8_t(2 * i), 0.5f * i};
+    }
+
+    cereal::FileOutputArchive archive(cereal::FileSink{path_to_file});
+    archive(myData);
+    archive.flush();
+  }
+
+  { // ... and read with the cereal binary archive, the layout is the same
+    std::ifstream is(path_to_file, std::ios::binary);
+    cereal::BinaryInputArchive archive(is);
+
+    SomeData myData;
+    archive(myData);
+    const MyRecord& r = myData.data->at(3);
+    Rcpp::Rcout << "entries: " << myData.data->size()
+                << ", record 3: " << int(r.x) << " " << int(r.y) << " " << r.z << std::endl;
+  }
+
+  return 0;
+}
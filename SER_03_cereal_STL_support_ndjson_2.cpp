@@ -0,0 +1,333 @@
+// SER_03: NDJSON record streams
+// ----------------------------------------------
+// A cereal::JSONOutputArchive produces one JSON document per archive. A log of
+// records written like that can neither be appended to (the closing brace is
+// written on destruction) nor split for parallel reading.
+//
+// NDJSON (newline delimited JSON, https://github.com/ndjson/ndjson-spec) stores
+// one compact JSON value per line instead:
+//
+//   {"name": "Hans","age": 21,"company": "Google"}
+//   {"name": "Juergen","age": 56,"company": "SAP"}
+//
+// cereal::NDJSONOutputArchive
+// - serializes every record with the cereal JSON archive (no indentation),
+//   removes the line breaks and the "value0" wrapper, and appends the line to
+//   a large buffer which is written in whole lines
+// - opens the file for appending by default, i.e., a log can be continued
+//   across sessions
+//
+// cereal::load_ndjson<T>() reads the file in large blocks, cuts each block
+// at the last newline and parses the lines of a block in parallel (OpenMP),
+// one cereal JSON archive per line. The records keep the order of the file.
+//
+// NOTE:
+// JSON strings never contain raw line breaks (they are written as \n), hence
+// a newline always ends a record.
+// ----------------------------------------------
+
+// [[Rcpp::plugins("cpp17")]]
+// [[Rcpp::plugins(openmp)]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <cereal/archives/json.hpp>
+#include <cereal/access.hpp>
+#include <cereal/types/string.hpp>
+
+#include <Rcpp.h>
+
+
+namespace cereal
+{
+  class NDJSONOutputArchive
+  {
+  public:
+    // append: continue an existing file, otherwise it is truncated
+    // buffer_size: bytes of complete lines collected before writing
+    explicit NDJSONOutputArchive( const std::string& path, bool append = true, std::size_t buffer_size = 1 << 20 ) :
+      itsBufferSize( buffer_size )
+    {
+      bool needs_newline = false;
+      if( append ) {
+        // a file cut off in the middle of a line gets terminated first
+        std::ifstream is( path, std::ios::binary | std::ios::ate );
+        if( is && is.tellg() > 0 ) {
+          is.seekg( -1, std::ios::end );
+          needs_newline = ( is.get() != '\n' );
+        }
+      }
+
+      itsStream.open( path, std::ios::binary | (append ? std::ios::app : std::ios::trunc) );
+      if( !itsStream ) {
+        throw Exception( "NDJSONOutputArchive: cannot open " + path );
+      }
+      itsBuffer.reserve( itsBufferSize + 4096 );
+      if( needs_newline ) {
+        itsBuffer += '\n';
+      }
+    }
+
+    ~NDJSONOutputArchive()
+    {
+      try {
+        flush();
+      } catch( ... ) { }
+    }
+
+    NDJSONOutputArchive( const NDJSONOutputArchive& ) = delete;
+    NDJSONOutputArchive& operator=( const NDJSONOutputArchive& ) = delete;
+
+    // Appends one line per record
+    template<class ... Types>
+    NDJSONOutputArchive& operator()( Types const& ... records )
+    {
+      ( writeRecord( records ), ... );
+      return *this;
+    }
+
+    // Hands all complete lines to the file
+    void flush()
+    {
+      itsStream.write( itsBuffer.data(), static_cast<std::streamsize>( itsBuffer.size() ) );
+      itsStream.flush();
+      if( !itsStream ) {
+        throw Exception( "NDJSONOutputArchive: write failed" );
+      }
+      itsBuffer.clear();
+    }
+
+  private:
+    template<class T>
+    void writeRecord( T const& record )
+    {
+      itsDocument.str( std::string() );
+      {
+        JSONOutputArchive ar( itsDocument, JSONOutputArchive::Options::NoIndent() );
+        ar( record );
+      }
+      const std::string doc = itsDocument.str();
+
+      // { "value0": <record> } -> <record>
+      std::size_t first = doc.find( ':' ) + 1;
+      while( doc[first] == ' ' || doc[first] == '\n' ) {
+        ++first;
+      }
+      const std::size_t last = doc.rfind( '}' );
+
+      for( std::size_t i = first; i < last; ++i ) {
+        if( doc[i] != '\n' ) {
+          itsBuffer += doc[i];
+        }
+      }
+      itsBuffer += '\n';
+
+      if( itsBuffer.size() >= itsBufferSize ) {
+        flush();
+      }
+    }
+
+    std::ofstream itsStream;
+    std::size_t itsBufferSize;
+    std::string itsBuffer;
+    std::ostringstream itsDocument;
+  };
+
+
+  // Parses one line (without the newline) into record
+  template<class T>
+  inline void load_ndjson_line( const char* line, std::size_t n, T& record, std::string& doc )
+  {
+    doc.assign( "{\"value0\":" );
+    doc.append( line, n );
+    doc += '}';
+    std::istringstream is( doc );
+    JSONInputArchive ar( is );
+    ar( record );
+  }
+
+
+  // Reads all records of an NDJSON file, the lines of each block of
+  // block_size bytes are parsed on n_threads threads (0: all available).
+  template<class T>
+  std::vector<T> load_ndjson( const std::string& path, int n_threads = 0, std::size_t block_size = std::size_t(64) << 20 )
+  {
+    std::ifstream is( path, std::ios::binary );
+    if( !is ) {
+      throw Exception( "load_ndjson: cannot open " + path );
+    }
+#ifdef _OPENMP
+    if( n_threads <= 0 ) {
+      n_threads = omp_get_max_threads();
+    }
+#endif
+
+    std::vector<T> records;
+    std::string block;
+    std::size_t line_no = 0;
+
+    while( is ) {
+      // append the next block to the rest of the previous one
+      const std::size_t keep = block.size();
+      block.resize( keep + block_size );
+      is.read( &block[keep], static_cast<std::streamsize>( block_size ) );
+      block.resize( keep + static_cast<std::size_t>( is.gcount() ) );
+
+      // cut after the last newline, at the end of the file take everything
+      std::size_t cut = block.size();
+      if( is ) {
+        const std::size_t nl = block.rfind( '\n' );
+        if( nl == std::string::npos ) {
+          continue;   // a line longer than the block, read more
+        }
+        cut = nl + 1;
+      }
+
+      // line boundaries of this block
+      std::vector<std::pair<std::size_t, std::size_t>> lines;
+      std::vector<std::size_t> numbers;
+      for( std::size_t pos = 0; pos < cut; ) {
+        const char* nl = static_cast<const char*>( std::memchr( block.data() + pos, '\n', cut - pos ) );
+        const std::size_t end = nl ? static_cast<std::size_t>( nl - block.data() ) : cut;
+        std::size_t len = end - pos;
+        if( len > 0 && block[pos + len - 1] == '\r' ) {
+          --len;
+        }
+        ++line_no;
+        if( len > 0 ) {   // empty lines are allowed and skipped
+          lines.emplace_back( pos, len );
+          numbers.push_back( line_no );
+        }
+        pos = end + 1;
+      }
+
+      const std::size_t base = records.size();
+      records.resize( base + lines.size() );
+
+      std::string error;
+#ifdef _OPENMP
+      #pragma omp parallel num_threads(n_threads)
+#endif
+      {
+        std::string doc;
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic, 256)
+#endif
+        for( long long k = 0; k < static_cast<long long>( lines.size() ); ++k ) {
+          try {
+            load_ndjson_line( block.data() + lines[k].first, lines[k].second, records[base + k], doc );
+          } catch( std::exception& e ) {
+#ifdef _OPENMP
+            #pragma omp critical
+#endif
+            if( error.empty() ) {
+              error = "load_ndjson: line " + std::to_string( numbers[k] ) + ": " + e.what();
+            }
+          }
+        }
+      }
+      if( !error.empty() ) {
+        throw Exception( error );
+      }
+
+      block.erase( 0, cut );
+    }
+
+    return records;
+  }
+}
+
+
+class EmployeeData
+{
+
+  public:
+    EmployeeData() = default;
+    EmployeeData(std::string name, int age, std::string company)
+      : name{name}, age{age}, company{company} {}
+    ~EmployeeData() = default;
+
+    std::string get_name() const {
+      return name;
+    }
+
+    std::string get_company() const {
+      return company;
+    }
+
+    int get_age() const {
+      return age;
+    }
+
+  private:
+
+    std::string name;
+    int age;
+    std::string company;
+
+    friend class cereal::access;
+
+    template<class Archive>
+    void serialize(Archive& archive)
+    {
+      archive(
+        CEREAL_NVP(name),
+        CEREAL_NVP(age),
+        CEREAL_NVP(company)
+      );
+    }
+
+};
+
+
+// [[Rcpp::export]]
+int main()
+{
+  using clock = std::chrono::steady_clock;
+
+  { // start a new log
+    cereal::NDJSONOutputArchive archive("Backend/employee.ndjson", false);
+    archive(EmployeeData("Chandan", 34, "Microsoft"),
+            EmployeeData("Hans", 21, "Google"),
+            EmployeeData("Juergen", 56, "SAP"));
+  }
+
+  { // ... and continue it later on
+    auto t0 = clock::now();
+    cereal::NDJSONOutputArchive archive("Backend/employee.ndjson");
+    for (int i = 0; i < 500000; ++i) {
+      archive(EmployeeData("Employee " + std::to_string(i), 20 + i % 45, "Company " + std::to_string(i % 100)));
+    }
+    archive.flush();
+    auto t1 = clock::now();
+    Rcpp::Rcout << "appended 500000 records in " << std::chrono::duration<double>(t1 - t0).count() << " s" << std::endl;
+  }
+
+  { // read in parallel
+    auto t0 = clock::now();
+    std::vector<EmployeeData> staff = cereal::load_ndjson<EmployeeData>("Backend/employee.ndjson");
+    auto t1 = clock::now();
+    Rcpp::Rcout << "read " << staff.size() << " records in " << std::chrono::duration<double>(t1 - t0).count() << " s" << std::endl;
+
+    for (std::size_t i : {std::size_t(0), std::size_t(1), std::size_t(2), staff.size() - 1}) {
+      Rcpp::Rcout << "Employee:\n" << "name: " << staff[i].get_name()
+                  << ", age: " << staff[i].get_age()
+                  << ", company: " << staff[i].get_company()
+                  << std::endl;
+    }
+  }
+
+  return 0;
+}
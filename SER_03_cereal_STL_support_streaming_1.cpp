@@ -0,0 +1,1029 @@
+// SER_03: Streaming JSON input archive
+// -------------------------------------------------------
+// cereal::JSONInputArchive parses the whole document into a rapidjson DOM
+// when it is constructed. Loading a JSON export of several GB therefore needs
+// a multiple of the file size in RAM before the first value is read.
+//
+// cereal::StreamingJSONInputArchive reads the same documents (as written by
+// cereal::JSONOutputArchive), but pulls the tokens from the stream only when
+// serialize()/load() asks for a value. The stream is read through a small
+// buffer (64 kB by default) and nothing of the document is kept once it is
+// loaded.
+//
+// Two cases need to look ahead:
+// - Named values which are asked for in a different order than they appear in
+//   the document. Members that are skipped on the way to the requested one are
+//   kept as raw text and replayed when they are asked for. Documents loaded in
+//   the order they were written never buffer anything.
+// - The size of arrays (vector, list, map, ...). Since the JSON does not
+//   store it, the array is scanned once to count the elements. On seekable
+//   streams (files, string streams) the archive then jumps back, otherwise the
+//   text of the array is kept and replayed.
+// Hence, on seekable streams, the peak memory is bounded by the largest single
+// value, not by the document.
+//
+// NOTE:
+// - Like with cereal::JSONInputArchive, values without a name are read in
+//   document order and members which are not asked for are ignored.
+// - Archives are only loaded with this archive, output goes through
+//   cereal::JSONOutputArchive.
+// - Non-seekable input (pipes, sockets, std::cin) keeps the whole text of an
+//   array in memory while it is loaded. For a document which is one large
+//   top-level array this is the whole document, so read such files from a
+//   seekable stream.
+// -------------------------------------------------------
+
+// [[Rcpp::plugins("cpp17")]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// data types for cereal serialization we are going to simulate
+#include <cereal/types/map.hpp>
+#include <cereal/types/vector.hpp>
+#include <cereal/types/string.hpp>
+#include <cereal/types/complex.hpp>
+#include <cereal/types/list.hpp>
+#include <cereal/types/array.hpp>
+#include <cereal/types/atomic.hpp>
+#include <cereal/types/deque.hpp>
+#include <cereal/types/queue.hpp>
+#include <cereal/types/forward_list.hpp>
+#include <cereal/types/unordered_map.hpp>
+#include <cereal/types/set.hpp>
+#include <cereal/types/stack.hpp>
+
+#include <cereal/archives/json.hpp>
+#include <cereal/external/base64.hpp>
+
+#include <Rcpp.h>
+
+
+namespace cereal
+{
+  namespace streaming_json_detail
+  {
+    inline bool is_space( int c )
+    {
+      return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+    }
+
+    inline void append_utf8( std::string& out, std::uint32_t cp )
+    {
+      if( cp < 0x80 ) {
+        out += static_cast<char>( cp );
+      } else if( cp < 0x800 ) {
+        out += static_cast<char>( 0xC0 | (cp >> 6) );
+        out += static_cast<char>( 0x80 | (cp & 0x3F) );
+      } else if( cp < 0x10000 ) {
+        out += static_cast<char>( 0xE0 | (cp >> 12) );
+        out += static_cast<char>( 0x80 | ((cp >> 6) & 0x3F) );
+        out += static_cast<char>( 0x80 | (cp & 0x3F) );
+      } else {
+        out += static_cast<char>( 0xF0 | (cp >> 18) );
+        out += static_cast<char>( 0x80 | ((cp >> 12) & 0x3F) );
+        out += static_cast<char>( 0x80 | ((cp >> 6) & 0x3F) );
+        out += static_cast<char>( 0x80 | (cp & 0x3F) );
+      }
+    }
+
+    // Pull parser over a stream. Keeps only the read buffer, the stack of
+    // open objects/arrays and the raw text of members read ahead.
+    class Reader
+    {
+    public:
+      Reader( std::istream& stream, std::size_t buffer_size ) :
+        itsStream( stream ),
+        itsBuffer( buffer_size > 0 ? buffer_size : 1 )
+      {
+        itsSeekable = ( itsStream.tellg() != std::streampos( -1 ) );
+
+        expect( '{' );
+        itsFrames.push_back( Frame{ false } );
+      }
+
+      // Sets the name of the next value, nullptr for "next in order"
+      void setNextName( const char* name ) { itsNextName = name; }
+
+      // Name of the next member of the current object, nullptr in arrays or
+      // at the end of the object
+      const char* getNodeName()
+      {
+        Frame& f = itsFrames.back();
+        if( f.array ) {
+          return nullptr;
+        }
+        if( !f.peeked ) {
+          if( !readKey( f, f.key ) ) {
+            return nullptr;
+          }
+          f.peeked = true;
+        }
+        return f.key.c_str();
+      }
+
+      void startNode()
+      {
+        locate();
+        skipSpace();
+        const int c = get();
+        if( c != '{' && c != '[' ) {
+          throw Exception( "JSON Parsing failed - expected an object or an array" );
+        }
+        itsFrames.push_back( Frame{ c == '[' } );
+      }
+
+      // Skips what was not asked for and leaves the current object/array
+      void finishNode()
+      {
+        Frame& f = itsFrames.back();
+        if( f.array ) {
+          while( true ) {
+            skipSpace();
+            if( peek() == ']' ) {
+              break;
+            }
+            if( !f.first ) {
+              expect( ',' );
+            }
+            f.first = false;
+            copyValue( nullptr );
+          }
+          get();
+        } else {
+          if( f.peeked ) {
+            copyValue( nullptr );
+            f.peeked = false;
+          }
+          std::string key;
+          while( readKey( f, key ) ) {
+            copyValue( nullptr );
+          }
+          expect( '}' );
+        }
+        itsFrames.pop_back();
+      }
+
+      // Number of elements of the array just entered with startNode()
+      std::size_t arraySize()
+      {
+        if( !itsFrames.back().array || !itsFrames.back().first ) {
+          throw Exception( "JSON Parsing failed - size requested outside of an array" );
+        }
+
+        peek();   // drops exhausted replays
+        if( !itsReplays.empty() ) {
+          // scan the replayed text and rewind
+          const std::size_t level = itsReplays.size();
+          const std::size_t pos = itsReplays.back().pos;
+          const std::size_t n = countElements( nullptr );
+          itsReplays.resize( level );
+          itsReplays.back().pos = pos;
+          return n;
+        }
+
+        if( itsSeekable && itsBase != std::streampos( -1 ) ) {
+          // scan the stream, jump back to the start of the buffer and read
+          // it again. Only positions from tellg() are used, a byte count
+          // would be off on text mode streams which translate line endings
+          const std::streampos at = itsBase;
+          const std::size_t pos = itsPos;
+          const std::size_t n = countElements( nullptr );
+          itsStream.clear();
+          itsStream.seekg( at );
+          if( !itsStream || !refill() || itsLength < pos ) {
+            throw Exception( "JSON Parsing failed - cannot seek back in the input stream" );
+          }
+          itsPos = pos;
+          return n;
+        }
+
+        // keep the text of the array and read it again
+        std::string text;
+        const std::size_t n = countElements( &text );
+        pushReplay( std::move( text ) );
+        return n;
+      }
+
+      // Positions the reader at the next value, found by name if set
+      void locate()
+      {
+        const char* name = itsNextName;
+        itsNextName = nullptr;
+
+        Frame& f = itsFrames.back();
+        if( f.array ) {
+          skipSpace();
+          if( peek() == ']' ) {
+            throw Exception( "JSON Parsing failed - no more elements in the array" );
+          }
+          if( !f.first ) {
+            expect( ',' );
+          }
+          f.first = false;
+          return;
+        }
+
+        if( name == nullptr ) {
+          if( f.peeked ) {
+            f.peeked = false;
+            return;
+          }
+          std::string key;
+          if( !readKey( f, key ) ) {
+            throw Exception( "JSON Parsing failed - no more members in the object" );
+          }
+          return;
+        }
+
+        if( f.peeked ) {
+          f.peeked = false;
+          if( f.key == name ) {
+            return;
+          }
+          stash( f, f.key );
+        }
+
+        auto it = f.stash.find( name );
+        if( it != f.stash.end() ) {
+          pushReplay( std::move( it->second ) );
+          f.stash.erase( it );
+          return;
+        }
+
+        std::string key;
+        while( readKey( f, key ) ) {
+          if( key == name ) {
+            return;
+          }
+          stash( f, key );
+        }
+        throw Exception( std::string( "JSON Parsing failed - provided NVP (" ) + name + ") not found" );
+      }
+
+      // Reads a number, literal or (for long double) string token
+      void readToken( std::string& tok )
+      {
+        skipSpace();
+        tok.clear();
+        if( peek() == '"' ) {
+          readString( tok );
+          return;
+        }
+        for( int c = peek(); c != EOF && c != ',' && c != ']' && c != '}' && !is_space( c ); c = peek() ) {
+          tok += static_cast<char>( c );
+          advance();
+        }
+      }
+
+      void readString( std::string& out )
+      {
+        skipSpace();
+        if( get() != '"' ) {
+          throw Exception( "JSON Parsing failed - expected a string" );
+        }
+        out.clear();
+        for( ;; ) {
+          int c = get();
+          if( c == EOF ) {
+            throw Exception( "JSON Parsing failed - unterminated string" );
+          }
+          if( c == '"' ) {
+            return;
+          }
+          if( c != '\\' ) {
+            out += static_cast<char>( c );
+            continue;
+          }
+          switch( c = get() ) {
+            case '"':  out += '"';  break;
+            case '\\': out += '\\'; break;
+            case '/':  out += '/';  break;
+            case 'b':  out += '\b'; break;
+            case 'f':  out += '\f'; break;
+            case 'n':  out += '\n'; break;
+            case 'r':  out += '\r'; break;
+            case 't':  out += '\t'; break;
+            case 'u': {
+              std::uint32_t cp = readHex4();
+              if( cp >= 0xD800 && cp < 0xDC00 ) {
+                if( get() != '\\' || get() != 'u' ) {
+                  throw Exception( "JSON Parsing failed - invalid surrogate pair" );
+                }
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (readHex4() - 0xDC00);
+              }
+              append_utf8( out, cp );
+              break;
+            }
+            default:
+              throw Exception( "JSON Parsing failed - invalid escape sequence" );
+          }
+        }
+      }
+
+    private:
+      struct Frame
+      {
+        bool array;
+        bool first = true;
+        bool peeked = false;   // key of the next member already read
+        std::string key;
+        std::unordered_map<std::string, std::string> stash;   // members read ahead
+      };
+
+      struct Replay
+      {
+        std::string text;
+        std::size_t pos;
+      };
+
+      int peek()
+      {
+        while( !itsReplays.empty() ) {
+          const Replay& r = itsReplays.back();
+          if( r.pos < r.text.size() ) {
+            return static_cast<unsigned char>( r.text[r.pos] );
+          }
+          itsReplays.pop_back();
+        }
+        if( itsPos == itsLength && !refill() ) {
+          return EOF;
+        }
+        return static_cast<unsigned char>( itsBuffer[itsPos] );
+      }
+
+      // call only after peek() returned a character
+      void advance()
+      {
+        if( !itsReplays.empty() ) {
+          ++itsReplays.back().pos;
+        } else {
+          ++itsPos;
+        }
+      }
+
+      int get()
+      {
+        const int c = peek();
+        if( c != EOF ) {
+          advance();
+        }
+        return c;
+      }
+
+      bool refill()
+      {
+        if( itsSeekable ) {
+          itsBase = itsStream.tellg();
+        }
+        itsStream.read( itsBuffer.data(), static_cast<std::streamsize>( itsBuffer.size() ) );
+        itsLength = static_cast<std::size_t>( itsStream.gcount() );
+        itsPos = 0;
+        return itsLength > 0;
+      }
+
+      void pushReplay( std::string text )
+      {
+        itsReplays.push_back( Replay{ std::move( text ), 0 } );
+      }
+
+      void skipSpace()
+      {
+        while( is_space( peek() ) ) {
+          advance();
+        }
+      }
+
+      void expect( char c )
+      {
+        skipSpace();
+        if( get() != c ) {
+          throw Exception( std::string( "JSON Parsing failed - expected '" ) + c + "'" );
+        }
+      }
+
+      std::uint32_t readHex4()
+      {
+        std::uint32_t v = 0;
+        for( int i = 0; i < 4; ++i ) {
+          const int c = get();
+          v <<= 4;
+          if( c >= '0' && c <= '9' )      v |= static_cast<std::uint32_t>( c - '0' );
+          else if( c >= 'a' && c <= 'f' ) v |= static_cast<std::uint32_t>( c - 'a' + 10 );
+          else if( c >= 'A' && c <= 'F' ) v |= static_cast<std::uint32_t>( c - 'A' + 10 );
+          else throw Exception( "JSON Parsing failed - invalid \\u escape" );
+        }
+        return v;
+      }
+
+      // Reads '[,] "key" :' of the next member, false at the closing '}'
+      // (which is not consumed).
+      bool readKey( Frame& f, std::string& key )
+      {
+        skipSpace();
+        if( peek() == '}' ) {
+          return false;
+        }
+        if( !f.first ) {
+          expect( ',' );
+        }
+        f.first = false;
+        readString( key );
+        expect( ':' );
+        return true;
+      }
+
+      void stash( Frame& f, const std::string& key )
+      {
+        std::string text;
+        copyValue( &text );
+        f.stash[key] = std::move( text );
+      }
+
+      // Copies the rest of a string whose opening quote was consumed
+      void copyStringRest( std::string* out )
+      {
+        for( ;; ) {
+          int c = get();
+          if( c == EOF ) {
+            throw Exception( "JSON Parsing failed - unterminated string" );
+          }
+          if( out ) {
+            *out += static_cast<char>( c );
+          }
+          if( c == '"' ) {
+            return;
+          }
+          if( c == '\\' ) {
+            c = get();
+            if( out && c != EOF ) {
+              *out += static_cast<char>( c );
+            }
+          }
+        }
+      }
+
+      // Reads one complete value, copying its raw text to out (if given)
+      void copyValue( std::string* out )
+      {
+        skipSpace();
+        int c = peek();
+        if( c == '"' ) {
+          advance();
+          if( out ) {
+            *out += '"';
+          }
+          copyStringRest( out );
+          return;
+        }
+        if( c == '[' || c == '{' ) {
+          int depth = 0;
+          do {
+            c = get();
+            if( c == EOF ) {
+              throw Exception( "JSON Parsing failed - unterminated value" );
+            }
+            if( out ) {
+              *out += static_cast<char>( c );
+            }
+            if( c == '"' ) {
+              copyStringRest( out );
+            } else if( c == '[' || c == '{' ) {
+              ++depth;
+            } else if( c == ']' || c == '}' ) {
+              --depth;
+            }
+          } while( depth > 0 );
+          return;
+        }
+        for( ; c != EOF && c != ',' && c != ']' && c != '}' && !is_space( c ); c = peek() ) {
+          if( out ) {
+            *out += static_cast<char>( c );
+          }
+          advance();
+        }
+      }
+
+      // Counts the elements of the array whose '[' was consumed, up to and
+      // including the closing ']', copying the text to out (if given).
+      std::size_t countElements( std::string* out )
+      {
+        std::size_t commas = 0;
+        bool any = false;
+        int depth = 0;
+        for( ;; ) {
+          const int c = get();
+          if( c == EOF ) {
+            throw Exception( "JSON Parsing failed - unterminated array" );
+          }
+          if( out ) {
+            *out += static_cast<char>( c );
+          }
+          if( c == '"' ) {
+            any = true;
+            copyStringRest( out );
+          } else if( c == '[' || c == '{' ) {
+            any = true;
+            ++depth;
+          } else if( c == ']' || c == '}' ) {
+            if( depth == 0 ) {
+              break;
+            }
+            --depth;
+          } else if( c == ',' ) {
+            commas += ( depth == 0 );
+          } else if( !is_space( c ) ) {
+            any = true;
+          }
+        }
+        return any ? commas + 1 : 0;
+      }
+
+      std::istream& itsStream;
+      std::vector<char> itsBuffer;
+      std::size_t itsPos = 0;
+      std::size_t itsLength = 0;
+      std::streampos itsBase = -1;   // stream position of itsBuffer[0]
+      bool itsSeekable = false;
+
+      std::vector<Frame> itsFrames;
+      std::vector<Replay> itsReplays;
+      const char* itsNextName = nullptr;
+    };
+  }
+
+
+  class StreamingJSONInputArchive : public InputArchive<StreamingJSONInputArchive>, public traits::TextArchive
+  {
+  public:
+    // buffer_size: bytes read from the stream at once
+    explicit StreamingJSONInputArchive( std::istream& stream, std::size_t buffer_size = 1 << 16 ) :
+      InputArchive<StreamingJSONInputArchive>( this ),
+      itsReader( stream, buffer_size )
+    { }
+
+    ~StreamingJSONInputArchive() CEREAL_NOEXCEPT = default;
+
+    // Interface used by the serialization functions below, the same as the
+    // one of cereal::JSONInputArchive
+    void startNode() { itsReader.startNode(); }
+    void finishNode() { itsReader.finishNode(); }
+    void setNextName( const char* name ) { itsReader.setNextName( name ); }
+    const char* getNodeName() { return itsReader.getNodeName(); }
+
+    void loadSize( size_type& size ) { size = static_cast<size_type>( itsReader.arraySize() ); }
+
+    void loadValue( std::string& val )
+    {
+      itsReader.locate();
+      itsReader.readString( val );
+    }
+
+    void loadValue( bool& val )
+    {
+      token();
+      if( itsToken == "true" )       val = true;
+      else if( itsToken == "false" ) val = false;
+      else throw Exception( "JSON Parsing failed - expected a bool, got " + itsToken );
+    }
+
+    void loadValue( std::nullptr_t& )
+    {
+      token();
+      if( itsToken != "null" ) {
+        throw Exception( "JSON Parsing failed - expected null, got " + itsToken );
+      }
+    }
+
+    template<class T, traits::EnableIf<std::is_arithmetic<T>::value,
+                                       !std::is_same<T, bool>::value> = traits::sfinae> inline
+    void loadValue( T& val )
+    {
+      token();
+      const char* first = itsToken.data();
+      const char* last = first + itsToken.size();
+
+      if constexpr ( std::is_floating_point<T>::value ) {
+        if( itsToken == "NaN" || itsToken == "-NaN" ) {
+          val = std::numeric_limits<T>::quiet_NaN();
+          return;
+        }
+        if( itsToken == "Infinity" || itsToken == "-Infinity" ) {
+          val = itsToken[0] == '-' ? -std::numeric_limits<T>::infinity() : std::numeric_limits<T>::infinity();
+          return;
+        }
+      }
+
+      const auto res = std::from_chars( first, last, val );
+      if( res.ec != std::errc() || res.ptr != last ) {
+        throw Exception( "JSON Parsing failed - invalid number " + itsToken );
+      }
+    }
+
+    void loadBinaryValue( void* data, size_t size, const char* name = nullptr )
+    {
+      setNextName( name );
+      std::string encoded;
+      loadValue( encoded );
+      const std::string decoded = base64::decode( encoded );
+      if( size != decoded.size() ) {
+        throw Exception( "Decoded binary data size does not match specified size" );
+      }
+      std::memcpy( data, decoded.data(), decoded.size() );
+    }
+
+  private:
+    void token()
+    {
+      itsReader.locate();
+      itsReader.readToken( itsToken );
+    }
+
+    streaming_json_detail::Reader itsReader;
+    std::string itsToken;
+  };
+
+
+  // Prologue/epilogue and load functions, the same as for
+  // cereal::JSONInputArchive
+  // --------------------------------
+  template<class T> inline
+  void prologue( StreamingJSONInputArchive&, NameValuePair<T> const& ) { }
+
+  template<class T> inline
+  void epilogue( StreamingJSONInputArchive&, NameValuePair<T> const& ) { }
+
+  template<class T> inline
+  void prologue( StreamingJSONInputArchive&, SizeTag<T> const& ) { }
+
+  template<class T> inline
+  void epilogue( StreamingJSONInputArchive&, SizeTag<T> const& ) { }
+
+  // classes with serialization functions (but not minimal ones) open a node
+  template<class T, traits::EnableIf<!std::is_arithmetic<T>::value,
+                                     !traits::has_minimal_base_class_serialization<T, traits::has_minimal_input_serialization, StreamingJSONInputArchive>::value,
+                                     !traits::has_minimal_input_serialization<T, StreamingJSONInputArchive>::value> = traits::sfinae> inline
+  void prologue( StreamingJSONInputArchive& ar, T const& )
+  {
+    ar.startNode();
+  }
+
+  template<class T, traits::EnableIf<!std::is_arithmetic<T>::value,
+                                     !traits::has_minimal_base_class_serialization<T, traits::has_minimal_input_serialization, StreamingJSONInputArchive>::value,
+                                     !traits::has_minimal_input_serialization<T, StreamingJSONInputArchive>::value> = traits::sfinae> inline
+  void epilogue( StreamingJSONInputArchive& ar, T const& )
+  {
+    ar.finishNode();
+  }
+
+  inline void prologue( StreamingJSONInputArchive&, std::nullptr_t const& ) { }
+  inline void epilogue( StreamingJSONInputArchive&, std::nullptr_t const& ) { }
+
+  template<class T, traits::EnableIf<std::is_arithmetic<T>::value> = traits::sfinae> inline
+  void prologue( StreamingJSONInputArchive&, T const& ) { }
+
+  template<class T, traits::EnableIf<std::is_arithmetic<T>::value> = traits::sfinae> inline
+  void epilogue( StreamingJSONInputArchive&, T const& ) { }
+
+  template<class CharT, class Traits, class Alloc> inline
+  void prologue( StreamingJSONInputArchive&, std::basic_string<CharT, Traits, Alloc> const& ) { }
+
+  template<class CharT, class Traits, class Alloc> inline
+  void epilogue( StreamingJSONInputArchive&, std::basic_string<CharT, Traits, Alloc> const& ) { }
+
+  template<class T> inline
+  void CEREAL_LOAD_FUNCTION_NAME( StreamingJSONInputArchive& ar, NameValuePair<T>& t )
+  {
+    ar.setNextName( t.name );
+    ar( t.value );
+  }
+
+  inline void CEREAL_LOAD_FUNCTION_NAME( StreamingJSONInputArchive& ar, std::nullptr_t& t )
+  {
+    ar.loadValue( t );
+  }
+
+  template<class T, traits::EnableIf<std::is_arithmetic<T>::value> = traits::sfinae> inline
+  void CEREAL_LOAD_FUNCTION_NAME( StreamingJSONInputArchive& ar, T& t )
+  {
+    ar.loadValue( t );
+  }
+
+  template<class CharT, class Traits, class Alloc> inline
+  void CEREAL_LOAD_FUNCTION_NAME( StreamingJSONInputArchive& ar, std::basic_string<CharT, Traits, Alloc>& str )
+  {
+    ar.loadValue( str );
+  }
+
+  template<class T> inline
+  void CEREAL_LOAD_FUNCTION_NAME( StreamingJSONInputArchive& ar, SizeTag<T>& st )
+  {
+    ar.loadSize( st.size );
+  }
+
+  namespace traits
+  {
+    namespace detail
+    {
+      // documents are written with the cereal JSON archive, needed to find
+      // the type of load_minimal functions
+      template<>
+      struct get_output_from_input<cereal::StreamingJSONInputArchive>
+      {
+        using type = cereal::JSONOutputArchive;
+      };
+    }
+  }
+}
+
+// register archive for polymorphic support
+CEREAL_REGISTER_ARCHIVE(cereal::StreamingJSONInputArchive)
+
+
+class STL_User_Class
+{
+public:
+  STL_User_Class() = default;
+  ~STL_User_Class() = default;
+  
+  void fillDataContainer() {
+    fillArray();
+    fillVector();
+    fillDeque();
+    fillList_of_doubles();
+    fillList();
+    fillForwardList();
+    fillDataMap();
+    fillSet();
+    fillMultiSet();
+    fillMultiMap();
+    fillUnorderedMap();
+    fillStack();
+    fillQueue();
+    fillPriorityQueue();
+    return;
+  }
+
+  std::vector<double> filledVector() {
+    std::vector<double> vec;
+    for (std::size_t l{0}; l < 10; ++l) {
+      vec.emplace_back(R::norm_rand());
+    }
+    return vec;
+  }
+
+  void fillVector()
+  {
+    data_vector = filledVector();
+    return;
+  }
+  
+  void fillArray()
+  {
+    data_array.fill(42);
+    str_array = {"Larry", "Moe", "Curly", "Frank"};
+  }
+
+  
+  void fillDeque()
+  {
+   data_deque = {7, 15, 16, 8};
+   data_deque.push_back(13);
+   data_deque.push_front(25);
+  }
+  
+  void fillList_of_doubles()
+  {
+    data_list_of_doubles.push_back(3.14);
+    data_list_of_doubles.push_back(42.0);
+  }
+  
+  void fillList()
+  {
+   for (std::size_t l{0}; l < 25; ++l) {
+     data_list_of_vecs.emplace_back(filledVector());
+   }
+   return;
+  }
+
+  void fillForwardList()
+  {
+   data_forward_list.assign(5, 42); // assing 5x 42
+   data_forward_list.push_front(62);
+  }
+  
+  void fillDataMap()
+  {
+    // fill map with key value pairs
+    data_map = {
+      {"real", { {1.0f, 0},
+                 {2.2f, 0},
+                 {3.3f, 0} } },
+      {"imaginary", { {0, -1.0f},
+                      {0, -2.9932f},
+                      {0, -3.5f} } }
+    };
+    return;
+  }
+
+  void fillSet()
+  {
+    string_set.insert("first");
+    string_set.insert("second");
+    string_set.insert("third");
+    string_set.insert("fourth");
+    string_set.insert("first"); // duplicate, won't be added
+  }
+
+  void fillMultiSet()
+  {
+    data_multiset.insert(42);
+    data_multiset.insert(32);
+    data_multiset.insert(62);
+    data_multiset.insert(22);
+    data_multiset.insert(52);
+  }
+
+  void fillMultiMap()
+  {
+    data_multimap.insert(std::pair<int, int>(1, 42));
+    data_multimap.insert(std::pair<int, double>(1, 42.42));
+  }
+
+  void fillUnorderedMap()
+  {
+    data_unorderd_map["Hans"] = 10;
+    data_unorderd_map["Wurst"] = 42;
+    data_unorderd_map["Nervt!"] = 0;
+  }
+
+  void fillStack()
+  {
+    data_stack.push(21);
+    data_stack.push(22);
+    data_stack.push(23);
+    data_stack.push(24);
+  }
+
+  void fillQueue()
+  {
+    data_queue.emplace("Cat");
+    data_queue.emplace("Dog");
+    data_queue.emplace("Whale");
+  }
+
+  void fillPriorityQueue()
+  {
+    data_priority_queue.push(19);
+    data_priority_queue.push(18);
+    data_priority_queue.push(17);
+  }
+
+  // some public data
+  // ------------------------------
+  int public_int{4};
+  double public_double{4.24};
+  std::string public_string{"HI!"};
+  bool public_bool{true};
+  std::vector<double> public_vector = filledVector();
+
+private:
+  // our data types
+  // ------------------------------
+  int someInt{42};
+  double someDouble{42.42};
+  std::string someStr{"Hans Wurst"};
+  std::array<double, 25> data_array;
+  std::array<std::string, 4> str_array;
+  std::vector<double> data_vector;
+  std::deque<int> data_deque;
+  std::list<double> data_list_of_doubles;
+  std::list<std::vector<double>> data_list_of_vecs;
+  std::forward_list<double> data_forward_list;
+  std::map<std::string, std::vector<std::complex<float>>> data_map;
+  std::set<std::string> string_set;
+  std::multimap<int, int> data_multimap;
+  std::multiset<int, std::greater<int>> data_multiset;
+  std::unordered_map<std::string, double> data_unorderd_map;
+  std::stack<double> data_stack;
+  std::queue<std::string> data_queue;
+  std::priority_queue<int> data_priority_queue;
+  // ------------------------------
+
+  
+  // friend
+  // --------------------------------
+  friend class cereal::access;
+  
+  
+  // let cereal know what to archive
+  // NOTE: YOU HAVE TO LIST THE VARIABLES IN THE ORDER OF OCCURRENCE, OTHERWISE
+  //       YOU END IN AN INFINITY LOOP, RAM CORRUPTION AND FATAL ERROR
+  // --------------------------------
+  template<class Archive>
+  void serialize(Archive& archive)
+  {
+    archive(
+      // --------------------------      
+      CEREAL_NVP(public_int),
+      CEREAL_NVP(public_double),
+      CEREAL_NVP(public_string),
+      CEREAL_NVP(public_bool),
+      CEREAL_NVP(public_vector),
+      // --------------------------
+      CEREAL_NVP(someInt),
+      CEREAL_NVP(someDouble),
+      CEREAL_NVP(someStr),
+      CEREAL_NVP(data_array),
+      CEREAL_NVP(str_array),
+      CEREAL_NVP(data_vector),
+      CEREAL_NVP(data_deque),
+      CEREAL_NVP(data_list_of_doubles),
+      CEREAL_NVP(data_list_of_vecs),
+      CEREAL_NVP(data_forward_list),
+      CEREAL_NVP(data_map),
+      CEREAL_NVP(string_set),
+      CEREAL_NVP(data_multimap),
+      CEREAL_NVP(data_multiset),
+      CEREAL_NVP(data_unorderd_map),
+      CEREAL_NVP(data_stack),
+      CEREAL_NVP(data_queue),
+      CEREAL_NVP(data_priority_queue)
+      // --------------------------
+    );
+  }
+
+};
+
+
+// Members are written in one order and loaded in another one. The members
+// passed on the way are buffered and replayed.
+struct Reordered
+{
+  int id{0};
+  std::string name;
+  std::vector<double> values;
+
+  template<class Archive>
+  void save(Archive& archive) const
+  {
+    archive(CEREAL_NVP(id), CEREAL_NVP(name), CEREAL_NVP(values));
+  }
+
+  template<class Archive>
+  void load(Archive& archive)
+  {
+    archive(CEREAL_NVP(values), CEREAL_NVP(name), CEREAL_NVP(id));
+  }
+};
+
+
+// [[Rcpp::export]]
+int main()
+{
+  { // Serialize many class instances into one large document
+    std::vector<STL_User_Class> data(1000);
+    for (auto& d : data) {
+      d.fillDataContainer();
+    }
+    std::ofstream os("Backend/STL_User_Class_stream.json");
+    cereal::JSONOutputArchive output(os);
+    output(cereal::make_nvp("best data ever", data));
+  }
+
+  { // Deserialize, reading the file piecewise
+    std::vector<STL_User_Class> data;
+    std::ifstream is("Backend/STL_User_Class_stream.json");
+    cereal::StreamingJSONInputArchive input(is);
+    input(cereal::make_nvp("best data ever", data));
+
+    Rcpp::Rcout << "loaded " << data.size() << " instances" << std::endl;
+    Rcpp::Rcout << "last one: " << data.back().public_int << " "
+                << data.back().public_double << " "
+                << data.back().public_string << " "
+                << data.back().public_vector[0] << std::endl;
+  }
+
+  { // Out of order members
+    std::stringstream ss;
+    {
+      cereal::JSONOutputArchive output(ss);
+      output(cereal::make_nvp("record", Reordered{7, "seven", {7.0, 0.7}}));
+    }
+
+    Reordered r;
+    cereal::StreamingJSONInputArchive input(ss);
+    input(cereal::make_nvp("record", r));
+    Rcpp::Rcout << r.id << " " << r.name << " " << r.values[0] << " " << r.values[1] << std::endl;
+  }
+
+  return 0;
+}
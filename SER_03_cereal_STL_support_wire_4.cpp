@@ -0,0 +1,307 @@
+// SER_03: Wire layout records, containers as one binary block
+// ----------------------------------------------------------------------------
+// std::vector<MyData> (three ints) and std::vector<MyRecord> (uint8_t x, y;
+// float z) are written element by element: cereal calls serialize() of every
+// record, which hands every field to the archive on its own. The data are
+// plain bytes though.
+//
+// CEREAL_WIRE_LAYOUT(fields...) in the body of an aggregate marks it as wire
+// layout safe. It defines serialize() from the field list, hence the list is
+// the only place where the fields are named, and the checks below apply to
+// exactly what is serialized. At compile time (when a container of the type
+// is serialized) it is verified that
+// - the type is a trivially copyable aggregate of arithmetic/enum fields
+// - the list names every field of the type once, in declaration order (the
+//   fields are counted by aggregate initialization and compared with a
+//   structured binding)
+//
+// std::vector of such records is then serialized by the cereal binary archives
+// - without padding (MyData): as one binary_data block of the whole vector
+// - with padding (MyRecord: 2 bytes between y and z): the fields are packed
+//   into a staging buffer, padding bytes never reach the file, and the buffer
+//   is written in blocks of 64 KB
+// Either way the bytes are the same as with the element wise path, i.e., files
+// written before can be read and vice versa.
+//
+// NOTE:
+// - Only cereal::BinaryOutputArchive/BinaryInputArchive take the fast path
+//   (native byte order). Specialize cereal::wire_layout_detail::is_native_binary
+//   for other archives writing fields as raw native bytes.
+// - Text archives and other containers use serialize() as usual.
+// - std::vector with the default allocator only.
+// - Up to 15 fields, as for CEREAL_REFLECT (SER_06_Serialization_Functions_reflection_1.cpp).
+// ----------------------------------------------------------------------------
+// [[Rcpp::plugins("cpp17")]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <cereal/cereal.hpp>
+#include <cereal/archives/binary.hpp>
+#include <cereal/types/vector.hpp>
+
+#include <Rcpp.h>
+
+
+// Marks the enclosing aggregate as wire layout safe and serializes the fields
+// in the given order, which has to be the declaration order.
+#define CEREAL_WIRE_LAYOUT( ... )                                   \
+  using cereal_wire_layout = void;                                  \
+  constexpr auto wire_tie() { return std::tie( __VA_ARGS__ ); }       \
+  constexpr auto wire_tie() const { return std::tie( __VA_ARGS__ ); } \
+  template<class Archive>                                           \
+  void serialize( Archive& ar ) { ar( __VA_ARGS__ ); }
+
+
+namespace cereal
+{
+  namespace wire_layout_detail
+  {
+    // Number of fields of an aggregate: the largest N for which T{ f1, ..., fN }
+    // compiles (fields have to be scalars, no brace elision)
+    struct any_field
+    {
+      template<class U> constexpr operator U() const noexcept;
+    };
+
+    template<class T, std::size_t... I>
+    auto brace_test( std::index_sequence<I...> ) -> decltype( T{ ( void( I ), any_field{} )... }, std::true_type{} );
+
+    template<class T>
+    std::false_type brace_test( ... );
+
+    constexpr std::size_t max_fields = 16;
+
+    template<class T, std::size_t N = 0>
+    constexpr std::size_t field_count()
+    {
+      if constexpr( N < max_fields && decltype( brace_test<T>( std::make_index_sequence<N + 1>() ) )::value ) {
+        return field_count<T, N + 1>();
+      } else {
+        return N;
+      }
+    }
+
+    template<class A>
+    constexpr bool same_field( A& a, A& b ) { return &a == &b; }
+
+    template<class A, class B>
+    constexpr bool same_field( A&, B& ) { return false; }
+
+    template<class Tuple, std::size_t... I, class... F>
+    constexpr bool same_fields( Tuple const& listed, std::index_sequence<I...>, F&... fields )
+    {
+      if constexpr( std::tuple_size<Tuple>::value != sizeof...( F ) ) {
+        return false;
+      } else {
+        return ( same_field( std::get<I>( listed ), fields ) && ... );
+      }
+    }
+
+    // Does wire_tie() list all fields of T in declaration order?
+    template<class T>
+    constexpr bool declaration_order()
+    {
+      T t{};
+      auto listed = t.wire_tie();
+      constexpr auto seq = std::make_index_sequence<std::tuple_size<decltype( listed )>::value>();
+      constexpr std::size_t n = field_count<T>();
+
+      if constexpr( n == 1 ) { auto& [f0] = t; return same_fields( listed, seq, f0 ); }
+      else if constexpr( n == 2 ) { auto& [f0, f1] = t; return same_fields( listed, seq, f0, f1 ); }
+      else if constexpr( n == 3 ) { auto& [f0, f1, f2] = t; return same_fields( listed, seq, f0, f1, f2 ); }
+      else if constexpr( n == 4 ) { auto& [f0, f1, f2, f3] = t; return same_fields( listed, seq, f0, f1, f2, f3 ); }
+      else if constexpr( n == 5 ) { auto& [f0, f1, f2, f3, f4] = t; return same_fields( listed, seq, f0, f1, f2, f3, f4 ); }
+      else if constexpr( n == 6 ) { auto& [f0, f1, f2, f3, f4, f5] = t; return same_fields( listed, seq, f0, f1, f2, f3, f4, f5 ); }
+      else if constexpr( n == 7 ) { auto& [f0, f1, f2, f3, f4, f5, f6] = t; return same_fields( listed, seq, f0, f1, f2, f3, f4, f5, f6 ); }
+      else if constexpr( n == 8 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7] = t; return same_fields( listed, seq, f0, f1, f2, f3, f4, f5, f6, f7 ); }
+      else if constexpr( n == 9 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8] = t; return same_fields( listed, seq, f0, f1, f2, f3, f4, f5, f6, f7, f8 ); }
+      else if constexpr( n == 10 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9] = t; return same_fields( listed, seq, f0, f1, f2, f3, f4, f5, f6, f7, f8, f9 ); }
+      else if constexpr( n == 11 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10] = t; return same_fields( listed, seq, f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10 ); }
+      else if constexpr( n == 12 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11] = t; return same_fields( listed, seq, f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11 ); }
+      else if constexpr( n == 13 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12] = t; return same_fields( listed, seq, f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12 ); }
+      else if constexpr( n == 14 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13] = t; return same_fields( listed, seq, f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13 ); }
+      else if constexpr( n == 15 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14] = t; return same_fields( listed, seq, f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14 ); }
+      else { return false; }
+    }
+
+    template<class Tuple> struct scalar_fields;
+    template<class... F> struct scalar_fields<std::tuple<F...>>
+    {
+      static constexpr bool value = ( ( std::is_arithmetic<std::remove_reference_t<F>>::value ||
+                                        std::is_enum<std::remove_reference_t<F>>::value ) && ... );
+      // bytes of the fields without padding
+      static constexpr std::size_t size = ( sizeof( std::remove_reference_t<F> ) + ... + 0 );
+    };
+
+    template<class T>
+    using fields_of = scalar_fields<decltype( std::declval<T&>().wire_tie() )>;
+
+    // Archives writing fields as raw native bytes
+    template<class Archive> struct is_native_binary : std::false_type {};
+    template<> struct is_native_binary<BinaryOutputArchive> : std::true_type {};
+    template<> struct is_native_binary<BinaryInputArchive> : std::true_type {};
+
+    template<class T, class = void>
+    struct is_wire_layout : std::false_type {};
+
+    template<class T>
+    struct is_wire_layout<T, std::void_t<typename T::cereal_wire_layout>> : std::true_type
+    {
+      static_assert( std::is_aggregate<T>::value && std::is_trivially_copyable<T>::value,
+                     "CEREAL_WIRE_LAYOUT: the type has to be a trivially copyable aggregate" );
+      static_assert( fields_of<T>::value,
+                     "CEREAL_WIRE_LAYOUT: all fields have to be arithmetic or enum types" );
+      static_assert( field_count<T>() < max_fields,
+                     "CEREAL_WIRE_LAYOUT: from 1 to 15 fields are supported" );
+      static_assert( declaration_order<T>(),
+                     "CEREAL_WIRE_LAYOUT: list every field of the type, in declaration order" );
+    };
+
+    template<class Archive, class T>
+    using fast_path = std::integral_constant<bool, is_native_binary<Archive>::value && is_wire_layout<T>::value>;
+
+    // Records per block of the staging buffer
+    template<class T>
+    constexpr std::size_t block_records() { return std::max<std::size_t>( 1, ( 64 * 1024 ) / fields_of<T>::size ); }
+
+    template<class T> inline
+    char* pack( T const& t, char* p )
+    {
+      std::apply( [&p]( auto const&... f ) { ( ( std::memcpy( p, &f, sizeof( f ) ), p += sizeof( f ) ), ... ); }, t.wire_tie() );
+      return p;
+    }
+
+    template<class T> inline
+    const char* unpack( T& t, const char* p )
+    {
+      std::apply( [&p]( auto&... f ) { ( ( std::memcpy( &f, p, sizeof( f ) ), p += sizeof( f ) ), ... ); }, t.wire_tie() );
+      return p;
+    }
+  }
+
+
+  // std::vector of wire layout records, more specialized than the overloads of
+  // cereal/types/vector.hpp (default allocator)
+  template<class Archive, class T> inline
+  typename std::enable_if<wire_layout_detail::fast_path<Archive, T>::value, void>::type
+  CEREAL_SAVE_FUNCTION_NAME( Archive& ar, std::vector<T> const& vector )
+  {
+    ar( make_size_tag( static_cast<size_type>( vector.size() ) ) );
+
+    constexpr std::size_t packed = wire_layout_detail::fields_of<T>::size;
+    if constexpr( packed == sizeof( T ) ) {
+      ar( binary_data( vector.data(), vector.size() * sizeof( T ) ) );
+    } else {
+      constexpr std::size_t block = wire_layout_detail::block_records<T>();
+      std::unique_ptr<char[]> buf( new char[std::min( block, vector.size() ) * packed + 1] );
+      for( std::size_t i = 0; i < vector.size(); i += block ) {
+        const std::size_t k = std::min( block, vector.size() - i );
+        char* p = buf.get();
+        for( std::size_t j = 0; j < k; ++j ) {
+          p = wire_layout_detail::pack( vector[i + j], p );
+        }
+        ar( binary_data( buf.get(), k * packed ) );
+      }
+    }
+  }
+
+  template<class Archive, class T> inline
+  typename std::enable_if<wire_layout_detail::fast_path<Archive, T>::value, void>::type
+  CEREAL_LOAD_FUNCTION_NAME( Archive& ar, std::vector<T>& vector )
+  {
+    size_type size;
+    ar( make_size_tag( size ) );
+    vector.resize( static_cast<std::size_t>( size ) );
+
+    constexpr std::size_t packed = wire_layout_detail::fields_of<T>::size;
+    if constexpr( packed == sizeof( T ) ) {
+      ar( binary_data( vector.data(), vector.size() * sizeof( T ) ) );
+    } else {
+      constexpr std::size_t block = wire_layout_detail::block_records<T>();
+      std::unique_ptr<char[]> buf( new char[std::min( block, vector.size() ) * packed + 1] );
+      for( std::size_t i = 0; i < vector.size(); i += block ) {
+        const std::size_t k = std::min( block, vector.size() - i );
+        ar( binary_data( buf.get(), k * packed ) );
+        const char* p = buf.get();
+        for( std::size_t j = 0; j < k; ++j ) {
+          p = wire_layout_detail::unpack( vector[i + j], p );
+        }
+      }
+    }
+  }
+}
+
+
+// MyData from SER_01, no padding
+struct MyData
+{
+  int x, y, z;
+
+  CEREAL_WIRE_LAYOUT(x, y, z)
+};
+
+// MyRecord from SER_03_cereal_STL_support_4, 2 bytes padding before z
+struct MyRecord
+{
+  uint8_t x, y;
+  float z;
+
+  CEREAL_WIRE_LAYOUT(x, y, z)
+};
+
+// The same record with the usual serialize()
+struct MyRecordFieldwise
+{
+  uint8_t x, y;
+  float z;
+
+  template<class Archive>
+  void serialize(Archive& ar)
+  {
+    ar(x, y, z);
+  }
+};
+
+
+// [[Rcpp::export]]
+int main()
+{
+  std::vector<MyRecord> records{ {1, 2, 0.5f}, {3, 4, 1.5f}, {5, 6, 2.5f} };
+  std::stringstream ss;
+  {
+    cereal::BinaryOutputArchive oarchive(ss);
+    oarchive(records);
+  }
+  Rcpp::Rcout << "3 records in " << ss.str().size() << " bytes (8 size tag + 3 x 6)" << std::endl;
+
+  // the element wise type reads the same bytes
+  std::vector<MyRecordFieldwise> back;
+  {
+    cereal::BinaryInputArchive iarchive(ss);
+    iarchive(back);
+  }
+  for (const auto& r : back) {
+    Rcpp::Rcout << int(r.x) << " " << int(r.y) << " " << r.z << std::endl;
+  }
+
+  // without padding the vector is one block
+  std::vector<MyData> data{ {40, 41, 42}, {50, 51, 52} };
+  std::stringstream ss2;
+  {
+    cereal::BinaryOutputArchive oarchive(ss2);
+    oarchive(data);
+  }
+  Rcpp::Rcout << "2 MyData in " << ss2.str().size() << " bytes (8 size tag + 2 x 12)" << std::endl;
+
+  return 0;
+}
@@ -1,7 +1,12 @@
+// [[Rcpp::plugins("cpp17")]]
 // [[Rcpp::depends(RcppArmadillo)]]
 // [[Rcpp::depends(Rcereal)]]
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
 #include <cereal/archives/binary.hpp>
 #include <cereal/access.hpp>
 #include <RcppArmadillo.h>
@@ -9,26 +14,116 @@
 
 namespace arma {
 
-  template<class Archive>
-  void save(Archive & ar, const arma::sp_mat &t){
-    ar(t.n_rows, t.n_cols, t.n_nonzero);
-    
-    for (auto it = t.begin(); it != t.end(); ++it) {
-      ar(it.row(), it.col(), *it);
-    }
+  // Sparse matrices are stored in their native CSC layout:
+  //   n_rows | n_cols | n_nonzero | col_ptrs (n_cols + 1) | row_indices (n_nonzero) | values (n_nonzero)
+  // The three arrays are written as bulk binary_data blocks and the matrix is
+  // rebuilt with the CSC constructor in one pass, instead of inserting
+  // (row, col, value) triplets one at a time.
+  template<class Archive, class eT>
+  typename std::enable_if<cereal::traits::is_output_serializable<cereal::BinaryData<eT>, Archive>::value, void>::type
+    save(Archive & ar, const arma::SpMat<eT> &t) {
+      t.sync();  // make sure the CSC arrays are up to date
+      arma::uword n_rows = t.n_rows;
+      arma::uword n_cols = t.n_cols;
+      arma::uword n_nonzero = t.n_nonzero;
+      ar(n_rows, n_cols, n_nonzero);
+
+      ar( cereal::binary_data(
+            const_cast<arma::uword*>( t.col_ptrs ),
+            static_cast<std::size_t>( (n_cols + 1) * sizeof(arma::uword) ) ) );
+      ar( cereal::binary_data(
+            const_cast<arma::uword*>( t.row_indices ),
+            static_cast<std::size_t>( n_nonzero * sizeof(arma::uword) ) ) );
+      ar( cereal::binary_data(
+            const_cast<eT*>( t.values ),
+            static_cast<std::size_t>( n_nonzero * sizeof(eT) ) ) );
   }
 
-  template<class Archive>
-  void load(Archive & ar, arma::sp_mat &t) {
-    arma::uword r, c, nz;
-    ar(r, c, nz);
-    
-    t.zeros(r, c);
-    double v{};
-    while (nz--) {
-      ar(--r, --c, v);
-      t(r, c) = v;
+  template<class Archive, class eT>
+  typename std::enable_if<cereal::traits::is_input_serializable<cereal::BinaryData<eT>, Archive>::value, void>::type
+    load(Archive & ar, arma::SpMat<eT> &t) {
+      arma::uword n_rows{}, n_cols{}, n_nonzero{};
+      ar(n_rows, n_cols, n_nonzero);
+
+      arma::uvec col_ptrs(n_cols + 1);
+      arma::uvec row_indices(n_nonzero);
+      arma::Col<eT> values(n_nonzero);
+
+      ar( cereal::binary_data(
+            col_ptrs.memptr(),
+            static_cast<std::size_t>( (n_cols + 1) * sizeof(arma::uword) ) ) );
+      ar( cereal::binary_data(
+            row_indices.memptr(),
+            static_cast<std::size_t>( n_nonzero * sizeof(arma::uword) ) ) );
+      ar( cereal::binary_data(
+            values.memptr(),
+            static_cast<std::size_t>( n_nonzero * sizeof(eT) ) ) );
+
+      // the CSC constructor trusts the arrays, check them before
+      if (col_ptrs[0] != 0 || col_ptrs[n_cols] != n_nonzero) {
+        throw std::runtime_error("SpMat load: corrupt column pointers");
+      }
+      for (arma::uword j = 0; j < n_cols; ++j) {
+        if (col_ptrs[j] > col_ptrs[j + 1]) {
+          throw std::runtime_error("SpMat load: corrupt column pointers");
+        }
+      }
+      for (arma::uword k = 0; k < n_nonzero; ++k) {
+        if (row_indices[k] >= n_rows) {
+          throw std::runtime_error("SpMat load: row index out of bounds");
+        }
+      }
+
+      t = arma::SpMat<eT>(row_indices, col_ptrs, values, n_rows, n_cols);
+  }
+
+
+  // Loader for files written in the old triplet layout:
+  //   n_rows | n_cols | n_nonzero | (row, col, value) x n_nonzero
+  // The triplets are collected into a locations matrix and handed to the
+  // batch constructor, which builds the CSC arrays in one pass.
+  template<class eT>
+  struct LegacyTriplets
+  {
+    arma::SpMat<eT>& t;
+
+    template<class Archive>
+    void load(Archive & ar) {
+      arma::uword n_rows{}, n_cols{}, n_nonzero{};
+      ar(n_rows, n_cols, n_nonzero);
+
+      arma::umat locations(2, n_nonzero);
+      arma::Col<eT> values(n_nonzero);
+
+      if constexpr (cereal::traits::is_same_archive<Archive, cereal::BinaryInputArchive>::value) {
+        // native layout: read the interleaved triplets in large chunks
+        constexpr std::size_t triplet = 2 * sizeof(arma::uword) + sizeof(eT);
+        constexpr std::size_t chunk = 65536;
+        std::vector<char> buf(chunk * triplet);
+
+        for (arma::uword k = 0; k < n_nonzero; ) {
+          const std::size_t n = std::min<std::size_t>(chunk, n_nonzero - k);
+          ar( cereal::binary_data( buf.data(), n * triplet ) );
+          const char* p = buf.data();
+          for (std::size_t i = 0; i < n; ++i, ++k, p += triplet) {
+            std::memcpy( locations.colptr(k), p, 2 * sizeof(arma::uword) );
+            std::memcpy( &values[k], p + 2 * sizeof(arma::uword), sizeof(eT) );
+          }
+        }
+      } else {
+        for (arma::uword k = 0; k < n_nonzero; ++k) {
+          ar(locations(0, k), locations(1, k), values[k]);
+        }
+      }
+
+      t = arma::SpMat<eT>(locations, values, n_rows, n_cols);
     }
+  };
+
+  // Convenience function to make a LegacyTriplets
+  template<class eT> inline
+  LegacyTriplets<eT> make_legacy_triplets(arma::SpMat<eT>& t) {
+    return {t};
   }
 }
 
@@ -52,6 +147,14 @@ int main() {
     std::ofstream os("Backend/Serialize_sparseArma.bin", std::ios::binary);
     cereal::BinaryOutputArchive oarchive(os);
     oarchive(spA);
+
+    // the old triplet layout, as written by earlier versions of this example
+    std::ofstream os_old("Backend/Serialize_sparseArma_triplets.bin", std::ios::binary);
+    cereal::BinaryOutputArchive oarchive_old(os_old);
+    oarchive_old(spA.n_rows, spA.n_cols, spA.n_nonzero);
+    for (auto it = spA.begin(); it != spA.end(); ++it) {
+      oarchive_old(it.row(), it.col(), *it);
+    }
   }
   
   // .... put put put ... 
@@ -65,6 +168,16 @@ int main() {
     
     spB.print();
   }
+
+  { // Deserialize a file in the old triplet layout
+    arma::sp_mat spC;
+
+    std::ifstream is("Backend/Serialize_sparseArma_triplets.bin", std::ios::binary);
+    cereal::BinaryInputArchive iarchive(is);
+    iarchive(arma::make_legacy_triplets(spC));
+
+    spC.print();
+  }
   
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,205 @@
+// SER_04: Bulk binary serialization of arma::Cube, arma::field and complex
+//         matrices
+// ----------------------------------------------------------------------------
+// SER_04_Serialize_Arma_with_Binary_1.cpp only provides the single
+// binary_data fast path for arma::Mat<eT> with real element types.
+// In the following we extend the approach to
+// - arma::Cube<eT>: all slices are stored contiguously in memory, hence the
+//   whole cube is written as one binary_data payload
+// - complex element types (cx_mat, cx_cube, ...)
+// - arma::field<oT>: the field dimensions followed by its elements, each of
+//   them using its own bulk path (e.g. a field of cubes)
+//
+// All overloads work with cereal::BinaryOutputArchive and
+// cereal::PortableBinaryOutputArchive.
+//
+// NOTE:
+// The portable archive swaps the byte order in units of sizeof(T) of the
+// binary_data pointer type T. A std::complex<double> is two doubles, therefore
+// the payload is always handed over as pointer to the pod type (double, float)
+// of the element type, otherwise the real and imaginary part would be swapped
+// as one 16 byte unit.
+// ----------------------------------------------------------------------------
+// [[Rcpp::depends(RcppArmadillo)]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <fstream>
+#include <cereal/archives/binary.hpp>
+#include <cereal/archives/portable_binary.hpp>
+#include <cereal/access.hpp>
+
+#include <RcppArmadillo.h>
+
+
+namespace arma {
+
+  // pod type of an element type, i.e., double for double and cx_double
+  template<class eT>
+  using pod_t = typename get_pod_type<eT>::result;
+
+
+  // Writes n_elem elements starting at mem as one binary_data payload.
+  template<class Archive, class eT>
+  inline void save_payload( Archive& ar, const eT* mem, uword n_elem ) {
+    ar( cereal::binary_data(
+          reinterpret_cast<pod_t<eT>*>( const_cast<eT*>( mem ) ),
+          static_cast<std::size_t>( n_elem * sizeof(eT) )
+        )
+      );
+  }
+
+  // Reads n_elem elements into mem from one binary_data payload.
+  template<class Archive, class eT>
+  inline void load_payload( Archive& ar, eT* mem, uword n_elem ) {
+    ar( cereal::binary_data(
+          reinterpret_cast<pod_t<eT>*>( mem ),
+          static_cast<std::size_t>( n_elem * sizeof(eT) )
+        )
+      );
+  }
+
+
+  // Mat (real and complex)
+  // --------------------------------
+  template<class Archive, class eT>
+  typename std::enable_if<cereal::traits::is_output_serializable<cereal::BinaryData<pod_t<eT>>, Archive>::value, void>::type
+    save( Archive& ar, const Mat<eT>& m ) {
+      uword n_rows = m.n_rows;
+      uword n_cols = m.n_cols;
+      ar( n_rows );
+      ar( n_cols );
+      save_payload( ar, m.memptr(), m.n_elem );
+      return;
+  }
+
+  template<class Archive, class eT>
+  typename std::enable_if<cereal::traits::is_input_serializable<cereal::BinaryData<pod_t<eT>>, Archive>::value, void>::type
+    load( Archive& ar, Mat<eT>& m ) {
+      uword n_rows{};
+      uword n_cols{};
+      ar( n_rows );
+      ar( n_cols );
+      m.set_size( n_rows, n_cols );
+      load_payload( ar, m.memptr(), m.n_elem );
+      return;
+  }
+
+
+  // Cube (real and complex): one payload for all slices
+  // --------------------------------
+  template<class Archive, class eT>
+  typename std::enable_if<cereal::traits::is_output_serializable<cereal::BinaryData<pod_t<eT>>, Archive>::value, void>::type
+    save( Archive& ar, const Cube<eT>& c ) {
+      uword n_rows = c.n_rows;
+      uword n_cols = c.n_cols;
+      uword n_slices = c.n_slices;
+      ar( n_rows, n_cols, n_slices );
+      save_payload( ar, c.memptr(), c.n_elem );
+      return;
+  }
+
+  template<class Archive, class eT>
+  typename std::enable_if<cereal::traits::is_input_serializable<cereal::BinaryData<pod_t<eT>>, Archive>::value, void>::type
+    load( Archive& ar, Cube<eT>& c ) {
+      uword n_rows{};
+      uword n_cols{};
+      uword n_slices{};
+      ar( n_rows, n_cols, n_slices );
+      c.set_size( n_rows, n_cols, n_slices );
+      load_payload( ar, c.memptr(), c.n_elem );
+      return;
+  }
+
+
+  // field: dimensions, then every object with its own (bulk) serialization
+  // --------------------------------
+  template<class Archive, class oT>
+  typename std::enable_if<cereal::traits::is_output_serializable<cereal::BinaryData<char>, Archive>::value, void>::type
+    save( Archive& ar, const field<oT>& f ) {
+      uword n_rows = f.n_rows;
+      uword n_cols = f.n_cols;
+      uword n_slices = f.n_slices;
+      ar( n_rows, n_cols, n_slices );
+      for( uword i = 0; i < f.n_elem; ++i ) {
+        ar( f[i] );
+      }
+      return;
+  }
+
+  template<class Archive, class oT>
+  typename std::enable_if<cereal::traits::is_input_serializable<cereal::BinaryData<char>, Archive>::value, void>::type
+    load( Archive& ar, field<oT>& f ) {
+      uword n_rows{};
+      uword n_cols{};
+      uword n_slices{};
+      ar( n_rows, n_cols, n_slices );
+      f.set_size( n_rows, n_cols, n_slices );
+      for( uword i = 0; i < f.n_elem; ++i ) {
+        ar( f[i] );
+      }
+      return;
+  }
+}
+
+
+// round trip of the simulation state through a given archive pair
+template<class OArchive, class IArchive>
+void round_trip(const std::string& path) {
+
+  { // Serialize
+    arma::cx_mat cmat(4, 3, arma::fill::randn);
+    cmat.set_imag( arma::randn(4, 3) );
+    arma::cube acube(3, 4, 2, arma::fill::randu);
+
+    // simulation state: a field of cubes
+    arma::field<arma::cube> state(2, 2);
+    for( arma::uword i = 0; i < state.n_elem; ++i ) {
+      state[i] = arma::randn<arma::cube>(2, 3, i + 1);
+    }
+
+    arma::field<arma::mat> fmat(3);
+    fmat(0) = arma::randn(2, 2);
+    fmat(1) = arma::randn(3, 1);
+    fmat(2) = arma::randn(1, 4);
+
+    std::ofstream os(path, std::ios::binary);
+    OArchive oarchive(os);
+    oarchive(cmat, acube, state, fmat);
+  }
+
+  // .... put put put ...
+
+  { // Deserialize
+    arma::cx_mat cmat;
+    arma::cube acube;
+    arma::field<arma::cube> state;
+    arma::field<arma::mat> fmat;
+
+    std::ifstream is(path, std::ios::binary);
+    IArchive iarchive(is);
+    iarchive(cmat, acube, state, fmat);
+
+    cmat.print("cx_mat:");
+    acube.print("cube:");
+    state.print("field<cube>:");
+    fmat.print("field<mat>:");
+    Rcpp::Rcout << std::endl;
+  }
+}
+
+
+// [[Rcpp::export]]
+int main() {
+
+  Rcpp::Rcout << "Binary archive" << std::endl;
+  round_trip<cereal::BinaryOutputArchive, cereal::BinaryInputArchive>(
+    "Backend/Serialize_Arma_Cube_Field.bin"
+  );
+
+  Rcpp::Rcout << "Portable binary archive" << std::endl;
+  round_trip<cereal::PortableBinaryOutputArchive, cereal::PortableBinaryInputArchive>(
+    "Backend/Serialize_Arma_Cube_Field_portable.bin"
+  );
+
+  return 0;
+}
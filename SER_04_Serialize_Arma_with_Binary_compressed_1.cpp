@@ -0,0 +1,581 @@
+// SER_04: Block compressed binary archives
+// ----------------------------------------------------------------------------
+// cereal::BinaryOutputArchive writes the raw bytes straight into the stream,
+// so the Backend/*.bin files are as large as the matrices in RAM.
+//
+// cereal archives only talk to a std::ostream/std::istream, hence compression
+// can be plugged in below the archive as a std::streambuf:
+// - the output is cut into independent blocks of block_size bytes
+// - full blocks are compressed in parallel on a small worker pool and written
+//   in order as frames
+// - on load, frames are read ahead and decompressed in parallel
+//
+// The block size is the main knob: large blocks give a better compression
+// ratio, small blocks give more parallelism (and less memory per worker).
+// The codec and level are selected per archive and recorded per frame, so the
+// reader does not need to know them.
+//
+// Frame layout (all integers little endian):
+//   codec (uint32) | raw size (uint64) | stored size (uint64) | stored bytes
+// A frame with raw size 0 terminates the stream. Blocks which do not shrink
+// are stored uncompressed (codec none).
+//
+// Codecs:
+// - none: always available
+// - lz4:  define SER_WITH_LZ4 before the includes and link liblz4
+// - zstd: define SER_WITH_ZSTD before the includes and link libzstd
+// e.g. in R: Sys.setenv(PKG_LIBS = "-lzstd -llz4") before sourceCpp().
+//
+// NOTE:
+// The wrappers work with any cereal archive, the compression is independent
+// of the archive format. Destroy the wrapper (leave its scope) to flush the
+// last block, just like for the plain cereal archives.
+// ----------------------------------------------------------------------------
+// [[Rcpp::plugins("cpp17")]]
+// [[Rcpp::depends(RcppArmadillo)]]
+// [[Rcpp::depends(Rcereal)]]
+
+// #define SER_WITH_LZ4 1
+// #define SER_WITH_ZSTD 1
+
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <stdexcept>
+#include <streambuf>
+#include <thread>
+#include <vector>
+
+#ifdef SER_WITH_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef SER_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include <cereal/archives/binary.hpp>
+#include <cereal/types/list.hpp>
+#include <cereal/access.hpp>
+
+#include <RcppArmadillo.h>
+
+
+namespace arma {
+
+  template<class Archive, class eT>
+  typename std::enable_if<cereal::traits::is_output_serializable<cereal::BinaryData<eT>, Archive>::value, void>::type
+    save( Archive & ar, const arma::Mat<eT>& m ) {
+      arma::uword n_rows = m.n_rows;
+      arma::uword n_cols = m.n_cols;
+      ar( n_rows );
+      ar( n_cols );
+      ar( cereal::binary_data(
+          reinterpret_cast< void * const >( const_cast< eT* >( m.memptr() ) ),
+          static_cast< std::size_t >( n_rows * n_cols * sizeof( eT ) ) ) );
+    }
+
+  template<class Archive, class eT>
+  typename std::enable_if<cereal::traits::is_input_serializable<cereal::BinaryData<eT>, Archive>::value, void>::type
+    load( Archive & ar, arma::Mat<eT>& m ) {
+      arma::uword n_rows;
+      arma::uword n_cols;
+      ar( n_rows );
+      ar( n_cols );
+
+      m.resize( n_rows, n_cols );
+
+      ar( cereal::binary_data(
+          reinterpret_cast< void * const >( const_cast< eT* >( m.memptr() ) ),
+          static_cast< std::size_t >( n_rows * n_cols * sizeof( eT ) ) ) );
+    }
+}
+
+
+namespace cereal {
+
+  enum class Codec : std::uint32_t { none = 0, lz4 = 1, zstd = 2 };
+
+  struct CompressionOptions
+  {
+    Codec codec = Codec::none;
+    int level = 3;                    // codec specific, ignored for none
+    std::size_t block_size = 1 << 20; // bytes per independent block
+    unsigned n_threads = 0;           // 0: std::thread::hardware_concurrency()
+  };
+
+
+  // Compressed blocks
+  // --------------------------------
+  namespace compression_detail {
+
+    // largest block, also bounds the sizes read from a frame header
+    constexpr std::size_t max_block_size = std::size_t( 1 ) << 30;
+
+    struct Frame
+    {
+      Codec codec;
+      std::uint64_t raw_size;
+      std::vector<char> bytes;
+    };
+
+    inline void put_u64( std::ostream& os, std::uint64_t v, int n_bytes = 8 ) {
+      char buf[8];
+      for( int i = 0; i < n_bytes; ++i ) {
+        buf[i] = static_cast<char>( (v >> (8 * i)) & 0xFF );
+      }
+      os.write( buf, n_bytes );
+    }
+
+    inline bool get_u64( std::istream& is, std::uint64_t& v, int n_bytes = 8 ) {
+      unsigned char buf[8];
+      if( !is.read( reinterpret_cast<char*>( buf ), n_bytes ) ) {
+        return false;
+      }
+      v = 0;
+      for( int i = 0; i < n_bytes; ++i ) {
+        v |= static_cast<std::uint64_t>( buf[i] ) << (8 * i);
+      }
+      return true;
+    }
+
+    inline void check_codec( Codec codec ) {
+      switch( codec ) {
+        case Codec::none: return;
+#ifdef SER_WITH_LZ4
+        case Codec::lz4: return;
+#endif
+#ifdef SER_WITH_ZSTD
+        case Codec::zstd: return;
+#endif
+        default:
+          throw std::runtime_error( "compression: codec not available in this build" );
+      }
+    }
+
+    // Compresses a block, falls back to storing it when it does not shrink.
+    inline Frame compress( Codec codec, int level, const std::vector<char>& raw ) {
+      Frame f{ Codec::none, raw.size(), {} };
+      std::size_t n_out = 0;
+
+      switch( codec ) {
+#ifdef SER_WITH_LZ4
+        case Codec::lz4: {
+          f.bytes.resize( static_cast<std::size_t>( LZ4_compressBound( static_cast<int>( raw.size() ) ) ) );
+          int n = level <= 1
+            ? LZ4_compress_default( raw.data(), f.bytes.data(), static_cast<int>( raw.size() ), static_cast<int>( f.bytes.size() ) )
+            : LZ4_compress_HC( raw.data(), f.bytes.data(), static_cast<int>( raw.size() ), static_cast<int>( f.bytes.size() ), level );
+          n_out = n > 0 ? static_cast<std::size_t>( n ) : 0;
+          break;
+        }
+#endif
+#ifdef SER_WITH_ZSTD
+        case Codec::zstd: {
+          f.bytes.resize( ZSTD_compressBound( raw.size() ) );
+          std::size_t n = ZSTD_compress( f.bytes.data(), f.bytes.size(), raw.data(), raw.size(), level );
+          n_out = ZSTD_isError( n ) ? 0 : n;
+          break;
+        }
+#endif
+        default:
+          break;
+      }
+
+      if( n_out == 0 || n_out >= raw.size() ) {
+        f.bytes = raw;
+        return f;
+      }
+      f.codec = codec;
+      f.bytes.resize( n_out );
+      return f;
+    }
+
+    inline std::vector<char> decompress( const Frame& f ) {
+      if( f.codec == Codec::none ) {
+        if( f.raw_size != f.bytes.size() ) {
+          throw std::runtime_error( "compression: corrupt block size" );
+        }
+        return f.bytes;
+      }
+
+      std::vector<char> raw( static_cast<std::size_t>( f.raw_size ) );
+      bool ok = false;
+      switch( f.codec ) {
+#ifdef SER_WITH_LZ4
+        case Codec::lz4: {
+          int n = LZ4_decompress_safe( f.bytes.data(), raw.data(), static_cast<int>( f.bytes.size() ), static_cast<int>( raw.size() ) );
+          ok = n >= 0 && static_cast<std::size_t>( n ) == raw.size();
+          break;
+        }
+#endif
+#ifdef SER_WITH_ZSTD
+        case Codec::zstd: {
+          std::size_t n = ZSTD_decompress( raw.data(), raw.size(), f.bytes.data(), f.bytes.size() );
+          ok = !ZSTD_isError( n ) && n == raw.size();
+          break;
+        }
+#endif
+        default:
+          break;
+      }
+      if( !ok ) {
+        throw std::runtime_error( "compression: corrupt block or unsupported codec" );
+      }
+      return raw;
+    }
+
+
+    // Fixed size worker pool, tasks are returned as futures.
+    class ThreadPool
+    {
+    public:
+      explicit ThreadPool( unsigned n_threads ) {
+        if( n_threads == 0 ) {
+          n_threads = std::max( 1u, std::thread::hardware_concurrency() );
+        }
+        for( unsigned i = 0; i < n_threads; ++i ) {
+          workers.emplace_back( [this] { run(); } );
+        }
+      }
+
+      ~ThreadPool() {
+        {
+          std::lock_guard<std::mutex> lock( mtx );
+          stop = true;
+        }
+        cv.notify_all();
+        for( auto& w : workers ) {
+          w.join();
+        }
+      }
+
+      ThreadPool( const ThreadPool& ) = delete;
+      ThreadPool& operator=( const ThreadPool& ) = delete;
+
+      std::size_t size() const { return workers.size(); }
+
+      template<class F>
+      auto submit( F&& f ) -> std::future<decltype( f() )> {
+        auto task = std::make_shared<std::packaged_task<decltype( f() )()>>( std::forward<F>( f ) );
+        auto fut = task->get_future();
+        {
+          std::lock_guard<std::mutex> lock( mtx );
+          jobs.emplace( [task] { (*task)(); } );
+        }
+        cv.notify_one();
+        return fut;
+      }
+
+    private:
+      void run() {
+        for( ;; ) {
+          std::function<void()> job;
+          {
+            std::unique_lock<std::mutex> lock( mtx );
+            cv.wait( lock, [this] { return stop || !jobs.empty(); } );
+            if( stop && jobs.empty() ) {
+              return;
+            }
+            job = std::move( jobs.front() );
+            jobs.pop();
+          }
+          job();
+        }
+      }
+
+      std::vector<std::thread> workers;
+      std::queue<std::function<void()>> jobs;
+      std::mutex mtx;
+      std::condition_variable cv;
+      bool stop = false;
+    };
+  }
+
+
+  // Output side: collects block_size bytes, compresses on the pool,
+  // writes the frames in order into the sink.
+  class CompressingStreambuf : public std::streambuf
+  {
+  public:
+    CompressingStreambuf( std::ostream& sink, const CompressionOptions& opts )
+      : sink( sink ), opts( opts ), pool( opts.n_threads ), block( opts.block_size ) {
+        compression_detail::check_codec( opts.codec );
+        if( opts.block_size == 0 || opts.block_size > compression_detail::max_block_size ) {
+          throw std::invalid_argument( "compression: block_size must be in (0, 1 GB]" );
+        }
+        setp( block.data(), block.data() + block.size() );
+    }
+
+    // Errors during the final flush cannot be reported from a destructor,
+    // call finish() explicitly if you need to handle them.
+    ~CompressingStreambuf() {
+      try { finish(); } catch( ... ) {}
+    }
+
+    void finish() {
+      if( finished ) {
+        return;
+      }
+      finished = true;
+      submit_block();
+      drain( 0 );
+      compression_detail::put_u64( sink, static_cast<std::uint64_t>( Codec::none ), 4 );
+      compression_detail::put_u64( sink, 0 );
+      compression_detail::put_u64( sink, 0 );
+      sink.flush();
+    }
+
+  protected:
+    int_type overflow( int_type ch ) override {
+      submit_block();
+      if( !traits_type::eq_int_type( ch, traits_type::eof() ) ) {
+        *pptr() = traits_type::to_char_type( ch );
+        pbump( 1 );
+      }
+      return traits_type::not_eof( ch );
+    }
+
+    std::streamsize xsputn( const char* s, std::streamsize n ) override {
+      std::streamsize done = 0;
+      while( done < n ) {
+        std::streamsize room = epptr() - pptr();
+        if( room == 0 ) {
+          submit_block();
+          continue;
+        }
+        std::streamsize k = std::min( room, n - done );
+        std::memcpy( pptr(), s + done, static_cast<std::size_t>( k ) );
+        pbump( static_cast<int>( k ) );
+        done += k;
+      }
+      return n;
+    }
+
+    int sync() override {
+      submit_block();
+      drain( 0 );
+      sink.flush();
+      return sink ? 0 : -1;
+    }
+
+  private:
+    void submit_block() {
+      std::size_t n = static_cast<std::size_t>( pptr() - pbase() );
+      if( n == 0 ) {
+        return;
+      }
+      block.resize( n );
+      pending.push_back( pool.submit(
+        [raw = std::move( block ), codec = opts.codec, level = opts.level] {
+          return compression_detail::compress( codec, level, raw );
+        } ) );
+
+      block = std::vector<char>( opts.block_size );
+      setp( block.data(), block.data() + block.size() );
+
+      // bound the memory held by blocks in flight
+      drain( 2 * pool.size() );
+    }
+
+    void drain( std::size_t max_pending ) {
+      while( pending.size() > max_pending ) {
+        compression_detail::Frame f = pending.front().get();
+        pending.pop_front();
+        compression_detail::put_u64( sink, static_cast<std::uint64_t>( f.codec ), 4 );
+        compression_detail::put_u64( sink, f.raw_size );
+        compression_detail::put_u64( sink, f.bytes.size() );
+        sink.write( f.bytes.data(), static_cast<std::streamsize>( f.bytes.size() ) );
+      }
+      if( !sink ) {
+        throw std::runtime_error( "compression: writing to the sink failed" );
+      }
+    }
+
+    std::ostream& sink;
+    CompressionOptions opts;
+    compression_detail::ThreadPool pool;
+    std::vector<char> block;
+    std::deque<std::future<compression_detail::Frame>> pending;
+    bool finished = false;
+  };
+
+
+  // Input side: reads frames ahead, decompresses them on the pool and hands
+  // out the decoded blocks in order.
+  class DecompressingStreambuf : public std::streambuf
+  {
+  public:
+    DecompressingStreambuf( std::istream& source, unsigned n_threads = 0 )
+      : source( source ), pool( n_threads ) {}
+
+  protected:
+    int_type underflow() override {
+      if( gptr() < egptr() ) {
+        return traits_type::to_int_type( *gptr() );
+      }
+      if( !next_block() ) {
+        return traits_type::eof();
+      }
+      return traits_type::to_int_type( *gptr() );
+    }
+
+  private:
+    bool next_block() {
+      read_ahead();
+      while( !pending.empty() ) {
+        current = pending.front().get();
+        pending.pop_front();
+        read_ahead();
+        if( !current.empty() ) {
+          setg( current.data(), current.data(), current.data() + current.size() );
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void read_ahead() {
+      while( !end_of_stream && pending.size() < 2 * pool.size() ) {
+        std::uint64_t codec{}, raw_size{}, stored_size{};
+        if( !compression_detail::get_u64( source, codec, 4 ) ||
+            !compression_detail::get_u64( source, raw_size ) ||
+            !compression_detail::get_u64( source, stored_size ) ) {
+          throw std::runtime_error( "compression: truncated stream" );
+        }
+        if( raw_size == 0 ) {
+          end_of_stream = true;
+          return;
+        }
+        // frames are stored raw unless compression makes them smaller
+        if( raw_size > compression_detail::max_block_size || stored_size > raw_size ) {
+          throw std::runtime_error( "compression: corrupt frame header" );
+        }
+
+        compression_detail::Frame f{ static_cast<Codec>( codec ), raw_size,
+                                     std::vector<char>( static_cast<std::size_t>( stored_size ) ) };
+        if( !source.read( f.bytes.data(), static_cast<std::streamsize>( stored_size ) ) ) {
+          throw std::runtime_error( "compression: truncated block" );
+        }
+        pending.push_back( pool.submit(
+          [f = std::move( f )] { return compression_detail::decompress( f ); } ) );
+      }
+    }
+
+    std::istream& source;
+    compression_detail::ThreadPool pool;
+    std::vector<char> current;
+    std::deque<std::future<std::vector<char>>> pending;
+    bool end_of_stream = false;
+  };
+
+
+  // Archive wrappers
+  // --------------------------------
+  // Own the compression stage and an archive of type Archive on top of it.
+  // Members are destroyed in reverse order: the archive finishes first, then
+  // the stream buffer flushes the last block.
+  template<class Archive>
+  class CompressedOutputArchive
+  {
+  public:
+    CompressedOutputArchive( std::ostream& sink, const CompressionOptions& opts = CompressionOptions{} )
+      : buf( sink, opts ), os( &buf ), ar( os ) {}
+
+    template<class ... Types>
+    CompressedOutputArchive& operator()( Types && ... args ) {
+      ar( std::forward<Types>( args )... );
+      return *this;
+    }
+
+  private:
+    CompressingStreambuf buf;
+    std::ostream os;
+    Archive ar;
+  };
+
+  template<class Archive>
+  class CompressedInputArchive
+  {
+  public:
+    CompressedInputArchive( std::istream& source, unsigned n_threads = 0 )
+      : buf( source, n_threads ), is( &buf ), ar( is ) {}
+
+    template<class ... Types>
+    CompressedInputArchive& operator()( Types && ... args ) {
+      ar( std::forward<Types>( args )... );
+      return *this;
+    }
+
+  private:
+    DecompressingStreambuf buf;
+    std::istream is;
+    Archive ar;
+  };
+}
+
+
+
+// [[Rcpp::export]]
+int main() {
+
+  cereal::CompressionOptions opts;
+#if defined(SER_WITH_ZSTD)
+  opts.codec = cereal::Codec::zstd;
+  opts.level = 3;
+#elif defined(SER_WITH_LZ4)
+  opts.codec = cereal::Codec::lz4;
+  opts.level = 1;
+#endif
+  opts.block_size = 256 * 1024;
+  opts.n_threads = 4;
+
+  { // Serialize
+    // rounded values compress well, just like sparse or quantized data
+    arma::mat amat1 = arma::round( 10 * arma::randn(1000, 500) );
+    arma::mat amat2 = arma::zeros(300, 300);
+    std::list<arma::mat> lst_amat{ amat1, amat2 };
+
+    Rcpp::Rcout << "Serialization begin." << std::endl;
+    std::ofstream os_raw("Backend/Serialize_Arma.bin", std::ios::binary);
+    cereal::BinaryOutputArchive oarchive_raw(os_raw);
+    oarchive_raw(amat1, lst_amat);
+
+    std::ofstream os("Backend/Serialize_Arma_compressed.bin", std::ios::binary);
+    cereal::CompressedOutputArchive<cereal::BinaryOutputArchive> oarchive(os, opts);
+    oarchive(amat1, lst_amat);
+    Rcpp::Rcout << "Serialization finished." << std::endl;
+  }
+
+  Rcpp::Rcout << "raw size:        "
+              << std::filesystem::file_size("Backend/Serialize_Arma.bin") << " bytes" << std::endl;
+  Rcpp::Rcout << "compressed size: "
+              << std::filesystem::file_size("Backend/Serialize_Arma_compressed.bin") << " bytes" << std::endl;
+
+  // .... put put put ...
+
+  { // Deserialize
+    arma::mat bmat;
+    std::list<arma::mat> lst_bmat;
+
+    Rcpp::Rcout << "Deserialization begin." << std::endl;
+    std::ifstream is("Backend/Serialize_Arma_compressed.bin", std::ios::binary);
+    cereal::CompressedInputArchive<cereal::BinaryInputArchive> iarchive(is, opts.n_threads);
+    iarchive(bmat, lst_bmat);
+    Rcpp::Rcout << "Deserialization finished." << std::endl;
+
+    bmat.submat(0, 0, 4, 4).print();
+    Rcpp::Rcout << "list entries: " << lst_bmat.size() << std::endl;
+  }
+
+  return 0;
+}
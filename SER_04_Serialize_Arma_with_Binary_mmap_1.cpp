@@ -0,0 +1,332 @@
+// SER_04: Zero-copy loading of arma::Mat via memory mapping
+// ----------------------------------------------------------------------------
+// The load overload in SER_04_Serialize_Arma_with_Binary_1.cpp resizes the
+// matrix and copies every byte of the binary_data payload out of the stream.
+// For multi-GB checkpoints this doubles the peak RSS and spends most of the
+// time in read() copies.
+//
+// Here we write the payload 64-byte aligned into the file, such that it can be
+// mapped into memory and wrapped by an arma::Mat through the advanced
+// constructor (copy_aux_mem = false). Loading is then O(1) in the matrix size:
+// the kernel only sets up the page tables, the data are paged in on access.
+//
+// File layout of one aligned matrix:
+//   n_rows (uword) | n_cols (uword) | n_pad (uword) | n_pad zero bytes | data
+// where n_pad is chosen such that data starts at a multiple of 64 bytes
+// relative to the beginning of the file.
+//
+// The files remain readable with a plain cereal::BinaryInputArchive (the
+// padding is skipped), so the mapping is an optional fast path.
+//
+// NOTE:
+// - Like cereal::BinaryOutputArchive the layout is not portable across
+//   platforms with different endianness or arma::uword size.
+// - POSIX only (mmap/madvise).
+// ----------------------------------------------------------------------------
+// [[Rcpp::plugins("cpp17")]]
+// [[Rcpp::depends(RcppArmadillo)]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cereal/archives/binary.hpp>
+#include <cereal/access.hpp>
+
+#include <RcppArmadillo.h>
+
+
+namespace arma {
+
+  // alignment of the binary_data payload within the file (cache line size)
+  constexpr std::size_t mmap_alignment = 64;
+
+  // Bytes of an n_rows x n_cols payload, throws for header values whose size
+  // does not fit in std::size_t (corrupt files)
+  template<class eT> inline
+  std::size_t aligned_payload_bytes(uword n_rows, uword n_cols)
+  {
+    const std::size_t max_elem = std::numeric_limits<std::size_t>::max() / sizeof(eT);
+    if( n_cols != 0 && n_rows > max_elem / n_cols ) {
+      throw std::runtime_error( "aligned matrix: corrupt size " + std::to_string( n_rows ) + " x " + std::to_string( n_cols ) );
+    }
+    return static_cast<std::size_t>( n_rows * n_cols ) * sizeof(eT);
+  }
+
+
+  // Wrapper type to request the aligned layout for a matrix.
+  // The wrapper needs the underlying stream to know the current file offset,
+  // cereal::BinaryOutputArchive writes unbuffered into the streambuf, hence
+  // tellp() reflects the exact position of the next byte.
+  template<class eT>
+  struct AlignedMat
+  {
+    const Mat<eT>& m;
+    std::ostream& os;
+
+    template<class Archive>
+    void save(Archive& ar) const
+    {
+      uword n_rows = m.n_rows;
+      uword n_cols = m.n_cols;
+      ar( n_rows );
+      ar( n_cols );
+
+      // offset after n_pad has been written
+      const std::size_t pos = static_cast<std::size_t>( os.tellp() ) + sizeof(uword);
+      uword n_pad = ( mmap_alignment - pos % mmap_alignment ) % mmap_alignment;
+      ar( n_pad );
+
+      const char zeros[mmap_alignment] = {};
+      ar( cereal::binary_data( const_cast<char*>( zeros ), static_cast<std::size_t>( n_pad ) ) );
+
+      ar( cereal::binary_data(
+            const_cast<eT*>( m.memptr() ),
+            static_cast<std::size_t>( n_rows * n_cols * sizeof(eT) )
+          )
+        );
+    }
+  };
+
+  // Convenience function to make an AlignedMat
+  template<class eT> inline
+  AlignedMat<eT> make_aligned(const Mat<eT>& m, std::ostream& os)
+  {
+    return {m, os};
+  }
+
+
+  // Copying fallback: reads an aligned matrix from any binary input archive.
+  template<class eT>
+  struct AlignedMatReader
+  {
+    Mat<eT>& m;
+
+    template<class Archive>
+    void load(Archive& ar)
+    {
+      uword n_rows{};
+      uword n_cols{};
+      uword n_pad{};
+      ar( n_rows );
+      ar( n_cols );
+      ar( n_pad );
+      if( n_pad >= mmap_alignment ) {
+        throw std::runtime_error( "AlignedMatReader: corrupt padding" );
+      }
+
+      char pad[mmap_alignment];
+      ar( cereal::binary_data( pad, static_cast<std::size_t>( n_pad ) ) );
+
+      const std::size_t n_bytes = aligned_payload_bytes<eT>( n_rows, n_cols );
+      m.resize( n_rows, n_cols );
+      ar( cereal::binary_data( m.memptr(), n_bytes ) );
+    }
+  };
+
+  template<class eT> inline
+  AlignedMatReader<eT> make_aligned_reader(Mat<eT>& m)
+  {
+    return {m};
+  }
+
+
+  // Hints passed to the kernel when mapping a file.
+  // - populate: prefault all pages during mmap (MAP_POPULATE, Linux only).
+  //             Makes loading O(file size) again, but avoids page faults later.
+  // - advice:   madvise() hint, e.g. MADV_SEQUENTIAL for streaming access,
+  //             MADV_RANDOM for column lookups, MADV_WILLNEED for read-ahead.
+  struct MapOptions
+  {
+    bool populate = false;
+    int advice = MADV_NORMAL;
+  };
+
+
+  // RAII handle of a read-only file mapping.
+  // The mapping is private (copy-on-write), hence writing into a matrix that
+  // wraps the mapping never modifies the file, it only copies the touched pages.
+  class MappedFile
+  {
+  public:
+    MappedFile(const std::string& path, const MapOptions& opts = MapOptions{})
+    {
+      int fd = ::open( path.c_str(), O_RDONLY );
+      if( fd < 0 ) {
+        throw std::runtime_error( "MappedFile: cannot open " + path );
+      }
+
+      struct stat st;
+      if( ::fstat( fd, &st ) != 0 ) {
+        ::close( fd );
+        throw std::runtime_error( "MappedFile: cannot stat " + path );
+      }
+      n_bytes = static_cast<std::size_t>( st.st_size );
+
+      int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+      if( opts.populate ) {
+        flags |= MAP_POPULATE;
+      }
+#endif
+      if( n_bytes > 0 ) {
+        void* p = ::mmap( nullptr, n_bytes, PROT_READ | PROT_WRITE, flags, fd, 0 );
+        if( p == MAP_FAILED ) {
+          ::close( fd );
+          throw std::runtime_error( "MappedFile: mmap failed for " + path );
+        }
+        base = static_cast<char*>( p );
+        ::madvise( base, n_bytes, opts.advice );
+      }
+      // the mapping keeps its own reference to the file
+      ::close( fd );
+    }
+
+    ~MappedFile()
+    {
+      if( base != nullptr ) {
+        ::munmap( base, n_bytes );
+      }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    char* data() const { return base; }
+    std::size_t size() const { return n_bytes; }
+
+  private:
+    char* base = nullptr;
+    std::size_t n_bytes = 0;
+  };
+
+
+  // A matrix that lives on mapped pages.
+  // The mat member does not own its memory (copy_aux_mem = false, strict = true),
+  // the shared mapping keeps the pages alive as long as the MappedMat exists.
+  // Copies of mat are ordinary (owning) matrices.
+  template<class eT>
+  struct MappedMat
+  {
+    MappedMat(std::shared_ptr<MappedFile> f, eT* ptr, uword n_rows, uword n_cols)
+      : file(std::move(f)), mat(ptr, n_rows, n_cols, false, true) {}
+
+    std::shared_ptr<MappedFile> file;
+    Mat<eT> mat;
+  };
+
+
+  // Sequential reader of aligned matrices from a mapped file.
+  // Each call to next() parses a header and wraps the payload without copying.
+  class MappedMatReader
+  {
+  public:
+    MappedMatReader(const std::string& path, const MapOptions& opts = MapOptions{})
+      : file(std::make_shared<MappedFile>(path, opts)) {}
+
+    template<class eT>
+    MappedMat<eT> next()
+    {
+      uword n_rows = read_uword();
+      uword n_cols = read_uword();
+      uword n_pad  = read_uword();
+      if( n_pad >= mmap_alignment ) {
+        throw std::runtime_error( "MappedMatReader: corrupt padding" );
+      }
+      pos += n_pad;
+
+      const std::size_t n_bytes = aligned_payload_bytes<eT>( n_rows, n_cols );
+      if( pos % mmap_alignment != 0 || pos > file->size() || n_bytes > file->size() - pos ) {
+        throw std::runtime_error( "MappedMatReader: corrupt or unaligned matrix payload" );
+      }
+
+      eT* ptr = reinterpret_cast<eT*>( file->data() + pos );
+      pos += n_bytes;
+      return MappedMat<eT>( file, ptr, n_rows, n_cols );
+    }
+
+  private:
+    uword read_uword()
+    {
+      if( pos + sizeof(uword) > file->size() ) {
+        throw std::runtime_error( "MappedMatReader: unexpected end of file" );
+      }
+      uword val;
+      std::memcpy( &val, file->data() + pos, sizeof(uword) );
+      pos += sizeof(uword);
+      return val;
+    }
+
+    std::shared_ptr<MappedFile> file;
+    std::size_t pos = 0;
+  };
+}
+
+
+
+// [[Rcpp::export]]
+int main() {
+
+  { // Serialize
+    arma::mat amat1 = arma::randn(5, 10);
+    arma::mat amat2 = arma::randn(4, 5);
+    arma::vec avec1 = arma::randn(7);
+
+    Rcpp::Rcout << "Serialization begin." << std::endl;
+    std::ofstream os("Backend/Serialize_Arma_mmap.bin", std::ios::binary);
+    cereal::BinaryOutputArchive oarchive(os);
+    oarchive(arma::make_aligned(amat1, os),
+             arma::make_aligned(amat2, os),
+             arma::make_aligned(avec1, os));
+    Rcpp::Rcout << "Serialization finished." << std::endl;
+  }
+
+  // .... put put put ...
+
+  { // Deserialize via memory mapping (zero-copy)
+    Rcpp::Rcout << "Mapping begin." << std::endl;
+    arma::MapOptions opts;
+    opts.advice = MADV_SEQUENTIAL;
+    arma::MappedMatReader reader("Backend/Serialize_Arma_mmap.bin", opts);
+
+    arma::MappedMat<double> bmat1 = reader.next<double>();
+    arma::MappedMat<double> bmat2 = reader.next<double>();
+    arma::MappedMat<double> bvec1 = reader.next<double>();
+    Rcpp::Rcout << "Mapping finished." << std::endl;
+
+    bmat1.mat.print();
+    Rcpp::Rcout << std::endl;
+    bmat2.mat.print();
+    Rcpp::Rcout << std::endl;
+    bvec1.mat.print();
+    Rcpp::Rcout << std::endl;
+
+    // arithmetic works as usual, results are ordinary matrices
+    arma::mat prod = bmat1.mat.t() * bmat1.mat;
+    Rcpp::Rcout << "trace(A'A): " << arma::trace(prod) << std::endl;
+  }
+
+  { // Deserialize via copying fallback
+    arma::mat cmat1, cmat2;
+    arma::mat cvec1;
+
+    std::ifstream is("Backend/Serialize_Arma_mmap.bin", std::ios::binary);
+    cereal::BinaryInputArchive iarchive(is);
+    iarchive(arma::make_aligned_reader(cmat1),
+             arma::make_aligned_reader(cmat2),
+             arma::make_aligned_reader(cvec1));
+
+    cmat1.print();
+  }
+
+  return 0;
+}
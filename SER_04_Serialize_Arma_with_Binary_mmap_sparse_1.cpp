@@ -0,0 +1,321 @@
+// SER_04: Memory-mapped read-only view over sparse CSC archives
+// ----------------------------------------------------------------------------
+// For very large sparse matrices (e.g. adjacency matrices) which are only
+// used in matrix-vector products, there is no need to materialize an
+// arma::sp_mat. The CSC layout written by the sparse save overload of
+// SER_04_Serialize_Arma_with_Binary_2.cpp
+//
+//   n_rows | n_cols | n_nonzero | col_ptrs (n_cols + 1) | row_indices | values
+//
+// consists of arrays of uword and eT only, every array starts at a multiple of
+// sizeof(uword) relative to the header. Hence the file can be mapped and the
+// arrays can be used in place.
+//
+// MappedSpMat<eT> maps such an archive read-only and shared. All processes
+// mapping the same file (e.g. several R workers) use the one copy in the page
+// cache instead of a private copy each.
+//
+// It offers
+// - column iteration: for (auto e : A.col(j)) { e.row, e.value }
+// - spmv:   y = A x   (scatter over the columns)
+// - spmv_t: y = A' x  (one dot product per column, parallel with OpenMP)
+//
+// NOTE:
+// - The layout is the native one of cereal::BinaryOutputArchive, i.e., the
+//   file must be written on a platform with the same endianness and uword.
+// - POSIX only (mmap/madvise).
+// - The column pointers and row indices are validated when the file is
+//   mapped, which reads these two arrays once. The values are not touched.
+// ----------------------------------------------------------------------------
+// [[Rcpp::plugins(openmp)]]
+// [[Rcpp::depends(RcppArmadillo)]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cereal/archives/binary.hpp>
+#include <cereal/access.hpp>
+#include <RcppArmadillo.h>
+
+
+namespace arma {
+
+  template<class Archive, class eT>
+  typename std::enable_if<cereal::traits::is_output_serializable<cereal::BinaryData<eT>, Archive>::value, void>::type
+    save(Archive & ar, const arma::SpMat<eT> &t) {
+      t.sync();  // make sure the CSC arrays are up to date
+      arma::uword n_rows = t.n_rows;
+      arma::uword n_cols = t.n_cols;
+      arma::uword n_nonzero = t.n_nonzero;
+      ar(n_rows, n_cols, n_nonzero);
+
+      ar( cereal::binary_data(
+            const_cast<arma::uword*>( t.col_ptrs ),
+            static_cast<std::size_t>( (n_cols + 1) * sizeof(arma::uword) ) ) );
+      ar( cereal::binary_data(
+            const_cast<arma::uword*>( t.row_indices ),
+            static_cast<std::size_t>( n_nonzero * sizeof(arma::uword) ) ) );
+      ar( cereal::binary_data(
+            const_cast<eT*>( t.values ),
+            static_cast<std::size_t>( n_nonzero * sizeof(eT) ) ) );
+  }
+
+
+  // RAII handle of a read-only, shared file mapping.
+  class SharedMappedFile
+  {
+  public:
+    SharedMappedFile(const std::string& path, int advice = MADV_NORMAL)
+    {
+      int fd = ::open( path.c_str(), O_RDONLY );
+      if( fd < 0 ) {
+        throw std::runtime_error( "SharedMappedFile: cannot open " + path );
+      }
+
+      struct stat st;
+      if( ::fstat( fd, &st ) != 0 ) {
+        ::close( fd );
+        throw std::runtime_error( "SharedMappedFile: cannot stat " + path );
+      }
+      n_bytes = static_cast<std::size_t>( st.st_size );
+
+      if( n_bytes > 0 ) {
+        void* p = ::mmap( nullptr, n_bytes, PROT_READ, MAP_SHARED, fd, 0 );
+        if( p == MAP_FAILED ) {
+          ::close( fd );
+          throw std::runtime_error( "SharedMappedFile: mmap failed for " + path );
+        }
+        base = static_cast<const char*>( p );
+        ::madvise( const_cast<char*>( base ), n_bytes, advice );
+      }
+      ::close( fd );
+    }
+
+    ~SharedMappedFile()
+    {
+      if( base != nullptr ) {
+        ::munmap( const_cast<char*>( base ), n_bytes );
+      }
+    }
+
+    SharedMappedFile(const SharedMappedFile&) = delete;
+    SharedMappedFile& operator=(const SharedMappedFile&) = delete;
+
+    const char* data() const { return base; }
+    std::size_t size() const { return n_bytes; }
+
+  private:
+    const char* base = nullptr;
+    std::size_t n_bytes = 0;
+  };
+
+
+  // Read-only sparse matrix over a mapped CSC archive.
+  template<class eT>
+  class MappedSpMat
+  {
+  public:
+    struct Entry
+    {
+      uword row;
+      eT value;
+    };
+
+    // Entries of one column, in increasing row order.
+    class ColRange
+    {
+    public:
+      class iterator
+      {
+      public:
+        iterator(const uword* r, const eT* v) : r(r), v(v) {}
+        Entry operator*() const { return { *r, *v }; }
+        iterator& operator++() { ++r; ++v; return *this; }
+        bool operator!=(const iterator& o) const { return r != o.r; }
+      private:
+        const uword* r;
+        const eT* v;
+      };
+
+      ColRange(const uword* r, const eT* v, uword n) : r(r), v(v), n(n) {}
+      iterator begin() const { return { r, v }; }
+      iterator end() const { return { r + n, v + n }; }
+      uword size() const { return n; }
+
+    private:
+      const uword* r;
+      const eT* v;
+      uword n;
+    };
+
+    // Maps the archive and locates the CSC arrays of the matrix starting at
+    // byte offset (a multiple of sizeof(uword), 0 if it is the first object).
+    MappedSpMat(const std::string& path, std::size_t offset = 0, int advice = MADV_NORMAL)
+      : file( std::make_shared<SharedMappedFile>( path, advice ) )
+    {
+      if( offset % sizeof(uword) != 0 ) {
+        throw std::runtime_error( "MappedSpMat: offset must be a multiple of sizeof(uword)" );
+      }
+      const char* p = file->data() + offset;
+      std::size_t need = offset + 3 * sizeof(uword);
+      if( need > file->size() ) {
+        throw std::runtime_error( "MappedSpMat: file too short" );
+      }
+
+      uword header[3];
+      std::memcpy( header, p, sizeof(header) );
+      rows = header[0];
+      cols = header[1];
+      nnz  = header[2];
+
+      // sizes are checked against the bytes left, a corrupt header must not
+      // overflow the computation
+      std::size_t left = file->size() - need;
+      if( cols >= left / sizeof(uword) ) {
+        throw std::runtime_error( "MappedSpMat: file too short for the CSC arrays" );
+      }
+      left -= (cols + 1) * sizeof(uword);
+      if( nnz > left / (sizeof(uword) + sizeof(eT)) ) {
+        throw std::runtime_error( "MappedSpMat: file too short for the CSC arrays" );
+      }
+
+      p += sizeof(header);
+      col_ptrs = reinterpret_cast<const uword*>( p );
+      p += (cols + 1) * sizeof(uword);
+      row_indices = reinterpret_cast<const uword*>( p );
+      p += nnz * sizeof(uword);
+      if( reinterpret_cast<std::uintptr_t>( p ) % alignof(eT) != 0 ) {
+        throw std::runtime_error( "MappedSpMat: values are not aligned for the element type" );
+      }
+      values = reinterpret_cast<const eT*>( p );
+
+      // validated once here, col() and the products index without checks
+      if( col_ptrs[0] != 0 || col_ptrs[cols] != nnz ) {
+        throw std::runtime_error( "MappedSpMat: corrupt column pointers" );
+      }
+      for( uword j = 0; j < cols; ++j ) {
+        if( col_ptrs[j] > col_ptrs[j + 1] ) {
+          throw std::runtime_error( "MappedSpMat: corrupt column pointers" );
+        }
+      }
+      for( uword k = 0; k < nnz; ++k ) {
+        if( row_indices[k] >= rows ) {
+          throw std::runtime_error( "MappedSpMat: row index out of bounds" );
+        }
+      }
+    }
+
+    uword n_rows() const { return rows; }
+    uword n_cols() const { return cols; }
+    uword n_nonzero() const { return nnz; }
+
+    ColRange col(uword j) const
+    {
+      if( j >= cols ) {
+        throw std::out_of_range( "MappedSpMat: column index out of bounds" );
+      }
+      const uword k = col_ptrs[j];
+      return ColRange( row_indices + k, values + k, col_ptrs[j + 1] - k );
+    }
+
+    // y = A x
+    Col<eT> spmv(const Col<eT>& x) const
+    {
+      if( x.n_elem != cols ) {
+        throw std::invalid_argument( "MappedSpMat::spmv: size mismatch" );
+      }
+      Col<eT> y( rows, fill::zeros );
+      eT* py = y.memptr();
+      for( uword j = 0; j < cols; ++j ) {
+        const eT xj = x[j];
+        for( uword k = col_ptrs[j]; k < col_ptrs[j + 1]; ++k ) {
+          py[ row_indices[k] ] += values[k] * xj;
+        }
+      }
+      return y;
+    }
+
+    // y = A' x, the columns are independent dot products
+    Col<eT> spmv_t(const Col<eT>& x) const
+    {
+      if( x.n_elem != rows ) {
+        throw std::invalid_argument( "MappedSpMat::spmv_t: size mismatch" );
+      }
+      Col<eT> y( cols );
+      eT* py = y.memptr();
+      const eT* px = x.memptr();
+#ifdef _OPENMP
+      #pragma omp parallel for schedule(dynamic, 256)
+#endif
+      for( long long j = 0; j < static_cast<long long>( cols ); ++j ) {
+        eT acc = eT(0);
+        for( uword k = col_ptrs[j]; k < col_ptrs[j + 1]; ++k ) {
+          acc += values[k] * px[ row_indices[k] ];
+        }
+        py[j] = acc;
+      }
+      return y;
+    }
+
+  private:
+    std::shared_ptr<SharedMappedFile> file;
+    uword rows = 0;
+    uword cols = 0;
+    uword nnz = 0;
+    const uword* col_ptrs = nullptr;
+    const uword* row_indices = nullptr;
+    const eT* values = nullptr;
+  };
+}
+
+
+// y = A x with A mapped from an archive written by main(), callable from
+// several R worker processes at once.
+// [[Rcpp::export]]
+arma::vec mapped_spmv(std::string path, const arma::vec& x) {
+  arma::MappedSpMat<double> A(path);
+  return A.spmv(x);
+}
+
+
+// [[Rcpp::export]]
+int main() {
+
+  arma::sp_mat spA = arma::sprandu<arma::sp_mat>(5000, 3000, 0.002);
+
+  { // Serialize
+    std::ofstream os("Backend/Serialize_sparseArma_csc.bin", std::ios::binary);
+    cereal::BinaryOutputArchive oarchive(os);
+    oarchive(spA);
+  }
+
+  // .... put put put ...
+
+  { // Map, without materializing an sp_mat
+    arma::MappedSpMat<double> A("Backend/Serialize_sparseArma_csc.bin");
+    Rcpp::Rcout << "mapped: " << A.n_rows() << " x " << A.n_cols()
+                << ", non-zeros: " << A.n_nonzero() << std::endl;
+
+    Rcpp::Rcout << "column 0:" << std::endl;
+    for( auto e : A.col(0) ) {
+      Rcpp::Rcout << "  (" << e.row << ", 0) " << e.value << std::endl;
+    }
+
+    arma::vec x = arma::randu(A.n_cols());
+    arma::vec z = arma::randu(A.n_rows());
+    Rcpp::Rcout << "max |A x - spmv|:   " << arma::abs(spA * x - A.spmv(x)).max() << std::endl;
+    Rcpp::Rcout << "max |A' z - spmv_t|: " << arma::abs(spA.t() * z - A.spmv_t(z)).max() << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,479 @@
+// SER_04: Parallel MatrixMarket reader/writer for arma::sp_mat
+// ----------------------------------------------------------------------------
+// Sparse data often arrives as MatrixMarket text (.mtx). Instead of a single
+// threaded conversion step in R, read_mtx() parses the file natively and
+// returns the same arma::sp_mat the cereal overloads of
+// SER_04_Serialize_Arma_with_Binary_2.cpp serialize:
+//
+// 1. the file is read into memory with one call
+// 2. the body is split into one chunk per thread at line boundaries
+// 3. every thread parses its chunk with std::from_chars into COO triplets
+// 4. COO -> CSC in parallel: count per column, prefix sum, scatter, then sort
+//    (and sum duplicates) within each column
+// 5. the sp_mat is built from the CSC arrays in one pass
+//
+// write_mtx() formats the columns in parallel into per thread buffers with
+// std::to_chars (shortest round trip representation) and writes them in order.
+//
+// Supported: "matrix coordinate" with real, integer or pattern values and
+// general, symmetric or skew-symmetric storage.
+//
+// NOTE:
+// Threads come from OpenMP, without it the same code runs sequentially.
+// std::from_chars/std::to_chars for double need a recent standard library
+// (e.g. GCC >= 11), otherwise strtod/snprintf are used.
+// ----------------------------------------------------------------------------
+// [[Rcpp::plugins("cpp17")]]
+// [[Rcpp::plugins(openmp)]]
+// [[Rcpp::depends(RcppArmadillo)]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <cereal/archives/binary.hpp>
+#include <cereal/access.hpp>
+#include <RcppArmadillo.h>
+
+
+namespace arma {
+
+  template<class Archive, class eT>
+  typename std::enable_if<cereal::traits::is_output_serializable<cereal::BinaryData<eT>, Archive>::value, void>::type
+    save(Archive & ar, const arma::SpMat<eT> &t) {
+      t.sync();  // make sure the CSC arrays are up to date
+      arma::uword n_rows = t.n_rows;
+      arma::uword n_cols = t.n_cols;
+      arma::uword n_nonzero = t.n_nonzero;
+      ar(n_rows, n_cols, n_nonzero);
+
+      ar( cereal::binary_data(
+            const_cast<arma::uword*>( t.col_ptrs ),
+            static_cast<std::size_t>( (n_cols + 1) * sizeof(arma::uword) ) ) );
+      ar( cereal::binary_data(
+            const_cast<arma::uword*>( t.row_indices ),
+            static_cast<std::size_t>( n_nonzero * sizeof(arma::uword) ) ) );
+      ar( cereal::binary_data(
+            const_cast<eT*>( t.values ),
+            static_cast<std::size_t>( n_nonzero * sizeof(eT) ) ) );
+  }
+
+  template<class Archive, class eT>
+  typename std::enable_if<cereal::traits::is_input_serializable<cereal::BinaryData<eT>, Archive>::value, void>::type
+    load(Archive & ar, arma::SpMat<eT> &t) {
+      arma::uword n_rows{}, n_cols{}, n_nonzero{};
+      ar(n_rows, n_cols, n_nonzero);
+
+      arma::uvec col_ptrs(n_cols + 1);
+      arma::uvec row_indices(n_nonzero);
+      arma::Col<eT> values(n_nonzero);
+
+      ar( cereal::binary_data(
+            col_ptrs.memptr(),
+            static_cast<std::size_t>( (n_cols + 1) * sizeof(arma::uword) ) ) );
+      ar( cereal::binary_data(
+            row_indices.memptr(),
+            static_cast<std::size_t>( n_nonzero * sizeof(arma::uword) ) ) );
+      ar( cereal::binary_data(
+            values.memptr(),
+            static_cast<std::size_t>( n_nonzero * sizeof(eT) ) ) );
+
+      t = arma::SpMat<eT>(row_indices, col_ptrs, values, n_rows, n_cols);
+  }
+
+
+  namespace mtx_detail {
+
+    inline int n_threads() {
+#ifdef _OPENMP
+      return omp_get_max_threads();
+#else
+      return 1;
+#endif
+    }
+
+    inline const char* skip_blanks( const char* p, const char* end ) {
+      while( p < end && (*p == ' ' || *p == '\t' || *p == '\r') ) {
+        ++p;
+      }
+      return p;
+    }
+
+    inline const char* next_line( const char* p, const char* end ) {
+      while( p < end && *p != '\n' ) {
+        ++p;
+      }
+      return p < end ? p + 1 : end;
+    }
+
+    inline const char* parse_uword( const char* p, const char* end, uword& v ) {
+      p = skip_blanks( p, end );
+      auto res = std::from_chars( p, end, v );
+      if( res.ec != std::errc() ) {
+        throw std::runtime_error( "read_mtx: malformed index" );
+      }
+      return res.ptr;
+    }
+
+    inline const char* parse_double( const char* p, const char* end, double& v ) {
+      p = skip_blanks( p, end );
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+      auto res = std::from_chars( p, end, v );
+      if( res.ec != std::errc() ) {
+        throw std::runtime_error( "read_mtx: malformed value" );
+      }
+      return res.ptr;
+#else
+      // the file buffer is a std::string, hence terminated
+      char* stop = nullptr;
+      v = std::strtod( p, &stop );
+      if( stop == p ) {
+        throw std::runtime_error( "read_mtx: malformed value" );
+      }
+      return stop;
+#endif
+    }
+
+    inline char* format_double( char* p, char* end, double v ) {
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+      return std::to_chars( p, end, v ).ptr;
+#else
+      return p + std::snprintf( p, static_cast<std::size_t>( end - p ), "%.17g", v );
+#endif
+    }
+
+    struct Coo
+    {
+      std::vector<uword> rows, cols;
+      std::vector<double> vals;
+      uword entries = 0;   // lines of the file, before symmetric expansion
+    };
+  }
+
+
+  inline SpMat<double> read_mtx( const std::string& path )
+  {
+    using namespace mtx_detail;
+
+    std::ifstream is( path, std::ios::binary | std::ios::ate );
+    if( !is ) {
+      throw std::runtime_error( "read_mtx: cannot open " + path );
+    }
+    std::string buf( static_cast<std::size_t>( is.tellg() ), '\0' );
+    is.seekg( 0 );
+    is.read( &buf[0], static_cast<std::streamsize>( buf.size() ) );
+    if( !is ) {
+      throw std::runtime_error( "read_mtx: cannot read " + path );
+    }
+
+    const char* p = buf.data();
+    const char* end = buf.data() + buf.size();
+
+    // banner
+    const char* eol = next_line( p, end );
+    std::istringstream banner( std::string( p, eol ) );
+    std::string tag, object, format, field, symmetry;
+    banner >> tag >> object >> format >> field >> symmetry;
+    for( auto* s : { &object, &format, &field, &symmetry } ) {
+      std::transform( s->begin(), s->end(), s->begin(), ::tolower );
+    }
+    if( tag != "%%MatrixMarket" || object != "matrix" || format != "coordinate" ) {
+      throw std::runtime_error( "read_mtx: only 'matrix coordinate' files are supported" );
+    }
+    const bool pattern = field == "pattern";
+    if( !pattern && field != "real" && field != "integer" && field != "double" ) {
+      throw std::runtime_error( "read_mtx: unsupported field " + field );
+    }
+    const bool symmetric = symmetry == "symmetric";
+    const bool skew = symmetry == "skew-symmetric";
+    if( !symmetric && !skew && symmetry != "general" ) {
+      throw std::runtime_error( "read_mtx: unsupported symmetry " + symmetry );
+    }
+    p = eol;
+
+    // comments, then the size line
+    while( p < end && (*p == '%' || *p == '\n' || *p == '\r') ) {
+      p = next_line( p, end );
+    }
+    uword n_rows{}, n_cols{}, n_entries{};
+    p = parse_uword( p, end, n_rows );
+    p = parse_uword( p, end, n_cols );
+    p = parse_uword( p, end, n_entries );
+    p = next_line( p, end );
+
+    // split the body at line boundaries
+    const int n_chunks = std::max( 1, n_threads() );
+    std::vector<const char*> bounds( n_chunks + 1, end );
+    bounds[0] = p;
+    for( int t = 1; t < n_chunks; ++t ) {
+      const char* guess = p + (end - p) * t / n_chunks;
+      bounds[t] = std::max( bounds[t - 1], next_line( guess - 1, end ) );
+    }
+
+    // parse the chunks into COO triplets
+    std::vector<Coo> coo( n_chunks );
+    std::vector<std::string> errors( n_chunks );
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static, 1)
+#endif
+    for( int t = 0; t < n_chunks; ++t ) {
+      try {
+        Coo& out = coo[t];
+        const char* q = bounds[t];
+        const char* stop = bounds[t + 1];
+        const std::size_t expect = n_entries * (symmetric || skew ? 2 : 1) / n_chunks + 16;
+        out.rows.reserve( expect );
+        out.cols.reserve( expect );
+        out.vals.reserve( expect );
+
+        while( q < stop ) {
+          q = skip_blanks( q, stop );
+          if( q == stop || *q == '\n' || *q == '%' ) {
+            q = next_line( q, stop );
+            continue;
+          }
+          uword r{}, c{};
+          double v = 1.0;
+          q = parse_uword( q, stop, r );
+          q = parse_uword( q, stop, c );
+          if( !pattern ) {
+            q = parse_double( q, stop, v );
+          }
+          q = next_line( q, stop );
+
+          if( r == 0 || c == 0 || r > n_rows || c > n_cols ) {
+            throw std::runtime_error( "read_mtx: index out of bounds" );
+          }
+          ++out.entries;
+          out.rows.push_back( r - 1 );
+          out.cols.push_back( c - 1 );
+          out.vals.push_back( v );
+          if( (symmetric || skew) && r != c ) {
+            out.rows.push_back( c - 1 );
+            out.cols.push_back( r - 1 );
+            out.vals.push_back( skew ? -v : v );
+          }
+        }
+      } catch( const std::exception& e ) {
+        errors[t] = e.what();
+      }
+    }
+    for( const auto& e : errors ) {
+      if( !e.empty() ) {
+        throw std::runtime_error( e );
+      }
+    }
+    uword n_read = 0;
+    for( const auto& c : coo ) {
+      n_read += c.entries;
+    }
+    if( n_read != n_entries ) {
+      throw std::runtime_error( "read_mtx: " + std::to_string( n_read ) + " entries, the header announces " +
+                                std::to_string( n_entries ) );
+    }
+
+    // COO -> CSC: count per column
+    uvec col_ptrs( n_cols + 1, fill::zeros );
+    uword* counts = col_ptrs.memptr() + 1;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static, 1)
+#endif
+    for( int t = 0; t < n_chunks; ++t ) {
+      for( uword c : coo[t].cols ) {
+#ifdef _OPENMP
+        #pragma omp atomic
+#endif
+        ++counts[c];
+      }
+    }
+    for( uword c = 0; c < n_cols; ++c ) {
+      col_ptrs[c + 1] += col_ptrs[c];
+    }
+    const uword n_coo = col_ptrs[n_cols];
+
+    // scatter
+    uvec next = col_ptrs.head( n_cols );
+    uword* pnext = next.memptr();
+    uvec row_indices( n_coo );
+    vec values( n_coo );
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static, 1)
+#endif
+    for( int t = 0; t < n_chunks; ++t ) {
+      const Coo& in = coo[t];
+      for( std::size_t k = 0; k < in.cols.size(); ++k ) {
+        uword pos;
+#ifdef _OPENMP
+        #pragma omp atomic capture
+#endif
+        pos = pnext[ in.cols[k] ]++;
+        row_indices[pos] = in.rows[k];
+        values[pos] = in.vals[k];
+      }
+    }
+    coo.clear();
+
+    // sort each column by row and sum duplicates
+    uvec n_unique( n_cols );
+#ifdef _OPENMP
+    #pragma omp parallel
+#endif
+    {
+      std::vector<std::pair<uword, double>> entries;  // reused per thread
+#ifdef _OPENMP
+      #pragma omp for schedule(dynamic, 1024)
+#endif
+      for( long long cc = 0; cc < static_cast<long long>( n_cols ); ++cc ) {
+        const uword c = static_cast<uword>( cc );
+        const uword b = col_ptrs[c];
+        const uword e = col_ptrs[c + 1];
+        entries.resize( e - b );
+        for( uword k = b; k < e; ++k ) {
+          entries[k - b] = { row_indices[k], values[k] };
+        }
+        std::sort( entries.begin(), entries.end(),
+                   []( const auto& x, const auto& y ) { return x.first < y.first; } );
+
+        uword w = b;
+        for( std::size_t k = 0; k < entries.size(); ++k ) {
+          if( w > b && row_indices[w - 1] == entries[k].first ) {
+            values[w - 1] += entries[k].second;
+          } else {
+            row_indices[w] = entries[k].first;
+            values[w] = entries[k].second;
+            ++w;
+          }
+        }
+        n_unique[c] = w - b;
+      }
+    }
+
+    // compact when duplicates were merged
+    if( accu( n_unique ) != n_coo ) {
+      uvec new_ptrs( n_cols + 1 );
+      new_ptrs[0] = 0;
+      for( uword c = 0; c < n_cols; ++c ) {
+        new_ptrs[c + 1] = new_ptrs[c] + n_unique[c];
+      }
+      uvec new_rows( new_ptrs[n_cols] );
+      vec new_vals( new_ptrs[n_cols] );
+#ifdef _OPENMP
+      #pragma omp parallel for schedule(dynamic, 1024)
+#endif
+      for( long long cc = 0; cc < static_cast<long long>( n_cols ); ++cc ) {
+        const uword c = static_cast<uword>( cc );
+        std::copy_n( row_indices.memptr() + col_ptrs[c], n_unique[c], new_rows.memptr() + new_ptrs[c] );
+        std::copy_n( values.memptr() + col_ptrs[c], n_unique[c], new_vals.memptr() + new_ptrs[c] );
+      }
+      col_ptrs = std::move( new_ptrs );
+      row_indices = std::move( new_rows );
+      values = std::move( new_vals );
+    }
+
+    return SpMat<double>( row_indices, col_ptrs, values, n_rows, n_cols );
+  }
+
+
+  inline void write_mtx( const std::string& path, const SpMat<double>& t )
+  {
+    using namespace mtx_detail;
+
+    t.sync();
+    const int n_chunks = std::max( 1, n_threads() );
+
+    // column ranges with roughly the same number of non-zeros
+    std::vector<uword> first_col( n_chunks + 1, t.n_cols );
+    first_col[0] = 0;
+    for( int k = 1; k < n_chunks; ++k ) {
+      const uword target = t.n_nonzero * k / n_chunks;
+      first_col[k] = static_cast<uword>(
+        std::upper_bound( t.col_ptrs, t.col_ptrs + t.n_cols + 1, target ) - t.col_ptrs ) - 1;
+      first_col[k] = std::max( first_col[k], first_col[k - 1] );
+    }
+
+    std::vector<std::string> out( n_chunks );
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static, 1)
+#endif
+    for( int k = 0; k < n_chunks; ++k ) {
+      // "row col value\n": two indices of at most 20 digits, a double of at
+      // most 24 characters and the separators
+      const uword b = t.col_ptrs[ first_col[k] ];
+      const uword e = t.col_ptrs[ first_col[k + 1] ];
+      std::string& s = out[k];
+      s.resize( (e - b) * 68 );
+      char* p = &s[0];
+      char* stop = p + s.size();
+
+      for( uword c = first_col[k]; c < first_col[k + 1]; ++c ) {
+        for( uword i = t.col_ptrs[c]; i < t.col_ptrs[c + 1]; ++i ) {
+          p = std::to_chars( p, stop, t.row_indices[i] + 1 ).ptr;
+          *p++ = ' ';
+          p = std::to_chars( p, stop, c + 1 ).ptr;
+          *p++ = ' ';
+          p = format_double( p, stop, t.values[i] );
+          *p++ = '\n';
+        }
+      }
+      s.resize( static_cast<std::size_t>( p - s.data() ) );
+    }
+
+    std::ofstream os( path, std::ios::binary );
+    os << "%%MatrixMarket matrix coordinate real general\n"
+       << t.n_rows << ' ' << t.n_cols << ' ' << t.n_nonzero << '\n';
+    for( const auto& s : out ) {
+      os.write( s.data(), static_cast<std::streamsize>( s.size() ) );
+    }
+    if( !os ) {
+      throw std::runtime_error( "write_mtx: writing " + path + " failed" );
+    }
+  }
+}
+
+
+// Converts a MatrixMarket file into a cereal archive of an sp_mat.
+// [[Rcpp::export]]
+void mtx_to_archive(std::string mtx_path, std::string archive_path) {
+  arma::sp_mat A = arma::read_mtx(mtx_path);
+  std::ofstream os(archive_path, std::ios::binary);
+  cereal::BinaryOutputArchive oarchive(os);
+  oarchive(A);
+}
+
+
+// [[Rcpp::export]]
+int main() {
+
+  arma::sp_mat spA = arma::sprandn<arma::sp_mat>(2000, 1000, 0.01);
+
+  // sp_mat -> .mtx -> sp_mat
+  arma::write_mtx("Backend/sparseArma.mtx", spA);
+  arma::sp_mat spB = arma::read_mtx("Backend/sparseArma.mtx");
+  Rcpp::Rcout << "non-zeros: " << spB.n_nonzero
+              << ", max abs diff: " << arma::abs(spA - spB).max() << std::endl;
+
+  // .mtx -> cereal archive -> sp_mat
+  mtx_to_archive("Backend/sparseArma.mtx", "Backend/Serialize_sparseArma_mtx.bin");
+  arma::sp_mat spC;
+  {
+    std::ifstream is("Backend/Serialize_sparseArma_mtx.bin", std::ios::binary);
+    cereal::BinaryInputArchive iarchive(is);
+    iarchive(spC);
+  }
+  Rcpp::Rcout << "archive round trip equal: " << (arma::abs(spA - spC).max() == 0.0) << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,191 @@
+// SER_04: Loading a column range of a serialized arma::Mat
+// ----------------------------------------------------------------------------
+// The load overload in SER_04_Serialize_Arma_with_Binary_1.cpp always reads
+// the whole n_rows * n_cols payload. Armadillo stores matrices column major,
+// hence every column is a contiguous run of n_rows elements in the archive:
+//
+//   n_rows (uword) | n_cols (uword) | col 0 | col 1 | ... | col n_cols-1
+//
+// Knowing the position of the header in the file, any column can be read by
+// seeking to  header + 2 * sizeof(uword) + j * n_rows * sizeof(eT).
+//
+// MatColumnReader parses the header at the current position of a seekable
+// stream and loads
+// - a span of columns [first, last] with a single read
+// - an arbitrary set of columns, where runs of consecutive indices are merged
+//   into one read each
+// The stream can be positioned by a preceding cereal::BinaryInputArchive, so
+// the matrix does not need to be the first object in the file. skip() moves
+// the stream behind the matrix to continue with the archive.
+//
+// NOTE:
+// Only valid for archives without any transformation of the payload, i.e.,
+// cereal::BinaryOutputArchive (not the portable archive on a foreign
+// endianness, not compressed streams).
+// ----------------------------------------------------------------------------
+// [[Rcpp::depends(RcppArmadillo)]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <cereal/archives/binary.hpp>
+#include <cereal/access.hpp>
+
+#include <RcppArmadillo.h>
+
+
+namespace arma {
+
+  template<class Archive, class eT>
+  typename std::enable_if<cereal::traits::is_output_serializable<cereal::BinaryData<eT>, Archive>::value, void>::type
+    save( Archive & ar, const arma::Mat<eT>& m ) {
+      arma::uword n_rows = m.n_rows;
+      arma::uword n_cols = m.n_cols;
+      ar( n_rows );
+      ar( n_cols );
+      ar( cereal::binary_data(
+          reinterpret_cast< void * const >( const_cast< eT* >( m.memptr() ) ),
+          static_cast< std::size_t >( n_rows * n_cols * sizeof( eT ) ) ) );
+    }
+
+  template<class Archive, class eT>
+  typename std::enable_if<cereal::traits::is_input_serializable<cereal::BinaryData<eT>, Archive>::value, void>::type
+    load( Archive & ar, arma::Mat<eT>& m ) {
+      arma::uword n_rows;
+      arma::uword n_cols;
+      ar( n_rows );
+      ar( n_cols );
+
+      m.resize( n_rows, n_cols );
+
+      ar( cereal::binary_data(
+          reinterpret_cast< void * const >( const_cast< eT* >( m.memptr() ) ),
+          static_cast< std::size_t >( n_rows * n_cols * sizeof( eT ) ) ) );
+    }
+
+
+  // Random access to the columns of a matrix stored by the save overload above.
+  template<class eT>
+  class MatColumnReader
+  {
+  public:
+    // Reads the header at the current position of is.
+    explicit MatColumnReader( std::istream& is ) : is( is )
+    {
+      header = is.tellg();
+      is.read( reinterpret_cast<char*>( &rows ), sizeof(uword) );
+      is.read( reinterpret_cast<char*>( &cols ), sizeof(uword) );
+      if( !is || header < 0 ) {
+        throw std::runtime_error( "MatColumnReader: cannot read matrix header" );
+      }
+    }
+
+    uword n_rows() const { return rows; }
+    uword n_cols() const { return cols; }
+
+    // Columns first, ..., last (inclusive).
+    Mat<eT> load_cols( uword first, uword last )
+    {
+      if( first > last || last >= cols ) {
+        throw std::out_of_range( "MatColumnReader: column span out of bounds" );
+      }
+      Mat<eT> out( rows, last - first + 1 );
+      read_run( first, out.n_cols, out.memptr() );
+      return out;
+    }
+
+    // Columns in the given order, duplicates allowed.
+    Mat<eT> load_cols( const uvec& indices )
+    {
+      Mat<eT> out( rows, indices.n_elem );
+
+      uword k = 0;
+      while( k < indices.n_elem ) {
+        // merge consecutive indices into one read
+        uword len = 1;
+        while( k + len < indices.n_elem && indices[k + len] == indices[k] + len ) {
+          ++len;
+        }
+        if( indices[k] + len > cols ) {
+          throw std::out_of_range( "MatColumnReader: column index out of bounds" );
+        }
+        read_run( indices[k], len, out.colptr( k ) );
+        k += len;
+      }
+      return out;
+    }
+
+    // Positions the stream behind the matrix payload.
+    void skip()
+    {
+      is.seekg( col_offset( cols ) );
+    }
+
+  private:
+    std::streamoff col_offset( uword j ) const
+    {
+      return static_cast<std::streamoff>( header )
+        + static_cast<std::streamoff>( 2 * sizeof(uword) )
+        + static_cast<std::streamoff>( j ) * static_cast<std::streamoff>( rows * sizeof(eT) );
+    }
+
+    void read_run( uword first, uword len, eT* dst )
+    {
+      is.seekg( col_offset( first ) );
+      is.read( reinterpret_cast<char*>( dst ), static_cast<std::streamsize>( len * rows * sizeof(eT) ) );
+      if( !is ) {
+        throw std::runtime_error( "MatColumnReader: truncated matrix payload" );
+      }
+    }
+
+    std::istream& is;
+    std::streampos header;
+    uword rows = 0;
+    uword cols = 0;
+  };
+}
+
+
+
+// [[Rcpp::export]]
+int main() {
+
+  { // Serialize
+    arma::vec avec1 = arma::randn(5);
+    arma::mat amat1 = arma::randn(6, 1000);
+    amat1.row(0) = arma::regspace<arma::rowvec>(0, 999);  // column ids
+
+    std::ofstream os("Backend/Serialize_Arma_partial.bin", std::ios::binary);
+    cereal::BinaryOutputArchive oarchive(os);
+    oarchive(avec1, amat1, avec1);
+  }
+
+  // .... put put put ...
+
+  { // Deserialize selected columns only
+    std::ifstream is("Backend/Serialize_Arma_partial.bin", std::ios::binary);
+    cereal::BinaryInputArchive iarchive(is);
+
+    // objects in front of the matrix are read as usual
+    arma::vec bvec1;
+    iarchive(bvec1);
+
+    arma::MatColumnReader<double> reader(is);
+    Rcpp::Rcout << "stored matrix: " << reader.n_rows() << " x " << reader.n_cols() << std::endl;
+
+    arma::mat span = reader.load_cols(10, 12);
+    span.print("columns 10..12:");
+
+    arma::uvec selected = {997, 3, 4, 5, 500};
+    arma::mat subset = reader.load_cols(selected);
+    subset.print("columns 997, 3, 4, 5, 500:");
+
+    // continue with the archive behind the matrix
+    reader.skip();
+    arma::vec bvec2;
+    iarchive(bvec2);
+    Rcpp::Rcout << "trailing vector equal: " << arma::approx_equal(bvec1, bvec2, "absdiff", 0.0) << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,348 @@
+// SER_04: Compact sparse matrix archives with delta + bit-packed indices
+// ----------------------------------------------------------------------------
+// SER_04_Serialize_Arma_with_Binary_portable_2.cpp stores every row and column
+// index as a full arma::uword, for double values the indices outweigh the
+// values by 2:1.
+//
+// The packed encoding stores a sparse matrix as
+// - column pointers: run length encoded non-zero counts per column,
+//   (count, run) pairs, since many columns share the same count
+// - row indices: within each column the rows are sorted, hence only the gaps
+//   d = row - previous_row - 1 are stored (the first row of a column is
+//   relative to -1). The gaps are small, they are bit-packed in blocks of 128
+//   values with one bit width per block (the widest gap in the block).
+// - values: one binary_data block, as before
+//
+// Block layout (the SIMD-BP128 "vertical" layout): the 128 values of a block
+// are distributed over 4 lanes (value i goes to lane i % 4) and every lane is
+// a bit stream of 32 values with b bits each. A block therefore consists of
+// b rows of 4 uint32 words, and 4 values are unpacked with a handful of SSE2
+// shift/and/or instructions at once. Non x86 builds use the scalar decoder on
+// the same layout.
+//
+// Layout:
+//   n_rows | n_cols | n_nonzero | n_runs | runs (2 x n_runs, uint64)
+//   | bit widths (uint8 per block) | packed words (uint32) | values
+//
+// All fields are fixed width and typed, so the portable archives convert the
+// byte order correctly.
+//
+// NOTE:
+// Row gaps are stored as uint32, i.e., n_rows must be below 2^32.
+// ----------------------------------------------------------------------------
+// [[Rcpp::depends(RcppArmadillo)]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <cereal/archives/binary.hpp>
+#include <cereal/archives/portable_binary.hpp>
+#include <cereal/access.hpp>
+#include <RcppArmadillo.h>
+
+
+namespace arma {
+
+  namespace packed_detail {
+
+    constexpr std::size_t block_len = 128;
+
+    inline std::uint32_t bit_width( std::uint32_t v ) {
+      std::uint32_t b = 0;
+      while( v != 0 ) {
+        ++b;
+        v >>= 1;
+      }
+      return b;
+    }
+
+    inline std::uint32_t low_mask( std::uint32_t b ) {
+      return b >= 32 ? 0xFFFFFFFFu : ((1u << b) - 1u);
+    }
+
+    // Packs 128 values with b bits each into b x 4 words.
+    inline void pack_block( const std::uint32_t* in, std::uint32_t b, std::uint32_t* out ) {
+      if( b == 0 ) {
+        return;   // all zero, no words
+      }
+      for( std::uint32_t w = 0; w < 4 * b; ++w ) {
+        out[w] = 0;
+      }
+      for( std::uint32_t j = 0; j < 32; ++j ) {
+        const std::uint32_t pos = j * b;
+        const std::uint32_t w = pos / 32;
+        const std::uint32_t off = pos % 32;
+        for( std::uint32_t lane = 0; lane < 4; ++lane ) {
+          const std::uint32_t v = in[4 * j + lane];
+          out[4 * w + lane] |= v << off;
+          if( off + b > 32 ) {
+            out[4 * (w + 1) + lane] |= v >> (32 - off);
+          }
+        }
+      }
+    }
+
+    // Unpacks 128 values with b bits each from b x 4 words.
+    inline void unpack_block( const std::uint32_t* in, std::uint32_t b, std::uint32_t* out ) {
+      if( b == 0 ) {
+        for( std::size_t i = 0; i < block_len; ++i ) {
+          out[i] = 0;
+        }
+        return;
+      }
+#if defined(__SSE2__)
+      const __m128i* rows = reinterpret_cast<const __m128i*>( in );
+      const __m128i mask = _mm_set1_epi32( static_cast<int>( low_mask( b ) ) );
+      for( std::uint32_t j = 0; j < 32; ++j ) {
+        const std::uint32_t pos = j * b;
+        const std::uint32_t w = pos / 32;
+        const std::uint32_t off = pos % 32;
+        __m128i x = _mm_srl_epi32( _mm_loadu_si128( rows + w ), _mm_cvtsi32_si128( static_cast<int>( off ) ) );
+        if( off + b > 32 ) {
+          __m128i hi = _mm_sll_epi32( _mm_loadu_si128( rows + w + 1 ), _mm_cvtsi32_si128( static_cast<int>( 32 - off ) ) );
+          x = _mm_or_si128( x, hi );
+        }
+        _mm_storeu_si128( reinterpret_cast<__m128i*>( out + 4 * j ), _mm_and_si128( x, mask ) );
+      }
+#else
+      const std::uint32_t mask = low_mask( b );
+      for( std::uint32_t j = 0; j < 32; ++j ) {
+        const std::uint32_t pos = j * b;
+        const std::uint32_t w = pos / 32;
+        const std::uint32_t off = pos % 32;
+        for( std::uint32_t lane = 0; lane < 4; ++lane ) {
+          std::uint32_t x = in[4 * w + lane] >> off;
+          if( off + b > 32 ) {
+            x |= in[4 * (w + 1) + lane] << (32 - off);
+          }
+          out[4 * j + lane] = x & mask;
+        }
+      }
+#endif
+    }
+  }
+
+
+  // Wrapper to store a sparse matrix in the packed encoding.
+  template<class eT>
+  struct PackedSpMat
+  {
+    const SpMat<eT>& t;
+
+    template<class Archive>
+    void save( Archive& ar ) const
+    {
+      using namespace packed_detail;
+
+      if( t.n_rows > 0xFFFFFFFFull ) {
+        throw std::runtime_error( "PackedSpMat: n_rows exceeds the 32 bit gap encoding" );
+      }
+      t.sync();
+
+      std::uint64_t n_rows = t.n_rows;
+      std::uint64_t n_cols = t.n_cols;
+      std::uint64_t n_nonzero = t.n_nonzero;
+      ar( n_rows, n_cols, n_nonzero );
+
+      // run length encoded non-zero counts per column
+      std::vector<std::uint64_t> runs;
+      for( uword c = 0; c < t.n_cols; ++c ) {
+        const std::uint64_t count = t.col_ptrs[c + 1] - t.col_ptrs[c];
+        if( !runs.empty() && runs[runs.size() - 2] == count ) {
+          ++runs.back();
+        } else {
+          runs.push_back( count );
+          runs.push_back( 1 );
+        }
+      }
+      std::uint64_t n_runs = runs.size() / 2;
+      ar( n_runs );
+      ar( cereal::binary_data( runs.data(), runs.size() * sizeof(std::uint64_t) ) );
+
+      // row gaps within each column, padded to whole blocks
+      const std::size_t n_blocks = (t.n_nonzero + block_len - 1) / block_len;
+      std::vector<std::uint32_t> gaps( n_blocks * block_len, 0 );
+      for( uword c = 0; c < t.n_cols; ++c ) {
+        std::uint64_t prev = 0;  // row of the previous entry + 1
+        for( uword k = t.col_ptrs[c]; k < t.col_ptrs[c + 1]; ++k ) {
+          gaps[k] = static_cast<std::uint32_t>( t.row_indices[k] - prev );
+          prev = t.row_indices[k] + 1;
+        }
+      }
+
+      std::vector<std::uint8_t> widths( n_blocks );
+      std::vector<std::uint32_t> words;
+      for( std::size_t blk = 0; blk < n_blocks; ++blk ) {
+        const std::uint32_t* in = gaps.data() + blk * block_len;
+        std::uint32_t acc = 0;
+        for( std::size_t i = 0; i < block_len; ++i ) {
+          acc |= in[i];
+        }
+        const std::uint32_t b = bit_width( acc );
+        widths[blk] = static_cast<std::uint8_t>( b );
+
+        const std::size_t at = words.size();
+        words.resize( at + 4 * b );
+        pack_block( in, b, words.data() + at );
+      }
+
+      std::uint64_t n_words = words.size();
+      ar( n_words );
+      ar( cereal::binary_data( widths.data(), widths.size() ) );
+      ar( cereal::binary_data( words.data(), words.size() * sizeof(std::uint32_t) ) );
+
+      ar( cereal::binary_data(
+            const_cast<eT*>( t.values ),
+            static_cast<std::size_t>( t.n_nonzero * sizeof(eT) ) ) );
+    }
+  };
+
+  template<class eT> inline
+  PackedSpMat<eT> make_packed( const SpMat<eT>& t )
+  {
+    return {t};
+  }
+
+
+  // Reads a sparse matrix written by PackedSpMat.
+  template<class eT>
+  struct PackedSpMatReader
+  {
+    SpMat<eT>& t;
+
+    template<class Archive>
+    void load( Archive& ar )
+    {
+      using namespace packed_detail;
+
+      std::uint64_t n_rows{}, n_cols{}, n_nonzero{}, n_runs{}, n_words{};
+      ar( n_rows, n_cols, n_nonzero );
+
+      ar( n_runs );
+      if( n_runs > n_cols ) {   // every run covers at least one column
+        throw std::runtime_error( "PackedSpMatReader: corrupt column runs" );
+      }
+      std::vector<std::uint64_t> runs( 2 * n_runs );
+      ar( cereal::binary_data( runs.data(), runs.size() * sizeof(std::uint64_t) ) );
+
+      uvec col_ptrs( n_cols + 1 );
+      col_ptrs[0] = 0;
+      uword c = 0;
+      for( std::size_t r = 0; r < n_runs; ++r ) {
+        for( std::uint64_t k = 0; k < runs[2 * r + 1]; ++k, ++c ) {
+          if( c >= n_cols || runs[2 * r] > n_nonzero - col_ptrs[c] ) {
+            throw std::runtime_error( "PackedSpMatReader: corrupt column runs" );
+          }
+          col_ptrs[c + 1] = col_ptrs[c] + runs[2 * r];
+        }
+      }
+      if( c != n_cols || col_ptrs[n_cols] != n_nonzero ) {
+        throw std::runtime_error( "PackedSpMatReader: corrupt column runs" );
+      }
+
+      const std::size_t n_blocks = (n_nonzero + block_len - 1) / block_len;
+      ar( n_words );
+      if( n_words > n_blocks * 4 * 32 ) {   // at most 32 bit per gap
+        throw std::runtime_error( "PackedSpMatReader: corrupt index block" );
+      }
+      std::vector<std::uint8_t> widths( n_blocks );
+      std::vector<std::uint32_t> words( n_words );
+      ar( cereal::binary_data( widths.data(), widths.size() ) );
+      ar( cereal::binary_data( words.data(), words.size() * sizeof(std::uint32_t) ) );
+
+      // unpack the gaps block wise
+      std::vector<std::uint32_t> gaps( n_blocks * block_len );
+      std::size_t at = 0;
+      for( std::size_t blk = 0; blk < n_blocks; ++blk ) {
+        const std::uint32_t b = widths[blk];
+        if( b > 32 || at + 4 * b > words.size() ) {
+          throw std::runtime_error( "PackedSpMatReader: corrupt index block" );
+        }
+        unpack_block( words.data() + at, b, gaps.data() + blk * block_len );
+        at += 4 * b;
+      }
+
+      // prefix sum within each column
+      uvec row_indices( n_nonzero );
+      for( uword cc = 0; cc < n_cols; ++cc ) {
+        uword row = 0;
+        for( uword k = col_ptrs[cc]; k < col_ptrs[cc + 1]; ++k ) {
+          if( gaps[k] >= n_rows - row ) {   // row <= n_rows here
+            throw std::runtime_error( "PackedSpMatReader: row index out of bounds" );
+          }
+          row += gaps[k];
+          row_indices[k] = row;
+          ++row;
+        }
+      }
+
+      Col<eT> values( n_nonzero );
+      ar( cereal::binary_data(
+            values.memptr(),
+            static_cast<std::size_t>( n_nonzero * sizeof(eT) ) ) );
+
+      t = SpMat<eT>( row_indices, col_ptrs, values, n_rows, n_cols );
+    }
+  };
+
+  template<class eT> inline
+  PackedSpMatReader<eT> make_packed_reader( SpMat<eT>& t )
+  {
+    return {t};
+  }
+}
+
+
+
+// [[Rcpp::export]]
+int main() {
+
+  arma::sp_mat spA = arma::sprandu<arma::sp_mat>(20000, 2000, 0.01);
+
+  { // Serialize
+    std::ofstream os("Backend/Serialize_sparseArma_packed.bin", std::ios::binary);
+    cereal::PortableBinaryOutputArchive oarchive(os);
+    oarchive(arma::make_packed(spA));
+  }
+
+  // .... put put put ...
+
+  { // Deserialize
+    arma::sp_mat spB;
+
+    std::ifstream is("Backend/Serialize_sparseArma_packed.bin", std::ios::binary | std::ios::ate);
+    const std::streamoff packed_size = is.tellg();
+    is.seekg(0);
+    cereal::PortableBinaryInputArchive iarchive(is);
+    iarchive(arma::make_packed_reader(spB));
+
+    const double triplet_size = 3.0 * sizeof(arma::uword) + spA.n_nonzero * (2.0 * sizeof(arma::uword) + sizeof(double));
+    Rcpp::Rcout << "non-zeros:         " << spA.n_nonzero << std::endl;
+    Rcpp::Rcout << "triplet layout:    " << triplet_size << " bytes" << std::endl;
+    Rcpp::Rcout << "packed layout:     " << packed_size << " bytes" << std::endl;
+    Rcpp::Rcout << "identical:         " << (arma::accu(arma::abs(spA - spB)) == 0.0) << std::endl;
+  }
+
+  { // dense columns: all row gaps are 0, i.e., blocks of width 0
+    arma::sp_mat spD(arma::mat(arma::ones(200, 200)));
+    std::stringstream ss;
+    {
+      cereal::PortableBinaryOutputArchive oarchive(ss);
+      oarchive(arma::make_packed(spD));
+    }
+    arma::sp_mat spE;
+    cereal::PortableBinaryInputArchive iarchive(ss);
+    iarchive(arma::make_packed_reader(spE));
+    Rcpp::Rcout << "dense identical:   " << (arma::accu(arma::abs(spD - spE)) == 0.0) << std::endl;
+  }
+
+  return 0;
+}
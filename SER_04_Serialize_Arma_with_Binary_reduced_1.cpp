@@ -0,0 +1,436 @@
+// SER_04: Reduced precision storage of double matrices
+// ----------------------------------------------------------------------------
+// The save overload in SER_04_Serialize_Arma_with_Binary_1.cpp always writes
+// sizeof(eT) bytes per element. Many archived model matrices don't need full
+// double precision, here we add an opt-in storage policy which narrows the
+// payload to
+// - float32:  4 bytes, ~7 significant digits
+// - bfloat16: 2 bytes, float32 range with ~3 significant digits
+// - float16:  2 bytes (IEEE half), range +-65504 with ~3 significant digits
+// and widens it back to double on load.
+//
+// The policy is recorded in the archive in front of the payload, so loading
+// never depends on knowing how the matrix was written.
+//
+// Layout: n_rows (uword) | n_cols (uword) | precision (uint8) | payload
+//
+// Conversion kernels
+// ------------------
+// The narrowing/widening runs chunk wise through a small buffer, the kernels
+// use the widest instruction set enabled at compile time:
+// - float32:  AVX-512F (8 doubles) or AVX (4 doubles)
+// - float16:  F16C (8 values per step)
+// - bfloat16: AVX2 integer rounding (8 values per step)
+// and a scalar fallback otherwise. All paths round to nearest even.
+// To enable them, compile for the host, e.g. in R:
+//   Sys.setenv(PKG_CXXFLAGS = "-march=native")
+// before sourceCpp().
+//
+// NOTE:
+// float16 and bfloat16 are narrowed via float32, i.e., the value is rounded
+// twice. The result can differ from a direct rounding in the last bit.
+// Values outside of the half range become +-Inf.
+// ----------------------------------------------------------------------------
+// [[Rcpp::depends(RcppArmadillo)]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__AVX__) || defined(__F16C__) || defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#include <cereal/archives/binary.hpp>
+#include <cereal/archives/portable_binary.hpp>
+#include <cereal/access.hpp>
+
+#include <RcppArmadillo.h>
+
+
+namespace arma {
+
+  enum class StoragePrecision : std::uint8_t { float64 = 0, float32 = 1, bfloat16 = 2, float16 = 3 };
+
+  inline std::size_t bytes_per_element( StoragePrecision p ) {
+    switch( p ) {
+      case StoragePrecision::float64:  return 8;
+      case StoragePrecision::float32:  return 4;
+      case StoragePrecision::bfloat16: return 2;
+      case StoragePrecision::float16:  return 2;
+    }
+    throw std::runtime_error( "unknown storage precision" );
+  }
+
+
+  // Scalar conversions
+  // --------------------------------
+  namespace precision_detail {
+
+    inline std::uint32_t bits( float f ) {
+      std::uint32_t u;
+      std::memcpy( &u, &f, sizeof(u) );
+      return u;
+    }
+
+    inline float from_bits( std::uint32_t u ) {
+      float f;
+      std::memcpy( &f, &u, sizeof(f) );
+      return f;
+    }
+
+    inline std::uint16_t float_to_bf16( float f ) {
+      std::uint32_t x = bits( f );
+      if( (x & 0x7FFFFFFFu) > 0x7F800000u ) {
+        // keep NaN a (quiet) NaN
+        return static_cast<std::uint16_t>( (x >> 16) | 0x40u );
+      }
+      return static_cast<std::uint16_t>( (x + 0x7FFFu + ((x >> 16) & 1u)) >> 16 );
+    }
+
+    inline float bf16_to_float( std::uint16_t h ) {
+      return from_bits( static_cast<std::uint32_t>( h ) << 16 );
+    }
+
+    inline std::uint16_t float_to_half( float f ) {
+      std::uint32_t x = bits( f );
+      std::uint32_t sign = (x >> 16) & 0x8000u;
+      std::uint32_t absx = x & 0x7FFFFFFFu;
+
+      if( absx >= 0x7F800000u ) {                 // Inf or NaN
+        return static_cast<std::uint16_t>(
+          sign | 0x7C00u | (absx > 0x7F800000u ? 0x200u | ((absx >> 13) & 0x3FFu) : 0u) );
+      }
+      if( absx >= 0x477FF000u ) {                 // rounds beyond 65504
+        return static_cast<std::uint16_t>( sign | 0x7C00u );
+      }
+      if( absx < 0x38800000u ) {                  // half subnormal or zero
+        if( absx <= 0x33000000u ) {
+          return static_cast<std::uint16_t>( sign );
+        }
+        std::uint32_t e = absx >> 23;
+        std::uint32_t m = (absx & 0x7FFFFFu) | 0x800000u;
+        std::uint32_t shift = 126u - e;
+        std::uint32_t r = m >> shift;
+        std::uint32_t rem = m & ((1u << shift) - 1u);
+        std::uint32_t halfway = 1u << (shift - 1u);
+        if( rem > halfway || (rem == halfway && (r & 1u)) ) {
+          ++r;
+        }
+        return static_cast<std::uint16_t>( sign | r );
+      }
+
+      std::uint32_t h = (absx - 0x38000000u) >> 13;
+      std::uint32_t rem = absx & 0x1FFFu;
+      if( rem > 0x1000u || (rem == 0x1000u && (h & 1u)) ) {
+        ++h;
+      }
+      return static_cast<std::uint16_t>( sign | h );
+    }
+
+    inline float half_to_float( std::uint16_t h ) {
+      std::uint32_t sign = static_cast<std::uint32_t>( h & 0x8000u ) << 16;
+      std::uint32_t e = (h >> 10) & 0x1Fu;
+      std::uint32_t m = h & 0x3FFu;
+
+      if( e == 0 ) {
+        if( m == 0 ) {
+          return from_bits( sign );
+        }
+        // subnormal: normalize the mantissa
+        e = 113;
+        while( !(m & 0x400u) ) {
+          m <<= 1;
+          --e;
+        }
+        return from_bits( sign | (e << 23) | ((m & 0x3FFu) << 13) );
+      }
+      if( e == 31 ) {
+        return from_bits( sign | 0x7F800000u | (m << 13) );
+      }
+      return from_bits( sign | ((e + 112u) << 23) | (m << 13) );
+    }
+  }
+
+
+  // Conversion kernels
+  // --------------------------------
+  inline void narrow_f32( const double* src, float* dst, std::size_t n ) {
+    std::size_t i = 0;
+#if defined(__AVX512F__)
+    for( ; i + 8 <= n; i += 8 ) {
+      _mm256_storeu_ps( dst + i, _mm512_cvtpd_ps( _mm512_loadu_pd( src + i ) ) );
+    }
+#elif defined(__AVX__)
+    for( ; i + 4 <= n; i += 4 ) {
+      _mm_storeu_ps( dst + i, _mm256_cvtpd_ps( _mm256_loadu_pd( src + i ) ) );
+    }
+#endif
+    for( ; i < n; ++i ) {
+      dst[i] = static_cast<float>( src[i] );
+    }
+  }
+
+  inline void widen_f32( const float* src, double* dst, std::size_t n ) {
+    std::size_t i = 0;
+#if defined(__AVX512F__)
+    for( ; i + 8 <= n; i += 8 ) {
+      _mm512_storeu_pd( dst + i, _mm512_cvtps_pd( _mm256_loadu_ps( src + i ) ) );
+    }
+#elif defined(__AVX__)
+    for( ; i + 4 <= n; i += 4 ) {
+      _mm256_storeu_pd( dst + i, _mm256_cvtps_pd( _mm_loadu_ps( src + i ) ) );
+    }
+#endif
+    for( ; i < n; ++i ) {
+      dst[i] = static_cast<double>( src[i] );
+    }
+  }
+
+  inline void narrow_f16( const double* src, std::uint16_t* dst, std::size_t n ) {
+    std::size_t i = 0;
+#if defined(__F16C__) && defined(__AVX__)
+    for( ; i + 8 <= n; i += 8 ) {
+      __m128 lo = _mm256_cvtpd_ps( _mm256_loadu_pd( src + i ) );
+      __m128 hi = _mm256_cvtpd_ps( _mm256_loadu_pd( src + i + 4 ) );
+      __m256 f = _mm256_insertf128_ps( _mm256_castps128_ps256( lo ), hi, 1 );
+      _mm_storeu_si128( reinterpret_cast<__m128i*>( dst + i ),
+                        _mm256_cvtps_ph( f, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC ) );
+    }
+#endif
+    for( ; i < n; ++i ) {
+      dst[i] = precision_detail::float_to_half( static_cast<float>( src[i] ) );
+    }
+  }
+
+  inline void widen_f16( const std::uint16_t* src, double* dst, std::size_t n ) {
+    std::size_t i = 0;
+#if defined(__F16C__) && defined(__AVX__)
+    for( ; i + 8 <= n; i += 8 ) {
+      __m256 f = _mm256_cvtph_ps( _mm_loadu_si128( reinterpret_cast<const __m128i*>( src + i ) ) );
+      _mm256_storeu_pd( dst + i,     _mm256_cvtps_pd( _mm256_castps256_ps128( f ) ) );
+      _mm256_storeu_pd( dst + i + 4, _mm256_cvtps_pd( _mm256_extractf128_ps( f, 1 ) ) );
+    }
+#endif
+    for( ; i < n; ++i ) {
+      dst[i] = static_cast<double>( precision_detail::half_to_float( src[i] ) );
+    }
+  }
+
+  inline void narrow_bf16( const double* src, std::uint16_t* dst, std::size_t n ) {
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i bias = _mm256_set1_epi32( 0x7FFF );
+    const __m256i one = _mm256_set1_epi32( 1 );
+    const __m256i quiet = _mm256_set1_epi32( 0x40 );
+    for( ; i + 8 <= n; i += 8 ) {
+      __m128 lo = _mm256_cvtpd_ps( _mm256_loadu_pd( src + i ) );
+      __m128 hi = _mm256_cvtpd_ps( _mm256_loadu_pd( src + i + 4 ) );
+      __m256 f = _mm256_insertf128_ps( _mm256_castps128_ps256( lo ), hi, 1 );
+      __m256i x = _mm256_castps_si256( f );
+
+      // round to nearest even on the upper 16 bits
+      __m256i lsb = _mm256_and_si256( _mm256_srli_epi32( x, 16 ), one );
+      __m256i r = _mm256_srli_epi32( _mm256_add_epi32( x, _mm256_add_epi32( bias, lsb ) ), 16 );
+      // NaN must not carry into the sign bit
+      __m256i nan = _mm256_castps_si256( _mm256_cmp_ps( f, f, _CMP_UNORD_Q ) );
+      r = _mm256_blendv_epi8( r, _mm256_or_si256( _mm256_srli_epi32( x, 16 ), quiet ), nan );
+
+      // 8 x 32 bit -> 8 x 16 bit, packus works per 128 bit lane
+      __m256i p = _mm256_permute4x64_epi64( _mm256_packus_epi32( r, r ), 0xD8 );
+      _mm_storeu_si128( reinterpret_cast<__m128i*>( dst + i ), _mm256_castsi256_si128( p ) );
+    }
+#endif
+    for( ; i < n; ++i ) {
+      dst[i] = precision_detail::float_to_bf16( static_cast<float>( src[i] ) );
+    }
+  }
+
+  inline void widen_bf16( const std::uint16_t* src, double* dst, std::size_t n ) {
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    for( ; i + 8 <= n; i += 8 ) {
+      __m256i x = _mm256_cvtepu16_epi32( _mm_loadu_si128( reinterpret_cast<const __m128i*>( src + i ) ) );
+      __m256 f = _mm256_castsi256_ps( _mm256_slli_epi32( x, 16 ) );
+      _mm256_storeu_pd( dst + i,     _mm256_cvtps_pd( _mm256_castps256_ps128( f ) ) );
+      _mm256_storeu_pd( dst + i + 4, _mm256_cvtps_pd( _mm256_extractf128_ps( f, 1 ) ) );
+    }
+#endif
+    for( ; i < n; ++i ) {
+      dst[i] = static_cast<double>( precision_detail::bf16_to_float( src[i] ) );
+    }
+  }
+
+
+  // elements converted per binary_data call
+  constexpr std::size_t precision_chunk = 16384;
+
+
+  // Wrapper to store a double matrix with reduced precision.
+  struct ReducedPrecision
+  {
+    const Mat<double>& m;
+    StoragePrecision precision;
+
+    template<class Archive>
+    void save( Archive& ar ) const
+    {
+      uword n_rows = m.n_rows;
+      uword n_cols = m.n_cols;
+      std::uint8_t tag = static_cast<std::uint8_t>( precision );
+      ar( n_rows, n_cols, tag );
+
+      const double* src = m.memptr();
+      const std::size_t n = m.n_elem;
+
+      if( precision == StoragePrecision::float64 ) {
+        ar( cereal::binary_data( const_cast<double*>( src ), n * sizeof(double) ) );
+        return;
+      }
+
+      // buffers typed by the stored element, so portable archives swap the
+      // byte order per element
+      std::vector<float> buf32;
+      std::vector<std::uint16_t> buf16;
+      if( precision == StoragePrecision::float32 ) {
+        buf32.resize( std::min( n, precision_chunk ) );
+      } else {
+        buf16.resize( std::min( n, precision_chunk ) );
+      }
+
+      for( std::size_t i = 0; i < n; i += precision_chunk ) {
+        const std::size_t k = std::min( precision_chunk, n - i );
+        switch( precision ) {
+          case StoragePrecision::float32:
+            narrow_f32( src + i, buf32.data(), k );
+            ar( cereal::binary_data( buf32.data(), k * sizeof(float) ) );
+            break;
+          case StoragePrecision::bfloat16:
+            narrow_bf16( src + i, buf16.data(), k );
+            ar( cereal::binary_data( buf16.data(), k * sizeof(std::uint16_t) ) );
+            break;
+          case StoragePrecision::float16:
+            narrow_f16( src + i, buf16.data(), k );
+            ar( cereal::binary_data( buf16.data(), k * sizeof(std::uint16_t) ) );
+            break;
+          default:
+            break;
+        }
+      }
+    }
+  };
+
+  inline ReducedPrecision make_reduced( const Mat<double>& m, StoragePrecision precision )
+  {
+    return {m, precision};
+  }
+
+
+  // Reads a matrix written by ReducedPrecision, whatever policy was used.
+  struct ReducedPrecisionReader
+  {
+    Mat<double>& m;
+
+    template<class Archive>
+    void load( Archive& ar )
+    {
+      uword n_rows{};
+      uword n_cols{};
+      std::uint8_t tag{};
+      ar( n_rows, n_cols, tag );
+
+      const StoragePrecision precision = static_cast<StoragePrecision>( tag );
+      bytes_per_element( precision ); // throws on unknown tags
+
+      m.set_size( n_rows, n_cols );
+      double* dst = m.memptr();
+      const std::size_t n = m.n_elem;
+
+      if( precision == StoragePrecision::float64 ) {
+        ar( cereal::binary_data( dst, n * sizeof(double) ) );
+        return;
+      }
+
+      std::vector<float> buf32;
+      std::vector<std::uint16_t> buf16;
+      if( precision == StoragePrecision::float32 ) {
+        buf32.resize( std::min( n, precision_chunk ) );
+      } else {
+        buf16.resize( std::min( n, precision_chunk ) );
+      }
+
+      for( std::size_t i = 0; i < n; i += precision_chunk ) {
+        const std::size_t k = std::min( precision_chunk, n - i );
+        switch( precision ) {
+          case StoragePrecision::float32:
+            ar( cereal::binary_data( buf32.data(), k * sizeof(float) ) );
+            widen_f32( buf32.data(), dst + i, k );
+            break;
+          case StoragePrecision::bfloat16:
+            ar( cereal::binary_data( buf16.data(), k * sizeof(std::uint16_t) ) );
+            widen_bf16( buf16.data(), dst + i, k );
+            break;
+          case StoragePrecision::float16:
+            ar( cereal::binary_data( buf16.data(), k * sizeof(std::uint16_t) ) );
+            widen_f16( buf16.data(), dst + i, k );
+            break;
+          default:
+            break;
+        }
+      }
+    }
+  };
+
+  inline ReducedPrecisionReader make_reduced_reader( Mat<double>& m )
+  {
+    return {m};
+  }
+}
+
+
+
+// [[Rcpp::export]]
+int main() {
+
+  arma::mat A = arma::randn(200, 50);
+
+  const arma::StoragePrecision policies[] = {
+    arma::StoragePrecision::float64,
+    arma::StoragePrecision::float32,
+    arma::StoragePrecision::bfloat16,
+    arma::StoragePrecision::float16
+  };
+  const char* names[] = { "float64", "float32", "bfloat16", "float16" };
+
+  for( int p = 0; p < 4; ++p ) {
+    const std::string path = std::string("Backend/Serialize_Arma_") + names[p] + ".bin";
+
+    { // Serialize
+      std::ofstream os(path, std::ios::binary);
+      cereal::BinaryOutputArchive oarchive(os);
+      oarchive(arma::make_reduced(A, policies[p]));
+    }
+
+    // .... put put put ...
+
+    { // Deserialize, the precision is read from the archive
+      arma::mat B;
+      std::ifstream is(path, std::ios::binary);
+      cereal::BinaryInputArchive iarchive(is);
+      iarchive(arma::make_reduced_reader(B));
+
+      std::ifstream size_probe(path, std::ios::binary | std::ios::ate);
+      Rcpp::Rcout << names[p] << ": " << size_probe.tellg() << " bytes, "
+                  << "max rel. error: "
+                  << arma::max( arma::vectorise( arma::abs(A - B) / arma::abs(A) ) )
+                  << std::endl;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,280 @@
+// SER_04: Fast JSON export of arma::Mat
+// ----------------------------------------------------------------------------
+// The JSON save for arma::Mat in SER_04_Serialize_Arma_with_JSON_1.cpp sends
+// every element through ColWrapper::save, i.e., one archive call with generic
+// number formatting and writer bookkeeping per element. Exporting a 10k x 1k
+// matrix like that is dominated by per element overhead.
+//
+// cereal::JSONOutputArchive does not allow raw text to be injected, hence the
+// bulk path is a small writer of its own, JSONMatrixWriter. It produces the
+// same document layout as the JSON archive with the overloads of
+// SER_04_Serialize_Arma_with_JSON_1.cpp (an array of column arrays per
+// matrix, named value0, value1, ... unless a name is given), so the output
+// still loads with cereal::JSONInputArchive.
+//
+// Every column is formatted at once into one preallocated buffer:
+// - the worst case size of a column is reserved up front
+// - numbers are written with std::to_chars, the shortest representation that
+//   round trips (like Ryu), no locale, no printf parsing
+// - the buffer is handed to the stream in large chunks
+//
+// Non-finite values are written as NaN, Infinity and -Infinity, like the
+// cereal JSON archive does.
+// ----------------------------------------------------------------------------
+// [[Rcpp::plugins("cpp17")]]
+// [[Rcpp::depends(RcppArmadillo)]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <fstream>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <RcppArmadillo.h>
+#include <cereal/cereal.hpp>
+#include <cereal/archives/json.hpp>
+
+namespace arma
+{
+  // Wraps a particular column in a class with its own serialization function.
+  // See SER_04_Serialize_Arma_with_JSON_1.cpp for the details.
+  template <class T>
+  struct ColWrapper
+  {
+    ColWrapper(T && m, int c, int nc) : mat(std::forward<T>(m)), col(c), n_cols(nc) {}
+    T & mat;
+    int col;
+    int n_cols;
+
+    template <class Archive>
+    void load( Archive & ar )
+    {
+      cereal::size_type n_rows;
+
+      // Test to see if we need to resize the data
+      ar( cereal::make_size_tag( n_rows ) );
+      if( mat.n_rows != n_rows ) {
+        mat.resize( n_rows, n_cols );
+      }
+
+      for( auto iter = mat.begin_col(col), end = mat.end_col(col); iter != end; ++iter ) {
+        ar( *iter );
+      }
+    }
+  };
+
+
+  // Convenience function to make a ColWrapper
+  template<class T> inline
+  ColWrapper<T> make_col_wrapper(T && t, int c, int nc)
+  {
+    return {std::forward<T>(t), c, nc};
+  }
+
+
+  template<class Archive, class eT, cereal::traits::EnableIf<cereal::traits::is_text_archive<Archive>::value> = cereal::traits::sfinae>
+  inline void load( Archive & ar, Mat<eT>& m )
+  {
+    cereal::size_type n_cols;
+
+    ar( cereal::make_size_tag( n_cols ) );
+    for( std::size_t i = 0; i < n_cols; ++i ) {
+      ar( make_col_wrapper(m, i, n_cols) );
+    }
+  }
+
+
+  // Writes matrices as a JSON document in the layout of the cereal JSON
+  // archive. The document is closed when the writer is destroyed.
+  class JSONMatrixWriter
+  {
+  public:
+    // pretty: indented like cereal::JSONOutputArchive, compact otherwise
+    explicit JSONMatrixWriter(std::ostream& os, bool pretty = true)
+      : os(os), pretty(pretty)
+    {
+      buf.reserve( flush_size );
+      buf += '{';
+    }
+
+    ~JSONMatrixWriter()
+    {
+      newline( 0 );
+      buf += '}';
+      if( pretty ) {
+        buf += '\n';
+      }
+      flush();
+    }
+
+    JSONMatrixWriter(const JSONMatrixWriter&) = delete;
+    JSONMatrixWriter& operator=(const JSONMatrixWriter&) = delete;
+
+    // Unnamed matrices, named value0, value1, ... like in cereal
+    template<class ... eTs>
+    JSONMatrixWriter& operator()(const Mat<eTs>& ... ms)
+    {
+      ( add( "value" + std::to_string( counter++ ), ms ), ... );
+      return *this;
+    }
+
+    template<class eT>
+    JSONMatrixWriter& add(const std::string& name, const Mat<eT>& m)
+    {
+      static_assert( std::is_arithmetic<eT>::value, "JSONMatrixWriter: only real element types" );
+
+      if( !first ) {
+        buf += ',';
+      }
+      first = false;
+      newline( 1 );
+      buf += '"';
+      buf += name;   // names are plain identifiers, no escaping
+      buf += pretty ? "\": [" : "\":[";
+
+      for( uword c = 0; c < m.n_cols; ++c ) {
+        if( c > 0 ) {
+          buf += ',';
+        }
+        newline( 2 );
+        buf += '[';
+        write_column( m.colptr( c ), m.n_rows );
+        newline( 2 );
+        buf += ']';
+
+        if( buf.size() >= flush_size ) {
+          flush();
+        }
+      }
+
+      if( m.n_cols > 0 ) {
+        newline( 1 );
+      }
+      buf += ']';
+      return *this;
+    }
+
+  private:
+    static constexpr std::size_t flush_size = 1 << 20;
+    static constexpr std::size_t max_number = 32;   // enough for any double
+
+    void newline(int depth)
+    {
+      if( pretty ) {
+        buf += '\n';
+        buf.append( 4 * depth, ' ' );
+      }
+    }
+
+    template<class eT>
+    void write_column(const eT* x, uword n)
+    {
+      const std::size_t indent = pretty ? 1 + 4 * 3 : 0;
+
+      // reserve the worst case once, then write through a raw pointer
+      const std::size_t at = buf.size();
+      buf.resize( at + n * (max_number + indent + 1) );
+      char* p = &buf[at];
+      char* const end = &buf[0] + buf.size();
+
+      for( uword i = 0; i < n; ++i ) {
+        if( i > 0 ) {
+          *p++ = ',';
+        }
+        if( pretty ) {
+          *p++ = '\n';
+          std::memset( p, ' ', indent - 1 );
+          p += indent - 1;
+        }
+        p = write_number( p, end, x[i] );
+      }
+      buf.resize( static_cast<std::size_t>( p - buf.data() ) );
+    }
+
+    template<class eT>
+    static char* write_number(char* p, char* end, eT v)
+    {
+      if constexpr ( std::is_floating_point<eT>::value ) {
+        if( std::isnan( v ) ) {
+          std::memcpy( p, "NaN", 3 );
+          return p + 3;
+        }
+        if( std::isinf( v ) ) {
+          if( v < 0 ) {
+            *p++ = '-';
+          }
+          std::memcpy( p, "Infinity", 8 );
+          return p + 8;
+        }
+      }
+      return std::to_chars( p, end, v ).ptr;
+    }
+
+    void flush()
+    {
+      os.write( buf.data(), static_cast<std::streamsize>( buf.size() ) );
+      buf.clear();
+    }
+
+    std::ostream& os;
+    bool pretty;
+    bool first = true;
+    unsigned counter = 0;
+    std::string buf;
+  };
+}
+
+
+// [[Rcpp::export]]
+int main()
+{
+  std::stringstream ss;
+
+  {
+    arma::mat A = arma::randu<arma::mat>(4, 5);
+    arma::vec v = arma::randu<arma::vec>(10);
+
+    // print data before serialization
+    Rcpp::Rcout << "The data before serialization." << std::endl;
+    Rcpp::Rcout << "The matrix:\n";
+    A.print();
+    Rcpp::Rcout << "The vector:\n";
+    v.print();
+    Rcpp::Rcout << std::endl;
+
+    arma::JSONMatrixWriter writer(ss);
+    writer(A, v);
+  }
+  Rcpp::Rcout << "Print out serialized matrix in stream format." << std::endl;
+  Rcpp::Rcout << ss.str() << std::endl;
+
+  {
+    // the document is readable by the cereal JSON archive
+    arma::mat A;
+    arma::vec v;
+    cereal::JSONInputArchive ar(ss);
+    ar(A, v);
+
+    Rcpp::Rcout << "The data after deserialization." << std::endl;
+    Rcpp::Rcout << "The matrix:\n";
+    A.print();
+    Rcpp::Rcout << "The vector:\n";
+    v.print();
+  }
+
+  return 0;
+}
+
+
+// Larger export in compact mode, e.g. export_large_json(10000, 1000) writes
+// about 200 MB
+// [[Rcpp::export]]
+void export_large_json(int n_rows = 1000, int n_cols = 100)
+{
+  arma::mat B = arma::randn<arma::mat>(n_rows, n_cols);
+  std::ofstream os("Backend/Serialize_Arma_large.json");
+  arma::JSONMatrixWriter writer(os, false);
+  writer.add("B", B);
+}
@@ -0,0 +1,539 @@
+// SER_04: Fast JSON import of arma::Mat
+// ----------------------------------------------------------------------------
+// cereal::JSONInputArchive first parses the whole document into a DOM, then
+// the load overload of SER_04_Serialize_Arma_with_JSON_1.cpp pulls every
+// element out of it with one archive call (ColWrapper::load). For large
+// matrices almost all of the time goes into building and walking DOM nodes of
+// plain numbers.
+//
+// The archive offers no way to get at the raw text of a value, so the fast
+// path is a reader of its own, JSONMatrixReader. It understands the document
+// layout written by the JSON_1 overloads (and by the JSONMatrixWriter of
+// SER_04_Serialize_Arma_with_JSON_2.cpp):
+//
+//   { "value0": [ [ x, x, ... ], [ x, x, ... ], ... ], "value1": ... }
+//
+// i.e., files written so far load without being regenerated.
+//
+// A matrix is read in two passes over its text:
+// 1. structure: 32 byte blocks are compared against '[', ']' and ',' at once
+//    (AVX2 or SSE2), the set bits of the masks give the number of columns and
+//    the number of rows of the first column. The matrix is allocated once.
+// 2. numbers: every column is parsed with std::from_chars straight into the
+//    column memory. Whitespace (indentation of pretty output) is skipped 32
+//    bytes at a time.
+// No DOM node and no temporary is created per value.
+//
+// NOTE:
+// - std::from_chars for floating point needs GCC >= 11 or a recent clang/MSVC.
+//   libstdc++ implements it with the fast_float algorithm.
+// - NaN, Infinity and -Infinity are accepted like in the cereal JSON archive.
+// - Member names are compared as written, escape sequences are not decoded.
+// ----------------------------------------------------------------------------
+// [[Rcpp::plugins("cpp17")]]
+// [[Rcpp::depends(RcppArmadillo)]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include <RcppArmadillo.h>
+#include <cereal/cereal.hpp>
+#include <cereal/archives/json.hpp>
+
+namespace arma
+{
+  // Wraps a particular column in a class with its own serialization function.
+  // See SER_04_Serialize_Arma_with_JSON_1.cpp for the details.
+  template <class T>
+  struct ColWrapper
+  {
+    ColWrapper(T && m, int c, int nc) : mat(std::forward<T>(m)), col(c), n_cols(nc) {}
+    T & mat;
+    int col;
+    int n_cols;
+
+    template <class Archive>
+    void save( Archive & ar ) const
+    {
+      ar( cereal::make_size_tag( mat.n_rows ) );
+      for( auto iter = mat.begin_col(col), end = mat.end_col(col); iter != end; ++iter ) {
+        ar( *iter );
+      }
+    }
+
+    template <class Archive>
+    void load( Archive & ar )
+    {
+      cereal::size_type n_rows;
+
+      // Test to see if we need to resize the data
+      ar( cereal::make_size_tag( n_rows ) );
+      if( mat.n_rows != n_rows ) {
+        mat.resize( n_rows, n_cols );
+      }
+
+      for( auto iter = mat.begin_col(col), end = mat.end_col(col); iter != end; ++iter ) {
+        ar( *iter );
+      }
+    }
+  };
+
+
+  // Convenience function to make a ColWrapper
+  template<class T> inline
+  ColWrapper<T> make_col_wrapper(T && t, int c, int nc)
+  {
+    return {std::forward<T>(t), c, nc};
+  }
+
+
+  template<class Archive, class eT, cereal::traits::EnableIf<cereal::traits::is_text_archive<Archive>::value> = cereal::traits::sfinae>
+  inline void save( Archive & ar, const Mat<eT>& m )
+  {
+    uword n_cols = m.n_cols;
+
+    ar( cereal::make_size_tag( n_cols ) );
+    for( std::size_t i = 0; i < n_cols; ++i ) {
+      ar( make_col_wrapper(m, i, n_cols) );
+    }
+  }
+
+
+  template<class Archive, class eT, cereal::traits::EnableIf<cereal::traits::is_text_archive<Archive>::value> = cereal::traits::sfinae>
+  inline void load( Archive & ar, Mat<eT>& m )
+  {
+    cereal::size_type n_cols;
+
+    ar( cereal::make_size_tag( n_cols ) );
+    for( std::size_t i = 0; i < n_cols; ++i ) {
+      ar( make_col_wrapper(m, i, n_cols) );
+    }
+  }
+
+
+  namespace json_detail
+  {
+    // The text is followed by this many padding bytes, so that the block
+    // kernels may always load 32 bytes. The padding character is not valid
+    // JSON outside of strings, hence running into it is reported as an error.
+    constexpr std::size_t padding = 64;
+    constexpr char pad_char = '#';
+
+    inline int ctz(std::uint32_t x)
+    {
+#if defined(__GNUC__)
+      return __builtin_ctz( x );
+#else
+      int i = 0;
+      while( !(x & 1u) ) { x >>= 1; ++i; }
+      return i;
+#endif
+    }
+
+    // bit i is set if p[i] == c, for 32 bytes
+    inline std::uint32_t eq_mask(const char* p, char c)
+    {
+#if defined(__AVX2__)
+      const __m256i v = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( p ) );
+      return static_cast<std::uint32_t>( _mm256_movemask_epi8( _mm256_cmpeq_epi8( v, _mm256_set1_epi8( c ) ) ) );
+#elif defined(__SSE2__)
+      const __m128i lo = _mm_loadu_si128( reinterpret_cast<const __m128i*>( p ) );
+      const __m128i hi = _mm_loadu_si128( reinterpret_cast<const __m128i*>( p + 16 ) );
+      const __m128i cc = _mm_set1_epi8( c );
+      return static_cast<std::uint32_t>( _mm_movemask_epi8( _mm_cmpeq_epi8( lo, cc ) ) )
+        | ( static_cast<std::uint32_t>( _mm_movemask_epi8( _mm_cmpeq_epi8( hi, cc ) ) ) << 16 );
+#else
+      std::uint32_t m = 0;
+      for( int i = 0; i < 32; ++i ) {
+        m |= std::uint32_t( p[i] == c ) << i;
+      }
+      return m;
+#endif
+    }
+
+    // bit i is set if p[i] is not whitespace (any byte above ' '), for 32 bytes
+    inline std::uint32_t nonspace_mask(const char* p)
+    {
+#if defined(__AVX2__)
+      const __m256i v = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( p ) );
+      const __m256i t = _mm256_max_epu8( v, _mm256_set1_epi8( 0x21 ) );
+      return static_cast<std::uint32_t>( _mm256_movemask_epi8( _mm256_cmpeq_epi8( t, v ) ) );
+#elif defined(__SSE2__)
+      const __m128i lim = _mm_set1_epi8( 0x21 );
+      const __m128i lo = _mm_loadu_si128( reinterpret_cast<const __m128i*>( p ) );
+      const __m128i hi = _mm_loadu_si128( reinterpret_cast<const __m128i*>( p + 16 ) );
+      return static_cast<std::uint32_t>( _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_max_epu8( lo, lim ), lo ) ) )
+        | ( static_cast<std::uint32_t>( _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_max_epu8( hi, lim ), hi ) ) ) << 16 );
+#else
+      std::uint32_t m = 0;
+      for( int i = 0; i < 32; ++i ) {
+        m |= std::uint32_t( static_cast<unsigned char>( p[i] ) > 0x20 ) << i;
+      }
+      return m;
+#endif
+    }
+
+    // The padding guarantees a non-whitespace byte, so this always stops.
+    inline const char* skip_ws(const char* p)
+    {
+      if( static_cast<unsigned char>( *p ) > 0x20 ) {
+        return p;   // compact output: nothing to skip
+      }
+      for( ;; p += 32 ) {
+        const std::uint32_t m = nonspace_mask( p );
+        if( m != 0 ) {
+          return p + ctz( m );
+        }
+      }
+    }
+
+    [[noreturn]] inline void fail(const std::string& what, const char* at, const char* begin)
+    {
+      throw std::runtime_error( "JSONMatrixReader: " + what + " at offset " +
+                                std::to_string( at - begin ) );
+    }
+
+    // Dimensions of a matrix, from the '[' opening it.
+    struct Shape
+    {
+      uword n_rows;
+      uword n_cols;
+    };
+
+    inline Shape scan_matrix(const char* p, const char* end, const char* begin)
+    {
+      uword n_cols = 0;
+      uword commas = 0;
+      const char* first_col = nullptr;
+      bool first_done = false;
+      int depth = 0;
+
+      for( const char* q = p; q < end; q += 32 ) {
+        const std::uint32_t open  = eq_mask( q, '[' );
+        const std::uint32_t close = eq_mask( q, ']' );
+        const std::uint32_t comma = first_done ? 0u : eq_mask( q, ',' );
+
+        for( std::uint32_t bits = open | close | comma; bits != 0; bits &= bits - 1 ) {
+          const int i = ctz( bits );
+          const std::uint32_t b = 1u << i;
+
+          if( open & b ) {
+            if( ++depth == 2 ) {
+              if( ++n_cols == 1 ) {
+                first_col = q + i;
+              }
+            } else if( depth > 2 ) {
+              fail( "nested array in matrix", q + i, begin );
+            }
+          } else if( close & b ) {
+            if( depth == 2 && n_cols == 1 ) {
+              first_done = true;
+            }
+            if( --depth == 0 ) {
+              uword n_rows = 0;
+              if( n_cols > 0 && *skip_ws( first_col + 1 ) != ']' ) {
+                n_rows = commas + 1;
+              }
+              return { n_rows, n_cols };
+            }
+          } else if( depth == 2 && !first_done ) {
+            ++commas;
+          }
+        }
+      }
+      fail( "unterminated matrix", p, begin );
+    }
+
+    template<class eT>
+    inline const char* parse_number(const char* p, const char* end, eT& v)
+    {
+      if constexpr ( std::is_floating_point<eT>::value ) {
+        const bool neg = (*p == '-');
+        const char* s = p + (neg ? 1 : 0);
+        if( *s == 'N' && std::memcmp( s, "NaN", 3 ) == 0 ) {
+          v = std::numeric_limits<eT>::quiet_NaN();
+          return s + 3;
+        }
+        if( *s == 'I' && std::memcmp( s, "Infinity", 8 ) == 0 ) {
+          v = neg ? -std::numeric_limits<eT>::infinity() : std::numeric_limits<eT>::infinity();
+          return s + 8;
+        }
+      }
+      const auto res = std::from_chars( p, end, v );
+      if( res.ec != std::errc() ) {
+        return nullptr;
+      }
+      return res.ptr;
+    }
+
+    // Skips any JSON value (used for members which are not asked for).
+    inline const char* skip_value(const char* p, const char* end, const char* begin)
+    {
+      int depth = 0;
+      for( ; p < end; ++p ) {
+        const char c = *p;
+        if( c == '"' ) {
+          for( ++p; p < end && *p != '"'; ++p ) {
+            if( *p == '\\' ) {
+              ++p;
+            }
+          }
+          if( depth == 0 ) {
+            return p + 1;
+          }
+        } else if( c == '[' || c == '{' ) {
+          ++depth;
+        } else if( c == ']' || c == '}' ) {
+          if( depth == 0 ) {
+            return p;   // end of the enclosing object
+          }
+          if( --depth == 0 ) {
+            return p + 1;
+          }
+        } else if( depth == 0 && (c == ',' || static_cast<unsigned char>( c ) <= 0x20) ) {
+          return p;     // end of a number or literal
+        }
+      }
+      fail( "unterminated value", p, begin );
+    }
+  }
+
+
+  // Reads matrices from a JSON document in the layout of the cereal JSON
+  // archive, see the notes at the top of this file.
+  class JSONMatrixReader
+  {
+  public:
+    explicit JSONMatrixReader(std::istream& is)
+      : text( std::istreambuf_iterator<char>( is ), std::istreambuf_iterator<char>() )
+    {
+      n_text = text.size();
+      text.append( json_detail::padding, json_detail::pad_char );
+
+      const char* p = json_detail::skip_ws( begin() );
+      if( *p != '{' ) {
+        json_detail::fail( "expected '{'", p, begin() );
+      }
+      body = p + 1;
+      cursor = body;
+    }
+
+    // Reads the next members in document order, like unnamed values in cereal
+    template<class ... eTs>
+    JSONMatrixReader& operator()(Mat<eTs>& ... ms)
+    {
+      ( next( ms ), ... );
+      return *this;
+    }
+
+    // Reads the member with the given name
+    template<class eT>
+    JSONMatrixReader& get(const std::string& name, Mat<eT>& m)
+    {
+      std::string key;
+      for( const char* p = body; (p = member( p, key )) != nullptr; ) {
+        if( key == name ) {
+          cursor = parse_matrix( p, m );
+          return *this;
+        }
+        p = json_detail::skip_value( json_detail::skip_ws( p ), end(), begin() );
+      }
+      throw std::runtime_error( "JSONMatrixReader: no member named " + name );
+    }
+
+  private:
+    const char* begin() const { return text.data(); }
+    const char* end() const { return text.data() + n_text; }
+
+    template<class eT>
+    void next(Mat<eT>& m)
+    {
+      std::string key;
+      const char* p = member( cursor, key );
+      if( p == nullptr ) {
+        throw std::runtime_error( "JSONMatrixReader: no more members" );
+      }
+      cursor = parse_matrix( p, m );
+    }
+
+    // Parses '[,] "name" :' at p. Returns the start of the value, or nullptr
+    // at the end of the object.
+    const char* member(const char* p, std::string& key) const
+    {
+      p = json_detail::skip_ws( p );
+      if( *p == ',' ) {
+        p = json_detail::skip_ws( p + 1 );
+      }
+      if( *p == '}' ) {
+        return nullptr;
+      }
+      if( *p != '"' ) {
+        json_detail::fail( "expected member name", p, begin() );
+      }
+      const char* k = ++p;
+      while( p < end() && *p != '"' ) {
+        p += (*p == '\\') ? 2 : 1;
+      }
+      if( p >= end() ) {
+        json_detail::fail( "unterminated member name", k, begin() );
+      }
+      key.assign( k, p );
+
+      p = json_detail::skip_ws( p + 1 );
+      if( *p != ':' ) {
+        json_detail::fail( "expected ':'", p, begin() );
+      }
+      return p + 1;
+    }
+
+    template<class eT>
+    const char* parse_matrix(const char* p, Mat<eT>& m) const
+    {
+      static_assert( std::is_arithmetic<eT>::value, "JSONMatrixReader: only real element types" );
+
+      p = json_detail::skip_ws( p );
+      if( *p != '[' ) {
+        json_detail::fail( "expected '['", p, begin() );
+      }
+
+      const json_detail::Shape s = json_detail::scan_matrix( p, end(), begin() );
+      m.set_size( s.n_rows, s.n_cols );
+
+      ++p;
+      for( uword c = 0; c < s.n_cols; ++c ) {
+        p = json_detail::skip_ws( p );
+        if( c > 0 ) {
+          if( *p != ',' ) {
+            json_detail::fail( "expected ','", p, begin() );
+          }
+          p = json_detail::skip_ws( p + 1 );
+        }
+        p = parse_column( p, m.colptr( c ), s.n_rows );
+      }
+
+      p = json_detail::skip_ws( p );
+      if( *p != ']' ) {
+        json_detail::fail( "expected ']'", p, begin() );
+      }
+      return p + 1;
+    }
+
+    // Parses one column array at p into x, which holds n_rows elements.
+    template<class eT>
+    const char* parse_column(const char* p, eT* x, uword n_rows) const
+    {
+      if( *p != '[' ) {
+        json_detail::fail( "expected '['", p, begin() );
+      }
+      ++p;
+
+      for( uword r = 0; r < n_rows; ++r ) {
+        p = json_detail::skip_ws( p );
+        const char* q = json_detail::parse_number( p, end(), x[r] );
+        if( q == nullptr ) {
+          json_detail::fail( "invalid number", p, begin() );
+        }
+        p = json_detail::skip_ws( q );
+        if( r + 1 < n_rows ) {
+          if( *p != ',' ) {
+            json_detail::fail( "columns of different length", p, begin() );
+          }
+          ++p;
+        }
+      }
+
+      p = json_detail::skip_ws( p );
+      if( *p != ']' ) {
+        json_detail::fail( "columns of different length", p, begin() );
+      }
+      return p + 1;
+    }
+
+    std::string text;
+    std::size_t n_text = 0;
+    const char* body = nullptr;
+    const char* cursor = nullptr;
+  };
+}
+
+
+// [[Rcpp::export]]
+int main()
+{
+  std::stringstream ss;
+
+  arma::mat A = arma::randu<arma::mat>(4, 5);
+  arma::vec v = arma::randu<arma::vec>(10);
+  {
+    // written exactly like in SER_04_Serialize_Arma_with_JSON_1.cpp
+    cereal::JSONOutputArchive ar(ss);
+    ar(A, v);
+  }
+  Rcpp::Rcout << "Print out serialized matrix in stream format." << std::endl;
+  Rcpp::Rcout << ss.str() << std::endl;
+
+  {
+    arma::mat A2;
+    arma::vec v2;
+    arma::JSONMatrixReader reader(ss);
+    reader(A2, v2);
+
+    Rcpp::Rcout << "The data after deserialization." << std::endl;
+    Rcpp::Rcout << "The matrix:\n";
+    A2.print();
+    Rcpp::Rcout << "The vector:\n";
+    v2.print();
+    Rcpp::Rcout << "identical: " << (arma::approx_equal(A, A2, "absdiff", 0.0) &&
+                                     arma::approx_equal(v, v2, "absdiff", 0.0)) << std::endl;
+  }
+
+  {
+    // a larger matrix, cereal load vs. JSONMatrixReader
+    using clock = std::chrono::steady_clock;
+    arma::mat B = arma::randn<arma::mat>(2000, 500);
+    std::string json;
+    {
+      std::ostringstream os;
+      {
+        cereal::JSONOutputArchive ar(os);
+        ar(B);
+      }
+      json = os.str();
+    }
+
+    arma::mat B1, B2;
+    auto t0 = clock::now();
+    {
+      std::istringstream is(json);
+      cereal::JSONInputArchive ar(is);
+      ar(B1);
+    }
+    auto t1 = clock::now();
+    {
+      std::istringstream is(json);
+      arma::JSONMatrixReader reader(is);
+      reader.get("value0", B2);
+    }
+    auto t2 = clock::now();
+
+    Rcpp::Rcout << "cereal JSONInputArchive: " << std::chrono::duration<double>(t1 - t0).count() << " s" << std::endl;
+    Rcpp::Rcout << "JSONMatrixReader:        " << std::chrono::duration<double>(t2 - t1).count() << " s" << std::endl;
+    Rcpp::Rcout << "identical: " << arma::approx_equal(B1, B2, "absdiff", 0.0) << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,480 @@
+// SER_04: Base64 blobs for matrices inside JSON archives
+// ----------------------------------------------------------------------------
+// SER_04_Serialize_Arma_with_JSON_1.cpp writes every element of a matrix as
+// decimal text. With ~20 characters per double this is about 3x the raw size
+// and formatting/parsing the numbers dominates the time.
+//
+// make_base64() is an opt-in representation for arma::Mat and std::vector
+// which keeps the metadata readable and stores the payload as one base64
+// string (4/3 of the raw size):
+//
+//   "A": {
+//       "n_rows": 4,
+//       "n_cols": 5,
+//       "dtype": "<f8",
+//       "data": "AAAAAAAA8D8AAAAAAAAAQA..."
+//   }
+//
+// (std::vector has "n_elem" instead of "n_rows"/"n_cols"). dtype follows the
+// numpy type strings: byte order ('<' little, '>' big endian), kind ('f'
+// floating point, 'i' signed, 'u' unsigned integer, 'c' complex) and the size
+// in bytes. Loading checks it against the requested element type.
+//
+// The base64 kernels use AVX2 (24 bytes <-> 32 characters per step) or SSSE3
+// (12 <-> 16) when enabled at compile time, e.g. in R:
+//   Sys.setenv(PKG_CXXFLAGS = "-march=native")
+// and a table based scalar version otherwise. The vectorized algorithms are
+// the ones by W. Mula and D. Lemire (shuffle based packing, range checks for
+// the validation on decode).
+//
+// NOTE:
+// - The payload is the memory of the matrix as is, i.e., in the byte order
+//   of the writing host (recorded in dtype).
+// - The wrappers work with any cereal text archive, e.g. also with the XML
+//   archive.
+// ----------------------------------------------------------------------------
+// [[Rcpp::plugins("cpp17")]]
+// [[Rcpp::depends(RcppArmadillo)]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <sstream>
+#include <complex>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if defined(__SSSE3__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include <RcppArmadillo.h>
+#include <cereal/cereal.hpp>
+#include <cereal/archives/json.hpp>
+#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
+
+
+namespace base64_detail
+{
+  static const char alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  inline std::size_t encoded_size( std::size_t n ) { return 4 * ((n + 2) / 3); }
+
+  inline void encode_scalar( const unsigned char* in, std::size_t n, char* out )
+  {
+    std::size_t i = 0;
+    for( ; i + 3 <= n; i += 3, out += 4 ) {
+      const std::uint32_t v = (std::uint32_t( in[i] ) << 16) | (std::uint32_t( in[i + 1] ) << 8) | in[i + 2];
+      out[0] = alphabet[(v >> 18) & 63];
+      out[1] = alphabet[(v >> 12) & 63];
+      out[2] = alphabet[(v >> 6) & 63];
+      out[3] = alphabet[v & 63];
+    }
+    if( i < n ) {
+      const std::uint32_t v = (std::uint32_t( in[i] ) << 16) | (i + 1 < n ? std::uint32_t( in[i + 1] ) << 8 : 0u);
+      out[0] = alphabet[(v >> 18) & 63];
+      out[1] = alphabet[(v >> 12) & 63];
+      out[2] = i + 1 < n ? alphabet[(v >> 6) & 63] : '=';
+      out[3] = '=';
+    }
+  }
+
+  // 6 bit value of a character, -1 if it is not part of the alphabet
+  inline int decode_char( unsigned char c )
+  {
+    if( c >= 'A' && c <= 'Z' ) return c - 'A';
+    if( c >= 'a' && c <= 'z' ) return c - 'a' + 26;
+    if( c >= '0' && c <= '9' ) return c - '0' + 52;
+    if( c == '+' ) return 62;
+    if( c == '/' ) return 63;
+    return -1;
+  }
+
+  // Decodes n characters (a multiple of 4, '=' padding only in the last
+  // group), returns the number of bytes written.
+  inline std::size_t decode_scalar( const char* in, std::size_t n, unsigned char* out )
+  {
+    unsigned char* const start = out;
+    for( std::size_t i = 0; i < n; i += 4 ) {
+      const bool last = (i + 4 == n);
+      const int pad = last ? (in[i + 3] == '=') + (in[i + 2] == '=') : 0;
+      int v[4];
+      for( int k = 0; k < 4 - pad; ++k ) {
+        v[k] = decode_char( static_cast<unsigned char>( in[i + k] ) );
+        if( v[k] < 0 ) {
+          throw std::runtime_error( "base64: invalid character" );
+        }
+      }
+      for( int k = 4 - pad; k < 4; ++k ) {
+        v[k] = 0;
+      }
+      const std::uint32_t w = (std::uint32_t( v[0] ) << 18) | (std::uint32_t( v[1] ) << 12) | (std::uint32_t( v[2] ) << 6) | std::uint32_t( v[3] );
+      *out++ = static_cast<unsigned char>( w >> 16 );
+      if( pad < 2 ) *out++ = static_cast<unsigned char>( w >> 8 );
+      if( pad < 1 ) *out++ = static_cast<unsigned char>( w );
+    }
+    return static_cast<std::size_t>( out - start );
+  }
+
+#if defined(__AVX2__)
+  // 6 bit indices -> characters, for 32 indices
+  inline __m256i lookup_avx2( __m256i idx )
+  {
+    const __m256i shift_lut = _mm256_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0 );
+    __m256i r = _mm256_subs_epu8( idx, _mm256_set1_epi8( 51 ) );
+    const __m256i less = _mm256_cmpgt_epi8( _mm256_set1_epi8( 26 ), idx );
+    r = _mm256_or_si256( r, _mm256_and_si256( less, _mm256_set1_epi8( 13 ) ) );
+    return _mm256_add_epi8( _mm256_shuffle_epi8( shift_lut, r ), idx );
+  }
+
+  // 24 bytes -> 32 characters per step, reads 28 bytes
+  inline std::size_t encode_avx2( const unsigned char* in, std::size_t n, char* out )
+  {
+    const __m256i shuf = _mm256_setr_epi8(
+      1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+      1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10 );
+    std::size_t i = 0;
+    for( ; i + 28 <= n; i += 24, out += 32 ) {
+      const __m128i lo = _mm_loadu_si128( reinterpret_cast<const __m128i*>( in + i ) );
+      const __m128i hi = _mm_loadu_si128( reinterpret_cast<const __m128i*>( in + i + 12 ) );
+      __m256i v = _mm256_shuffle_epi8( _mm256_set_m128i( hi, lo ), shuf );
+
+      const __m256i t0 = _mm256_and_si256( v, _mm256_set1_epi32( 0x0fc0fc00 ) );
+      const __m256i t1 = _mm256_mulhi_epu16( t0, _mm256_set1_epi32( 0x04000040 ) );
+      const __m256i t2 = _mm256_and_si256( v, _mm256_set1_epi32( 0x003f03f0 ) );
+      const __m256i t3 = _mm256_mullo_epi16( t2, _mm256_set1_epi32( 0x01000010 ) );
+      v = _mm256_or_si256( t1, t3 );
+
+      _mm256_storeu_si256( reinterpret_cast<__m256i*>( out ), lookup_avx2( v ) );
+    }
+    return i;
+  }
+
+  // 32 characters -> 24 bytes per step, returns the number of characters
+  // consumed (a multiple of 32) or throws on invalid characters
+  inline std::size_t decode_avx2( const char* in, std::size_t n, unsigned char* out )
+  {
+    const __m256i pack = _mm256_setr_epi8(
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1 );
+    const __m256i lanes = _mm256_setr_epi32( 0, 1, 2, 4, 5, 6, 7, 7 );
+    const __m256i store_mask = _mm256_setr_epi32( -1, -1, -1, -1, -1, -1, 0, 0 );
+
+    std::size_t i = 0;
+    for( ; i + 32 <= n; i += 32, out += 24 ) {
+      const __m256i c = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( in + i ) );
+
+      // range checks, the signed compares reject bytes >= 0x80
+      const __m256i az_u = _mm256_and_si256( _mm256_cmpgt_epi8( c, _mm256_set1_epi8( 'A' - 1 ) ), _mm256_cmpgt_epi8( _mm256_set1_epi8( 'Z' + 1 ), c ) );
+      const __m256i az_l = _mm256_and_si256( _mm256_cmpgt_epi8( c, _mm256_set1_epi8( 'a' - 1 ) ), _mm256_cmpgt_epi8( _mm256_set1_epi8( 'z' + 1 ), c ) );
+      const __m256i dig  = _mm256_and_si256( _mm256_cmpgt_epi8( c, _mm256_set1_epi8( '0' - 1 ) ), _mm256_cmpgt_epi8( _mm256_set1_epi8( '9' + 1 ), c ) );
+      const __m256i plus = _mm256_cmpeq_epi8( c, _mm256_set1_epi8( '+' ) );
+      const __m256i slash = _mm256_cmpeq_epi8( c, _mm256_set1_epi8( '/' ) );
+
+      const __m256i valid = _mm256_or_si256( _mm256_or_si256( az_u, az_l ), _mm256_or_si256( dig, _mm256_or_si256( plus, slash ) ) );
+      if( _mm256_movemask_epi8( valid ) != -1 ) {
+        throw std::runtime_error( "base64: invalid character" );
+      }
+
+      __m256i shift = _mm256_and_si256( az_u, _mm256_set1_epi8( -65 ) );
+      shift = _mm256_or_si256( shift, _mm256_and_si256( az_l, _mm256_set1_epi8( -71 ) ) );
+      shift = _mm256_or_si256( shift, _mm256_and_si256( dig, _mm256_set1_epi8( 4 ) ) );
+      shift = _mm256_or_si256( shift, _mm256_and_si256( plus, _mm256_set1_epi8( 19 ) ) );
+      shift = _mm256_or_si256( shift, _mm256_and_si256( slash, _mm256_set1_epi8( 16 ) ) );
+      const __m256i v = _mm256_add_epi8( c, shift );
+
+      // 4 x 6 bits -> 3 bytes
+      const __m256i ab = _mm256_maddubs_epi16( v, _mm256_set1_epi32( 0x01400140 ) );
+      const __m256i abcd = _mm256_madd_epi16( ab, _mm256_set1_epi32( 0x00011000 ) );
+      const __m256i bytes = _mm256_permutevar8x32_epi32( _mm256_shuffle_epi8( abcd, pack ), lanes );
+      _mm256_maskstore_epi32( reinterpret_cast<int*>( out ), store_mask, bytes );
+    }
+    return i;
+  }
+#endif
+
+#if defined(__SSSE3__)
+  // 12 bytes -> 16 characters per step, reads 16 bytes
+  inline std::size_t encode_ssse3( const unsigned char* in, std::size_t n, char* out )
+  {
+    const __m128i shuf = _mm_setr_epi8( 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10 );
+    const __m128i shift_lut = _mm_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0 );
+    std::size_t i = 0;
+    for( ; i + 16 <= n; i += 12, out += 16 ) {
+      __m128i v = _mm_shuffle_epi8( _mm_loadu_si128( reinterpret_cast<const __m128i*>( in + i ) ), shuf );
+
+      const __m128i t0 = _mm_and_si128( v, _mm_set1_epi32( 0x0fc0fc00 ) );
+      const __m128i t1 = _mm_mulhi_epu16( t0, _mm_set1_epi32( 0x04000040 ) );
+      const __m128i t2 = _mm_and_si128( v, _mm_set1_epi32( 0x003f03f0 ) );
+      const __m128i t3 = _mm_mullo_epi16( t2, _mm_set1_epi32( 0x01000010 ) );
+      v = _mm_or_si128( t1, t3 );
+
+      __m128i r = _mm_subs_epu8( v, _mm_set1_epi8( 51 ) );
+      const __m128i less = _mm_cmpgt_epi8( _mm_set1_epi8( 26 ), v );
+      r = _mm_or_si128( r, _mm_and_si128( less, _mm_set1_epi8( 13 ) ) );
+      r = _mm_add_epi8( _mm_shuffle_epi8( shift_lut, r ), v );
+
+      _mm_storeu_si128( reinterpret_cast<__m128i*>( out ), r );
+    }
+    return i;
+  }
+
+  // 16 characters -> 12 bytes per step
+  inline std::size_t decode_ssse3( const char* in, std::size_t n, unsigned char* out )
+  {
+    const __m128i pack = _mm_setr_epi8( 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1 );
+
+    std::size_t i = 0;
+    for( ; i + 16 <= n; i += 16, out += 12 ) {
+      const __m128i c = _mm_loadu_si128( reinterpret_cast<const __m128i*>( in + i ) );
+
+      const __m128i az_u = _mm_and_si128( _mm_cmpgt_epi8( c, _mm_set1_epi8( 'A' - 1 ) ), _mm_cmpgt_epi8( _mm_set1_epi8( 'Z' + 1 ), c ) );
+      const __m128i az_l = _mm_and_si128( _mm_cmpgt_epi8( c, _mm_set1_epi8( 'a' - 1 ) ), _mm_cmpgt_epi8( _mm_set1_epi8( 'z' + 1 ), c ) );
+      const __m128i dig  = _mm_and_si128( _mm_cmpgt_epi8( c, _mm_set1_epi8( '0' - 1 ) ), _mm_cmpgt_epi8( _mm_set1_epi8( '9' + 1 ), c ) );
+      const __m128i plus = _mm_cmpeq_epi8( c, _mm_set1_epi8( '+' ) );
+      const __m128i slash = _mm_cmpeq_epi8( c, _mm_set1_epi8( '/' ) );
+
+      const __m128i valid = _mm_or_si128( _mm_or_si128( az_u, az_l ), _mm_or_si128( dig, _mm_or_si128( plus, slash ) ) );
+      if( _mm_movemask_epi8( valid ) != 0xFFFF ) {
+        throw std::runtime_error( "base64: invalid character" );
+      }
+
+      __m128i shift = _mm_and_si128( az_u, _mm_set1_epi8( -65 ) );
+      shift = _mm_or_si128( shift, _mm_and_si128( az_l, _mm_set1_epi8( -71 ) ) );
+      shift = _mm_or_si128( shift, _mm_and_si128( dig, _mm_set1_epi8( 4 ) ) );
+      shift = _mm_or_si128( shift, _mm_and_si128( plus, _mm_set1_epi8( 19 ) ) );
+      shift = _mm_or_si128( shift, _mm_and_si128( slash, _mm_set1_epi8( 16 ) ) );
+      const __m128i v = _mm_add_epi8( c, shift );
+
+      const __m128i ab = _mm_maddubs_epi16( v, _mm_set1_epi32( 0x01400140 ) );
+      const __m128i abcd = _mm_madd_epi16( ab, _mm_set1_epi32( 0x00011000 ) );
+      alignas(16) unsigned char tmp[16];
+      _mm_store_si128( reinterpret_cast<__m128i*>( tmp ), _mm_shuffle_epi8( abcd, pack ) );
+      std::memcpy( out, tmp, 12 );
+    }
+    return i;
+  }
+#endif
+
+  inline std::string encode( const void* data, std::size_t n )
+  {
+    const unsigned char* in = static_cast<const unsigned char*>( data );
+    std::string out( encoded_size( n ), '\0' );
+    char* p = &out[0];
+
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    i = encode_avx2( in, n, p );
+#elif defined(__SSSE3__)
+    i = encode_ssse3( in, n, p );
+#endif
+    encode_scalar( in + i, n - i, p + 4 * (i / 3) );
+    return out;
+  }
+
+  // Decodes s into exactly n bytes at data
+  inline void decode( const std::string& s, void* data, std::size_t n )
+  {
+    if( s.size() != encoded_size( n ) ) {
+      throw std::runtime_error( "base64: size of the data does not match the dimensions" );
+    }
+    unsigned char* out = static_cast<unsigned char*>( data );
+    const char* in = s.data();
+    if( s.empty() ) {
+      return;
+    }
+
+    // the last group (possibly padded) is always left to the scalar code
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    i = decode_avx2( in, s.size() - 4, out );
+#elif defined(__SSSE3__)
+    i = decode_ssse3( in, s.size() - 4, out );
+#endif
+    const std::size_t k = 3 * (i / 4);
+    if( k + decode_scalar( in + i, s.size() - i, out + k ) != n ) {
+      throw std::runtime_error( "base64: size of the data does not match the dimensions" );
+    }
+  }
+
+  inline bool is_little_endian()
+  {
+    const std::uint16_t test = 1;
+    unsigned char first;
+    std::memcpy( &first, &test, 1 );
+    return first == 1;
+  }
+
+  template<class T> struct kind { static constexpr char value = std::is_floating_point<T>::value ? 'f' : std::is_signed<T>::value ? 'i' : 'u'; };
+  template<class T> struct kind<std::complex<T>> { static constexpr char value = 'c'; };
+
+  // numpy type string of eT, e.g. "<f8"
+  template<class eT>
+  inline std::string dtype()
+  {
+    static_assert( std::is_arithmetic<eT>::value || std::is_same<eT, std::complex<float>>::value ||
+                   std::is_same<eT, std::complex<double>>::value, "base64: unsupported element type" );
+    return std::string( 1, is_little_endian() ? '<' : '>' ) + kind<eT>::value + std::to_string( sizeof(eT) );
+  }
+
+  template<class eT>
+  inline void check_dtype( const std::string& stored )
+  {
+    const std::string expected = dtype<eT>();
+    if( stored != expected ) {
+      throw std::runtime_error( "base64: data stored as " + stored + ", cannot load as " + expected );
+    }
+  }
+}
+
+
+namespace arma
+{
+  // Matrix as { n_rows, n_cols, dtype, data }
+  template<class eT>
+  struct Base64Mat
+  {
+    Mat<eT>& m;
+
+    template<class Archive>
+    void save( Archive & ar ) const
+    {
+      ar( cereal::make_nvp( "n_rows", m.n_rows ),
+          cereal::make_nvp( "n_cols", m.n_cols ),
+          cereal::make_nvp( "dtype", base64_detail::dtype<eT>() ),
+          cereal::make_nvp( "data", base64_detail::encode( m.memptr(), m.n_elem * sizeof(eT) ) ) );
+    }
+
+    template<class Archive>
+    void load( Archive & ar )
+    {
+      uword n_rows{}, n_cols{};
+      std::string dtype, data;
+      ar( cereal::make_nvp( "n_rows", n_rows ),
+          cereal::make_nvp( "n_cols", n_cols ),
+          cereal::make_nvp( "dtype", dtype ),
+          cereal::make_nvp( "data", data ) );
+
+      base64_detail::check_dtype<eT>( dtype );
+      m.set_size( n_rows, n_cols );
+      base64_detail::decode( data, m.memptr(), m.n_elem * sizeof(eT) );
+    }
+  };
+
+
+  // std::vector as { n_elem, dtype, data }
+  template<class eT>
+  struct Base64Vector
+  {
+    std::vector<eT>& v;
+
+    template<class Archive>
+    void save( Archive & ar ) const
+    {
+      ar( cereal::make_nvp( "n_elem", static_cast<std::uint64_t>( v.size() ) ),
+          cereal::make_nvp( "dtype", base64_detail::dtype<eT>() ),
+          cereal::make_nvp( "data", base64_detail::encode( v.data(), v.size() * sizeof(eT) ) ) );
+    }
+
+    template<class Archive>
+    void load( Archive & ar )
+    {
+      std::uint64_t n_elem{};
+      std::string dtype, data;
+      ar( cereal::make_nvp( "n_elem", n_elem ),
+          cereal::make_nvp( "dtype", dtype ),
+          cereal::make_nvp( "data", data ) );
+
+      base64_detail::check_dtype<eT>( dtype );
+      v.resize( n_elem );
+      base64_detail::decode( data, v.data(), v.size() * sizeof(eT) );
+    }
+  };
+
+
+  // Convenience functions to make the wrappers, use them instead of the
+  // object itself, e.g. ar( cereal::make_nvp( "A", arma::make_base64( A ) ) )
+  template<class eT> inline
+  Base64Mat<eT> make_base64(Mat<eT>& m)
+  {
+    return {m};
+  }
+
+  template<class eT> inline
+  Base64Mat<eT> make_base64(const Mat<eT>& m)
+  {
+    return {const_cast<Mat<eT>&>(m)};   // only saved
+  }
+
+  template<class eT> inline
+  Base64Vector<eT> make_base64(std::vector<eT>& v)
+  {
+    return {v};
+  }
+
+  template<class eT> inline
+  Base64Vector<eT> make_base64(const std::vector<eT>& v)
+  {
+    return {const_cast<std::vector<eT>&>(v)};   // only saved
+  }
+}
+
+
+// [[Rcpp::export]]
+int main()
+{
+  std::stringstream ss;
+
+  arma::mat A = arma::randu<arma::mat>(4, 5);
+  std::vector<double> w = {1.0, 2.5, -3.75};
+  {
+    cereal::JSONOutputArchive ar(ss);
+    ar( cereal::make_nvp("description", std::string("model weights")),
+        cereal::make_nvp("A", arma::make_base64(A)),
+        cereal::make_nvp("w", arma::make_base64(w)) );
+  }
+  Rcpp::Rcout << ss.str() << std::endl;
+
+  {
+    std::string description;
+    arma::mat A2;
+    std::vector<double> w2;
+    cereal::JSONInputArchive ar(ss);
+    ar( cereal::make_nvp("description", description),
+        cereal::make_nvp("A", arma::make_base64(A2)),
+        cereal::make_nvp("w", arma::make_base64(w2)) );
+
+    Rcpp::Rcout << description << std::endl;
+    A2.print("A after deserialization:");
+    Rcpp::Rcout << "identical: " << arma::approx_equal(A, A2, "absdiff", 0.0)
+                << " " << (w == w2) << std::endl;
+  }
+
+  {
+    // a double matrix can't be loaded as float
+    std::stringstream ss2;
+    {
+      cereal::JSONOutputArchive ar(ss2);
+      ar( cereal::make_nvp("A", arma::make_base64(A)) );
+    }
+    try {
+      arma::fmat F;
+      cereal::JSONInputArchive ar(ss2);
+      ar( cereal::make_nvp("A", arma::make_base64(F)) );
+    } catch (std::exception& e) {
+      Rcpp::Rcout << e.what() << std::endl;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,355 @@
+// Minimal serialization without temporary strings
+// ----------------------------------------------------------
+// save_minimal has to return an arithmetic type or a std::string by value and
+// load_minimal receives a std::string const& (cereal checks this at compile
+// time). For text minimal types (Minimal in SER_06_Serialization_Functions_2,
+// Hello in SER_10_Archive_Serialization_2) every object therefore costs a
+// heap allocation on save, and another one for the std::string cereal loads
+// the value into.
+//
+// Minimal view serialization is an opt-in alternative for the text archives
+// (JSON, XML):
+//
+//   template<class Archive>
+//   std::string_view save_minimal_view(Archive const&, cereal::MinimalBuffer& buf) const;
+//
+//   template<class Archive>
+//   void load_minimal_view(Archive const&, std::string_view value);
+//
+// - save_minimal_view returns a view into the object itself, or formats the
+//   text into buf, a small buffer lent by the archive (64 characters)
+// - load_minimal_view gets a view of the text read by the archive, kept in a
+//   buffer which is reused for every value
+// - CEREAL_MINIMAL_VIEW(Type) registers the type: it tells cereal (via
+//   cereal::specialize, see SER_10_Archive_Serialization_1) to use the view
+//   functions for the JSON and XML archives and writes the value exactly where
+//   cereal writes the value of save_minimal
+// Binary archives keep using the ordinary save_minimal/load_minimal (or
+// serialize) of the type.
+//
+// NOTE:
+// - The output is the same as with save_minimal returning std::string, both
+//   directions can be mixed.
+// - cereal's XML archive formats every value through a std::ostringstream, so
+//   only the JSON archives are free of per-value allocations.
+// - Views containing '\0' are written through a std::string.
+// ----------------------------------------------------------
+// [[Rcpp::plugins("cpp17")]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <cereal/cereal.hpp>
+#include <cereal/access.hpp>
+#include <cereal/specialize.hpp>
+#include <cereal/archives/binary.hpp>
+#include <cereal/archives/json.hpp>
+#include <cereal/archives/xml.hpp>
+#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
+
+#include <Rcpp.h>
+
+
+namespace cereal
+{
+  // Scratch space for the text of one minimal value
+  class MinimalBuffer
+  {
+  public:
+    static constexpr std::size_t capacity = 64;
+
+    MinimalBuffer& append( std::string_view s )
+    {
+      if( s.size() > capacity - itsSize ) {
+        throw Exception( "MinimalBuffer: text longer than " + std::to_string( capacity ) + " characters" );
+      }
+      std::memcpy( itsData + itsSize, s.data(), s.size() );
+      itsSize += s.size();
+      return *this;
+    }
+
+    // Integers and floating point values, formatted with std::to_chars
+    template<class T, traits::EnableIf<std::is_arithmetic<T>::value> = traits::sfinae>
+    MinimalBuffer& append( T value )
+    {
+      const auto res = std::to_chars( itsData + itsSize, itsData + capacity, value );
+      if( res.ec != std::errc() ) {
+        throw Exception( "MinimalBuffer: text longer than " + std::to_string( capacity ) + " characters" );
+      }
+      itsSize = static_cast<std::size_t>( res.ptr - itsData );
+      return *this;
+    }
+
+    std::string_view view() const { return std::string_view( itsData, itsSize ); }
+
+    // NUL terminated copy of v, in place if v lies in this buffer
+    const char* c_str( std::string_view v )
+    {
+      if( v.data() >= itsData && v.data() + v.size() <= itsData + itsSize ) {
+        itsData[v.data() - itsData + v.size()] = '\0';
+        return v.data();
+      }
+      if( v.size() > capacity ) {
+        return nullptr;
+      }
+      std::memcpy( itsData, v.data(), v.size() );
+      itsData[v.size()] = '\0';
+      itsSize = v.size();
+      return itsData;
+    }
+
+  private:
+    char itsData[capacity + 1];
+    std::size_t itsSize = 0;
+  };
+
+
+  namespace minimal_view_detail
+  {
+    // Grows to the longest value of the thread, then stays
+    inline std::string& scratch()
+    {
+      thread_local std::string s;
+      return s;
+    }
+
+    template<class Archive, class T> inline
+    void save( Archive& ar, T const& t )
+    {
+      MinimalBuffer buf;
+      const std::string_view v = t.save_minimal_view( ar, buf );
+
+      if( !v.empty() && std::memchr( v.data(), '\0', v.size() ) != nullptr ) {
+        ar.saveValue( std::string( v ) );
+        return;
+      }
+      const char* s = buf.c_str( v );
+      if( s == nullptr ) {
+        scratch().assign( v.data(), v.size() );
+        s = scratch().c_str();
+      }
+      ar.saveValue( s );
+    }
+
+    template<class Archive, class T> inline
+    void load( Archive& ar, T& t )
+    {
+      std::string& s = scratch();
+      ar.loadValue( s );   // assigns into the existing capacity
+      t.load_minimal_view( ar, std::string_view( s ) );
+    }
+  }
+}
+
+
+// Registers Type for minimal view serialization with the cereal JSON and XML
+// archives. Use it in the global namespace after the definition of Type.
+#define CEREAL_MINIMAL_VIEW( Type )                                                                             \
+  CEREAL_SPECIALIZE_FOR_ARCHIVE( cereal::JSONOutputArchive, Type, cereal::specialization::non_member_load_save ) \
+  CEREAL_SPECIALIZE_FOR_ARCHIVE( cereal::JSONInputArchive, Type, cereal::specialization::non_member_load_save )  \
+  CEREAL_SPECIALIZE_FOR_ARCHIVE( cereal::XMLOutputArchive, Type, cereal::specialization::non_member_load_save )  \
+  CEREAL_SPECIALIZE_FOR_ARCHIVE( cereal::XMLInputArchive, Type, cereal::specialization::non_member_load_save )   \
+  namespace cereal                                                                                              \
+  {                                                                                                             \
+    inline void prologue( JSONOutputArchive& ar, Type const& ) { ar.writeName(); }                              \
+    inline void epilogue( JSONOutputArchive&, Type const& ) { }                                                 \
+    inline void prologue( JSONInputArchive&, Type const& ) { }                                                  \
+    inline void epilogue( JSONInputArchive&, Type const& ) { }                                                  \
+    inline void prologue( XMLOutputArchive& ar, Type const& ) { ar.startNode(); }                               \
+    inline void epilogue( XMLOutputArchive& ar, Type const& ) { ar.finishNode(); }                              \
+    inline void prologue( XMLInputArchive& ar, Type const& ) { ar.startNode(); }                                \
+    inline void epilogue( XMLInputArchive& ar, Type const& ) { ar.finishNode(); }                               \
+                                                                                                                \
+    inline void CEREAL_SAVE_FUNCTION_NAME( JSONOutputArchive& ar, Type const& t ) { minimal_view_detail::save( ar, t ); } \
+    inline void CEREAL_LOAD_FUNCTION_NAME( JSONInputArchive& ar, Type& t ) { minimal_view_detail::load( ar, t ); }        \
+    inline void CEREAL_SAVE_FUNCTION_NAME( XMLOutputArchive& ar, Type const& t ) { minimal_view_detail::save( ar, t ); }  \
+    inline void CEREAL_LOAD_FUNCTION_NAME( XMLInputArchive& ar, Type& t ) { minimal_view_detail::load( ar, t ); }         \
+  }
+
+
+// Minimal from SER_06_Serialization_Functions_2: the view points into the
+// object, loading reuses the capacity of myData
+struct Minimal
+{
+  std::string myData;
+
+  template<class Archive>
+  std::string_view save_minimal_view(Archive const&, cereal::MinimalBuffer&) const
+  {
+    return myData;
+  }
+
+  template<class Archive>
+  void load_minimal_view(Archive const&, std::string_view value)
+  {
+    myData.assign(value.data(), value.size());
+  }
+
+  // binary archives
+  template<class Archive>
+  std::string save_minimal(Archive const&) const
+  {
+    return myData;
+  }
+
+  template<class Archive>
+  void load_minimal(Archive const&, std::string const& value)
+  {
+    myData = value;
+  }
+};
+
+CEREAL_MINIMAL_VIEW(Minimal)
+
+
+// Hello from SER_10_Archive_Serialization_2: the text is formatted into the
+// buffer of the archive
+struct Hello
+{
+  int x;
+
+  // Enabled for text archives (e.g. XML, JSON)
+  template <class Archive,
+            cereal::traits::EnableIf<cereal::traits::is_text_archive<Archive>::value>
+    = cereal::traits::sfinae>
+    std::string_view save_minimal_view( Archive const &, cereal::MinimalBuffer & buf ) const
+    {
+      return buf.append( x ).append( "hello" ).view();
+    }
+
+  // Enabled for text archives (e.g. XML, JSON)
+  template <class Archive,
+            cereal::traits::EnableIf<cereal::traits::is_text_archive<Archive>::value>
+    = cereal::traits::sfinae>
+    void load_minimal_view( Archive const &, std::string_view str )
+    {
+      const auto res = std::from_chars( str.data(), str.data() + std::min<std::size_t>( str.size(), 1 ), x );
+      if( res.ec != std::errc() ) {
+        throw cereal::Exception( "Hello: invalid value \"" + std::string( str ) + "\"" );
+      }
+    }
+
+
+  // Enabled for binary archives (e.g. binary, portable binary)
+  template <class Archive,
+            cereal::traits::DisableIf<cereal::traits::is_text_archive<Archive>::value>
+    = cereal::traits::sfinae>
+    int save_minimal( Archive & ) const
+    {
+      return x;
+    }
+
+  // Enabled for binary archives (e.g. binary, portable binary)
+  template <class Archive,
+            cereal::traits::DisableIf<cereal::traits::is_text_archive<Archive>::value>
+    = cereal::traits::sfinae>
+    void load_minimal( Archive const &, int const & xx )
+    {
+      x = xx;
+    }
+};
+
+CEREAL_MINIMAL_VIEW(Hello)
+
+
+// The same as Minimal, with the std::string interface only
+struct MinimalCopy
+{
+  std::string myData;
+
+  template<class Archive>
+  std::string save_minimal(Archive const&) const
+  {
+    return myData;
+  }
+
+  template<class Archive>
+  void load_minimal(Archive const&, std::string const& value)
+  {
+    myData = value;
+  }
+};
+
+
+// [[Rcpp::export]]
+int main()
+{
+  Minimal m = {"minimal"};
+  Hello h = {7};
+
+  { // the same output as with save_minimal
+    cereal::JSONOutputArchive ar(std::cout);
+    ar(CEREAL_NVP(m), CEREAL_NVP(h));
+  }
+  Rcpp::Rcout << std::endl;
+
+  { // round trip through XML
+    std::stringstream ss;
+    {
+      cereal::XMLOutputArchive ar(ss);
+      ar(CEREAL_NVP(m), CEREAL_NVP(h));
+    }
+    Minimal m2;
+    Hello h2{0};
+    cereal::XMLInputArchive ar(ss);
+    ar(m2, h2);
+    Rcpp::Rcout << "xml: " << m2.myData << " " << h2.x << std::endl;
+  }
+
+  { // many minimal objects, string copies vs. views
+    using clock = std::chrono::steady_clock;
+    const std::size_t n = 1000000;
+    std::vector<Minimal> views(n);
+    std::vector<MinimalCopy> copies(n);
+    for (std::size_t i = 0; i < n; ++i) {
+      views[i].myData = "a minimal value, number " + std::to_string(i);
+      copies[i].myData = views[i].myData;
+    }
+
+    std::ostringstream os1, os2;
+    auto t0 = clock::now();
+    {
+      cereal::JSONOutputArchive ar(os1);
+      ar(CEREAL_NVP(copies));
+    }
+    auto t1 = clock::now();
+    {
+      cereal::JSONOutputArchive ar(os2);
+      ar(CEREAL_NVP(views));
+    }
+    auto t2 = clock::now();
+
+    std::vector<Minimal> views2;
+    std::vector<MinimalCopy> copies2;
+    {
+      std::istringstream is(os1.str());
+      cereal::JSONInputArchive ar(is);
+      ar(cereal::make_nvp("copies", copies2));
+    }
+    auto t3 = clock::now();
+    {
+      std::istringstream is(os2.str());
+      cereal::JSONInputArchive ar(is);
+      ar(cereal::make_nvp("views", views2));
+    }
+    auto t4 = clock::now();
+
+    Rcpp::Rcout << "save, std::string:      " << std::chrono::duration<double>(t1 - t0).count() << " s" << std::endl;
+    Rcpp::Rcout << "save, std::string_view: " << std::chrono::duration<double>(t2 - t1).count() << " s" << std::endl;
+    Rcpp::Rcout << "load, std::string:      " << std::chrono::duration<double>(t3 - t2).count() << " s" << std::endl;
+    Rcpp::Rcout << "load, std::string_view: " << std::chrono::duration<double>(t4 - t3).count() << " s" << std::endl;
+    Rcpp::Rcout << "last: " << views2.back().myData << std::endl;
+  }
+
+  return 0;
+}
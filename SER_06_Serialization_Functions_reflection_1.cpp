@@ -0,0 +1,292 @@
+// Serialization Functions: generated by aggregate reflection
+// ----------------------------------------
+// MyClass (SER_06_Serialization_Functions_1), MyData and MyRecord list every
+// field in their serialize() bodies. Those lists have to be kept in sync with
+// the class by hand, and SER_03_cereal_STL_support_1 shows what a wrong order
+// does to the binary archive.
+//
+// For aggregates (no constructors, all fields public) the fields can be found
+// without naming them:
+// - the number of fields is the largest N for which T{ a1, ..., aN } compiles,
+//   where each ai converts to any type
+// - a structured binding with N names then gives the fields in declaration
+//   order
+// CEREAL_REFLECT(Type) turns this on for Type. cereal then uses generated
+// save/load functions, which pick the way to write the fields at compile time:
+// - native binary archives, trivially copyable, only arithmetic/enum fields
+//   and no padding: the object as one binary_data block (one memcpy), and
+//   std::vector of such records as one block for the whole vector
+// - otherwise field by field, i.e., ar(f0, f1, ...) as written by hand
+// The bytes are the same in all cases, hence hand written serialize()
+// functions and CEREAL_REFLECT can be exchanged without breaking files.
+//
+// Records with padding (MyRecord) are written field by field. The packed
+// block path for them is CEREAL_WIRE_LAYOUT in
+// SER_03_cereal_STL_support_wire_4.cpp, which names the fields in the class
+// body instead of finding them.
+//
+// NOTE:
+// - Up to 15 fields, as for CEREAL_WIRE_LAYOUT. Use std::array instead of C
+//   arrays as fields.
+// - Text archives get the default names value0, value1, ...
+// - Use CEREAL_REFLECT in the global namespace after the definition of Type,
+//   and do not define serialization functions for Type yourself.
+// ----------------------------------------
+// [[Rcpp::plugins("cpp17")]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <sstream>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <cereal/cereal.hpp>
+#include <cereal/archives/binary.hpp>
+#include <cereal/archives/json.hpp>
+#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
+
+#include <Rcpp.h>
+
+
+namespace cereal
+{
+  // Specialized by CEREAL_REFLECT
+  template<class T>
+  struct reflect : std::false_type {};
+
+  namespace reflection_detail
+  {
+    struct any_field
+    {
+      template<class U> constexpr operator U() const noexcept;
+    };
+
+    template<class T, std::size_t... I>
+    auto brace_test( std::index_sequence<I...> ) -> decltype( T{ ( void( I ), any_field{} )... }, std::true_type{} );
+
+    template<class T>
+    std::false_type brace_test( ... );
+
+    constexpr std::size_t max_fields = 16;
+
+    template<class T, std::size_t N = 0>
+    constexpr std::size_t field_count()
+    {
+      if constexpr( N < max_fields && decltype( brace_test<T>( std::make_index_sequence<N + 1>() ) )::value ) {
+        return field_count<T, N + 1>();
+      } else {
+        return N;
+      }
+    }
+
+    // f( field0, field1, ... ), T may be const
+    template<class T, class F> inline
+    decltype(auto) apply_fields( T& t, F&& f )
+    {
+      using U = std::remove_const_t<T>;
+      static_assert( std::is_aggregate<U>::value, "CEREAL_REFLECT: the type has to be an aggregate" );
+      constexpr std::size_t n = field_count<U>();
+      static_assert( n > 0 && n < max_fields, "CEREAL_REFLECT: from 1 to 15 fields are supported" );
+
+      if constexpr( n == 1 ) { auto& [f0] = t; return f( f0 ); }
+      else if constexpr( n == 2 ) { auto& [f0, f1] = t; return f( f0, f1 ); }
+      else if constexpr( n == 3 ) { auto& [f0, f1, f2] = t; return f( f0, f1, f2 ); }
+      else if constexpr( n == 4 ) { auto& [f0, f1, f2, f3] = t; return f( f0, f1, f2, f3 ); }
+      else if constexpr( n == 5 ) { auto& [f0, f1, f2, f3, f4] = t; return f( f0, f1, f2, f3, f4 ); }
+      else if constexpr( n == 6 ) { auto& [f0, f1, f2, f3, f4, f5] = t; return f( f0, f1, f2, f3, f4, f5 ); }
+      else if constexpr( n == 7 ) { auto& [f0, f1, f2, f3, f4, f5, f6] = t; return f( f0, f1, f2, f3, f4, f5, f6 ); }
+      else if constexpr( n == 8 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7] = t; return f( f0, f1, f2, f3, f4, f5, f6, f7 ); }
+      else if constexpr( n == 9 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8] = t; return f( f0, f1, f2, f3, f4, f5, f6, f7, f8 ); }
+      else if constexpr( n == 10 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9] = t; return f( f0, f1, f2, f3, f4, f5, f6, f7, f8, f9 ); }
+      else if constexpr( n == 11 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10] = t; return f( f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10 ); }
+      else if constexpr( n == 12 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11] = t; return f( f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11 ); }
+      else if constexpr( n == 13 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12] = t; return f( f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12 ); }
+      else if constexpr( n == 14 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13] = t; return f( f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13 ); }
+      else if constexpr( n == 15 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14] = t; return f( f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14 ); }
+    }
+
+    // Field types as seen by a structured binding, without cv and references
+    template<class... F>
+    struct field_types
+    {
+      static constexpr bool scalar = ( ( std::is_arithmetic<F>::value || std::is_enum<F>::value ) && ... );
+      static constexpr std::size_t size = ( sizeof( F ) + ... + 0 );
+    };
+
+    struct collect_field_types
+    {
+      template<class... F>
+      field_types<std::remove_cv_t<F>...> operator()( F&... ) const { return {}; }
+    };
+
+    template<class T>
+    using fields_of = decltype( apply_fields( std::declval<T&>(), collect_field_types{} ) );
+
+    // The object is its own wire format: native binary archive, trivially
+    // copyable, scalar fields only and no padding
+    template<class Archive, class T>
+    constexpr bool bulk()
+    {
+      if constexpr( ( std::is_same<Archive, BinaryOutputArchive>::value || std::is_same<Archive, BinaryInputArchive>::value ) &&
+                    std::is_trivially_copyable<T>::value ) {
+        using fields = fields_of<T>;
+        return fields::scalar && fields::size == sizeof( T );
+      } else {
+        return false;
+      }
+    }
+
+    template<class Archive, class T, bool = reflect<T>::value>
+    struct bulk_vector : std::false_type {};
+
+    template<class Archive, class T>
+    struct bulk_vector<Archive, T, true> : std::integral_constant<bool, bulk<Archive, T>()> {};
+  }
+
+
+  template<class Archive, class T> inline
+  typename std::enable_if<reflect<T>::value, void>::type
+  CEREAL_SAVE_FUNCTION_NAME( Archive& ar, T const& t )
+  {
+    if constexpr( reflection_detail::bulk<Archive, T>() ) {
+      ar( binary_data( &t, sizeof( T ) ) );
+    } else {
+      reflection_detail::apply_fields( t, [&ar]( auto const&... f ) { ar( f... ); } );
+    }
+  }
+
+  template<class Archive, class T> inline
+  typename std::enable_if<reflect<T>::value, void>::type
+  CEREAL_LOAD_FUNCTION_NAME( Archive& ar, T& t )
+  {
+    if constexpr( reflection_detail::bulk<Archive, T>() ) {
+      ar( binary_data( &t, sizeof( T ) ) );
+    } else {
+      reflection_detail::apply_fields( t, [&ar]( auto&... f ) { ar( f... ); } );
+    }
+  }
+
+  // std::vector of records without padding as one block, more specialized
+  // than the overloads of cereal/types/vector.hpp (default allocator)
+  template<class Archive, class T> inline
+  typename std::enable_if<reflection_detail::bulk_vector<Archive, T>::value, void>::type
+  CEREAL_SAVE_FUNCTION_NAME( Archive& ar, std::vector<T> const& vector )
+  {
+    ar( make_size_tag( static_cast<size_type>( vector.size() ) ) );
+    ar( binary_data( vector.data(), vector.size() * sizeof( T ) ) );
+  }
+
+  template<class Archive, class T> inline
+  typename std::enable_if<reflection_detail::bulk_vector<Archive, T>::value, void>::type
+  CEREAL_LOAD_FUNCTION_NAME( Archive& ar, std::vector<T>& vector )
+  {
+    size_type size;
+    ar( make_size_tag( size ) );
+    vector.resize( static_cast<std::size_t>( size ) );
+    ar( binary_data( vector.data(), vector.size() * sizeof( T ) ) );
+  }
+}
+
+
+// Generated serialization for the aggregate Type
+#define CEREAL_REFLECT( Type )                            \
+  namespace cereal                                        \
+  {                                                       \
+    template<> struct reflect<Type> : std::true_type {};  \
+  }
+
+
+// MyClass from SER_06_Serialization_Functions_1, MyData from SER_01 and
+// MyRecord from SER_03_cereal_STL_support_4, without serialize()
+struct MyClass
+{
+  int x, y, z;
+};
+
+struct MyData
+{
+  int x, y, z;
+};
+
+// 2 bytes padding before z, written field by field
+struct MyRecord
+{
+  uint8_t x, y;
+  float z;
+};
+
+// not trivially copyable, written field by field
+struct Employee
+{
+  std::string name;
+  int age;
+  std::vector<MyRecord> history;
+};
+
+CEREAL_REFLECT(MyClass)
+CEREAL_REFLECT(MyData)
+CEREAL_REFLECT(MyRecord)
+CEREAL_REFLECT(Employee)
+
+
+// MyData as before, for comparison
+struct MyDataByHand
+{
+  int x, y, z;
+
+  template<class Archive>
+  void serialize(Archive& ar)
+  {
+    ar(x, y, z);
+  }
+};
+
+
+// [[Rcpp::export]]
+int main()
+{
+  { // text archives: field by field, default names
+    MyClass c{1, 2, 3};
+    Employee e{"Hans", 21, { {1, 2, 0.5f}, {3, 4, 1.5f} }};
+    cereal::JSONOutputArchive ar(std::cout);
+    ar(CEREAL_NVP(c), CEREAL_NVP(e));
+  }
+  Rcpp::Rcout << std::endl;
+
+  { // binary round trip of a non trivial aggregate
+    std::stringstream ss;
+    {
+      cereal::BinaryOutputArchive ar(ss);
+      ar(Employee{"Juergen", 56, { {5, 6, 2.5f} }}, MyData{40, 41, 42});
+    }
+    Employee e;
+    MyData d;
+    cereal::BinaryInputArchive ar(ss);
+    ar(e, d);
+    Rcpp::Rcout << e.name << " " << e.age << " " << e.history[0].z
+                << ", MyData: " << d.x << " " << d.y << " " << d.z << std::endl;
+  }
+
+  { // std::vector<MyData> in one block, the same bytes as the hand written one
+    std::vector<MyData> generated{ {1, 2, 3}, {4, 5, 6} };
+    std::vector<MyDataByHand> by_hand{ {1, 2, 3}, {4, 5, 6} };
+    std::stringstream s1, s2;
+    {
+      cereal::BinaryOutputArchive ar1(s1);
+      ar1(generated);
+      cereal::BinaryOutputArchive ar2(s2);
+      ar2(by_hand);
+    }
+    Rcpp::Rcout << "same bytes: " << (s1.str() == s2.str()) << std::endl;
+
+    std::vector<MyData> back;
+    cereal::BinaryInputArchive ar(s2);
+    ar(back);
+    Rcpp::Rcout << "back: " << back[1].x << " " << back[1].y << " " << back[1].z << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,214 @@
+// Specializing the archive: std::map<std::string, std::string>
+// -------------------------------------------------------------------
+// SER_10_Archive_Serialization_1 writes a string map to text archives as one
+// NVP per entry, i.e., every entry passes through the generic machinery
+// twice (NVP, then the value). For configuration snapshots with hundreds of
+// thousands of keys this per entry overhead dominates.
+//
+// The overloads below are specialized for the JSON and XML archives and talk
+// to the archive directly:
+// - saving sets the key as the name of the next member/element and writes the
+//   value, there are no NVP objects and no nested process() calls
+// - loading reads the member/element names with getNodeName() and loads each
+//   value straight into its node of the map
+// - the document lists the keys in the order of the map, hence every new key
+//   belongs at the end: emplace_hint(map.end(), ...) inserts in amortized
+//   constant time (hinting with the previously inserted node, as often seen,
+//   costs a full search per key in sorted input)
+//
+// The layout is the one of SER_10: {"key": "value", ...} in JSON and
+// <key>value</key> in XML.
+//
+// NOTE:
+// - Keys have to be valid XML element names when using the XML archive.
+// - For duplicate keys in hand edited documents the last value wins.
+// -------------------------------------------------------------------
+// [[Rcpp::plugins("cpp17")]]
+// [[Rcpp::depends(Rcereal)]]
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <map>
+#include <string>
+#include <tuple>
+#include <utility>
+
+#include <cereal/cereal.hpp>
+#include <cereal/archives/json.hpp>
+#include <cereal/archives/xml.hpp>
+#include <cereal/types/string.hpp>
+
+#include <Rcpp.h>
+
+
+// Specializing the archive
+// ---------------------------
+namespace cereal
+{
+  namespace stringmap_detail
+  {
+    // Node for key at the end of the map, value left empty
+    template<class C, class A> inline
+    std::string& append( std::map<std::string, std::string, C, A>& map, const char* key )
+    {
+      return map.emplace_hint( map.end(), std::piecewise_construct,
+                               std::forward_as_tuple( key ), std::forward_as_tuple() )->second;
+    }
+  }
+
+  template<class C, class A> inline
+  void CEREAL_SAVE_FUNCTION_NAME( JSONOutputArchive& ar, std::map<std::string, std::string, C, A> const& map )
+  {
+    for( auto const& kv : map ) {
+      ar.setNextName( kv.first.c_str() );
+      ar.writeName();
+      ar.saveValue( kv.second );
+    }
+  }
+
+  template<class C, class A> inline
+  void CEREAL_LOAD_FUNCTION_NAME( JSONInputArchive& ar, std::map<std::string, std::string, C, A>& map )
+  {
+    map.clear();
+    for( const char* key = ar.getNodeName(); key != nullptr; key = ar.getNodeName() ) {
+      ar.loadValue( stringmap_detail::append( map, key ) );
+    }
+  }
+
+  template<class C, class A> inline
+  void CEREAL_SAVE_FUNCTION_NAME( XMLOutputArchive& ar, std::map<std::string, std::string, C, A> const& map )
+  {
+    for( auto const& kv : map ) {
+      ar.setNextName( kv.first.c_str() );
+      ar.startNode();
+      ar.saveValue( kv.second );
+      ar.finishNode();
+    }
+  }
+
+  template<class C, class A> inline
+  void CEREAL_LOAD_FUNCTION_NAME( XMLInputArchive& ar, std::map<std::string, std::string, C, A>& map )
+  {
+    map.clear();
+    for( const char* key = ar.getNodeName(); key != nullptr; key = ar.getNodeName() ) {
+      std::string& value = stringmap_detail::append( map, key );
+      ar.startNode();
+      ar.loadValue( value );
+      ar.finishNode();
+    }
+  }
+}
+
+
+// The SER_10 way, one NVP per entry, for comparison
+struct NVPMap
+{
+  std::map<std::string, std::string> map;
+
+  template<class Archive>
+  void save(Archive& ar) const
+  {
+    for (const auto& i: map)
+    {
+      ar(cereal::make_nvp(i.first, i.second));
+    }
+  }
+
+  template<class Archive>
+  void load(Archive& ar)
+  {
+    map.clear();
+    auto hint = map.begin();
+    while (const char* namePtr = ar.getNodeName())
+    {
+      std::string key = namePtr;
+      std::string value;
+      ar(value);
+      hint = map.emplace_hint(hint, std::move(key), std::move(value));
+    }
+  }
+};
+
+
+// [[Rcpp::export]]
+int main()
+{
+  std::map<std::string, std::string> config;
+  for (int i = 0; i < 300000; ++i) {
+    config.emplace("key_" + std::to_string(i), "value of setting " + std::to_string(i));
+  }
+  NVPMap nvp_config{config};
+
+  using clock = std::chrono::steady_clock;
+  auto seconds = [](clock::time_point a, clock::time_point b) {
+    return std::chrono::duration<double>(b - a).count();
+  };
+
+  { // JSON
+    std::stringstream ss1, ss2;
+    auto t0 = clock::now();
+    {
+      cereal::JSONOutputArchive ar(ss1);
+      ar(cereal::make_nvp("config", nvp_config));
+    }
+    auto t1 = clock::now();
+    {
+      cereal::JSONOutputArchive ar(ss2);
+      ar(CEREAL_NVP(config));
+    }
+    auto t2 = clock::now();
+
+    NVPMap nvp_loaded;
+    std::map<std::string, std::string> loaded;
+    {
+      cereal::JSONInputArchive ar(ss1);
+      ar(cereal::make_nvp("config", nvp_loaded));
+    }
+    auto t3 = clock::now();
+    {
+      cereal::JSONInputArchive ar(ss2);
+      ar(cereal::make_nvp("config", loaded));
+    }
+    auto t4 = clock::now();
+
+    Rcpp::Rcout << "JSON save, NVP per entry: " << seconds(t0, t1) << " s, specialized: " << seconds(t1, t2) << " s" << std::endl;
+    Rcpp::Rcout << "JSON load, NVP per entry: " << seconds(t2, t3) << " s, specialized: " << seconds(t3, t4) << " s" << std::endl;
+    Rcpp::Rcout << "same document: " << (ss1.str() == ss2.str())
+                << ", same map: " << (loaded == config && nvp_loaded.map == config) << std::endl;
+  }
+
+  { // XML
+    std::stringstream ss1, ss2;
+    auto t0 = clock::now();
+    {
+      cereal::XMLOutputArchive ar(ss1);
+      ar(cereal::make_nvp("config", nvp_config));
+    }
+    auto t1 = clock::now();
+    {
+      cereal::XMLOutputArchive ar(ss2);
+      ar(CEREAL_NVP(config));
+    }
+    auto t2 = clock::now();
+
+    NVPMap nvp_loaded;
+    std::map<std::string, std::string> loaded;
+    {
+      cereal::XMLInputArchive ar(ss1);
+      ar(cereal::make_nvp("config", nvp_loaded));
+    }
+    auto t3 = clock::now();
+    {
+      cereal::XMLInputArchive ar(ss2);
+      ar(cereal::make_nvp("config", loaded));
+    }
+    auto t4 = clock::now();
+
+    Rcpp::Rcout << "XML save,  NVP per entry: " << seconds(t0, t1) << " s, specialized: " << seconds(t1, t2) << " s" << std::endl;
+    Rcpp::Rcout << "XML load,  NVP per entry: " << seconds(t2, t3) << " s, specialized: " << seconds(t3, t4) << " s" << std::endl;
+    Rcpp::Rcout << "same document: " << (ss1.str() == ss2.str())
+                << ", same map: " << (loaded == config && nvp_loaded.map == config) << std::endl;
+  }
+
+  return 0;
+}